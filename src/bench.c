@@ -0,0 +1,337 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Micro-benchmarks of the firmware's numeric kernels: the filters,
+ * the PID controller, the triac firing delay, curve evaluation, the
+ * RTD conversion and the console's number conversions.
+ *
+ * Each kernel is called repeatedly, on inputs taken in turn from a
+ * table prepared beforehand, and the time per call is printed as a
+ * comma-separated table, one kernel per line.  The same program is
+ * also built for the MCU, with the firmware's flags, i.e. with soft
+ * floating point, to be run under an emulator that counts the
+ * instructions executed.  Since the preparation doesn't depend on the
+ * number of calls, the count per call is the difference between a
+ * run of N calls and a run of none, over N.  See the Makefile's
+ * benchmark target. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "callbacks.h"
+#include "curve.h"
+#include "format.h"
+#include "health.h"
+#include "peripherals.h"
+#include "sensors.h"
+
+/* The number of prepared inputs.  Large enough for curve evaluation
+ * to sweep the stage gradually, as in a shot. */
+
+#define INPUTS 4096
+#define POINTS 16
+
+/* The firmware's interface to the hardware, reduced to what the
+ * drivers need to link. */
+
+struct health health[SENSORS];
+struct filter temperature_filter;
+
+void process_temperature_sample(double T, uint16_t c)
+{
+}
+
+double get_time(void)
+{
+    return 0;
+}
+
+void delay_us(int32_t n)
+{
+}
+
+int is_usb_dtr(void)
+{
+    return 0;
+}
+
+int uprintf(const char *format, ...)
+{
+    return 0;
+}
+
+/* Formatted numbers are counted, but otherwise discarded. */
+
+static int written;
+
+int write_usb(const char *s, int n, bool flush)
+{
+    written += n;
+
+    return n;
+}
+
+void _uassert(const char *msg, int line, const char *func)
+{
+    fprintf(stderr, msg, line, func);
+    abort();
+}
+
+static struct {
+    double u[INPUTS], x[INPUTS];
+    uint16_t codes[INPUTS];
+    char strings[INPUTS][16];
+
+    double points[POINTS][4];
+    struct curve curve;
+} inputs;
+
+/* Keeps the results of the kernels alive. */
+
+static volatile double sink;
+
+static void prepare(void)
+{
+    const double A = 3.9083e-3;
+    const double B = -5.775e-7;
+
+    uint32_t seed = 1;
+
+    /* The inputs are drawn with a generator of our own, so that
+     * they're the same on the host and the MCU. */
+
+    for (int i = 0; i < INPUTS; i++) {
+        seed = seed * 1664525 + 1013904223;
+
+        const double u = ldexp(seed, -32);
+
+        inputs.u[i] = u;
+
+        /* RTD codes for 20-130C, for a PT100 and a reference
+         * resistance of 430Ohm. */
+
+        const double T = 20 + 110 * u;
+        const double R = 100 * (1 + A * T + B * T * T);
+
+        inputs.codes[i] = (uint16_t)lround(ldexp(R / 430, 15)) << 1;
+
+        /* Numbers as they're given in commands. */
+
+        snprintf(inputs.strings[i], sizeof(inputs.strings[i]),
+                 "%.3f", 200 * u - 100);
+    }
+
+    /* A stage of relative input and ratiometric output, the most
+     * expensive combination, with an input that sweeps across it,
+     * with some noise, as in curve.c's test. */
+
+    for (int i = 0; i < POINTS; i++) {
+        inputs.points[i][0] = i + inputs.u[i];
+        inputs.points[i][1] = 10 * inputs.u[POINTS + i];
+    }
+
+    for (int i = 0; i < INPUTS; i++) {
+        inputs.x[i] = 3 + (inputs.points[0][0]
+                           + ((inputs.points[POINTS - 1][0]
+                               - inputs.points[0][0]) * i / INPUTS)
+                           + 0.01 * inputs.u[i]);
+    }
+
+    compile_curve(&inputs.curve, inputs.points, POINTS,
+                  RELATIVE, 3, RATIOMETRIC, 1.5);
+}
+
+/* The kernels, each called n times. */
+
+static void run_single_filter(int n)
+{
+    struct filter f = SINGLE_FILTER(0.03);
+
+    for (int i = 0; i < n; i++) {
+        filter_sample_dt(&f, inputs.u[i % INPUTS],
+                         0.01 + 1e-3 * inputs.u[(i + 1) % INPUTS]);
+    }
+
+    sink = f.y;
+}
+
+static void run_double_filter(int n)
+{
+    struct filter f = DOUBLE_FILTER(0.12, 60.0);
+
+    for (int i = 0; i < n; i++) {
+        filter_sample_dt(&f, inputs.u[i % INPUTS],
+                         0.01 + 1e-3 * inputs.u[(i + 1) % INPUTS]);
+    }
+
+    sink = f.y;
+}
+
+static void run_pid(int n)
+{
+    /* The pressure controller's gains. */
+
+    struct pid pid = {0.12, 0.75, 0.1875, 9, 0};
+    double y = 0;
+
+    for (int i = 0; i < n; i++) {
+        y += calculate_pid_output(
+            &pid, 9 * inputs.u[i % INPUTS], inputs.u[(i + 1) % INPUTS] - 0.5,
+            0.01);
+    }
+
+    sink = y;
+}
+
+static void run_delay(int n)
+{
+    double y = 0;
+
+    for (int i = 0; i < n; i++) {
+        y += calculate_delay(inputs.u[i % INPUTS]);
+    }
+
+    sink = y;
+}
+
+static void run_curve(int n)
+{
+    double y = 0, z;
+
+    inputs.curve.cursor = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (evaluate_curve(&inputs.curve, inputs.x[i % INPUTS], &z)) {
+            y += z;
+        }
+    }
+
+    sink = y;
+}
+
+static void run_rtd(int n)
+{
+    double y = 0;
+
+    for (int i = 0; i < n; i++) {
+        y += calibrate_temperature(inputs.codes[i % INPUTS]);
+    }
+
+    sink = y;
+}
+
+static void run_ftostr(int n)
+{
+    for (int i = 0; i < n; i++) {
+        ftostr(200 * inputs.u[i % INPUTS] - 100, 0, 3);
+    }
+
+    sink = written;
+}
+
+static void run_strtod(int n)
+{
+    double y = 0;
+
+    for (int i = 0; i < n; i++) {
+        y += strtod(inputs.strings[i % INPUTS], NULL);
+    }
+
+    sink = y;
+}
+
+static const struct {
+    const char *name;
+    void (*run)(int n);
+} kernels[] = {
+    {"filter_sample_dt/single", run_single_filter},
+    {"filter_sample_dt/double", run_double_filter},
+    {"calculate_pid_output", run_pid},
+    {"calculate_delay", run_delay},
+    {"evaluate_curve", run_curve},
+    {"calibrate_temperature", run_rtd},
+    {"ftostr", run_ftostr},
+    {"strtod", run_strtod},
+};
+
+#define N_KERNELS ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+static void run(int k, int n)
+{
+    const clock_t t_0 = clock();
+
+    kernels[k].run(n);
+
+    const clock_t t_1 = clock();
+
+    printf("%s, %d, %.1f\n", kernels[k].name, n,
+           n > 0 ? (double)(t_1 - t_0) / CLOCKS_PER_SEC / n * 1e9 : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, n = 1000000;
+
+    while ((opt = getopt(argc, argv, "ln:")) != -1) {
+        switch (opt) {
+        case 'l':
+            for (int k = 0; k < N_KERNELS; k++) {
+                printf("%s\n", kernels[k].name);
+            }
+
+            return 0;
+        case 'n':
+            n = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-l] [-n CALLS] [KERNEL...]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        int k;
+
+        for (k = 0; k < N_KERNELS && strcmp(argv[i], kernels[k].name); k++);
+
+        if (k == N_KERNELS) {
+            fprintf(stderr, "%s: unknown kernel %s\n", argv[0], argv[i]);
+            return 1;
+        }
+    }
+
+    prepare();
+    printf("# kernel, calls, ns/call\n");
+
+    for (int k = 0; k < N_KERNELS; k++) {
+        bool selected = optind == argc;
+
+        for (int i = optind; i < argc && !selected; i++) {
+            selected = !strcmp(argv[i], kernels[k].name);
+        }
+
+        if (selected) {
+            run(k, n);
+        }
+    }
+
+    return 0;
+}
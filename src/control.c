@@ -0,0 +1,168 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+
+#include "callbacks.h"
+#include "jitter.h"
+#include "peripherals.h"
+#include "pid.h"
+
+/* The controllers, run on each sample of their process variable,
+ * whenever they have a set-point.  A sample that arrives after a gap
+ * long enough to make it stale (see jitter.c) is only used for the
+ * proportional term, holding the integral, as neither integrating
+ * the error, nor differentiating the process variable over the gap
+ * is meaningful. */
+
+#define K_U 0.125
+#define P_U 16.5
+
+struct pid temperature_pid = {0.6 * K_U, 0.5 * P_U, 0.125 * P_U, NAN};
+
+#undef K_U
+#undef P_U
+
+#define K_U 0.2
+#define P_U 1.5
+
+struct pid pressure_pid = {0.6 * K_U, 0.5 * P_U, 0.125 * P_U, NAN};
+
+#undef K_U
+#undef P_U
+
+#define K_U 0.24
+#define P_U 0.6
+
+struct pid flow_pid = {K_U / 3, 0.5 * P_U, P_U / 3, NAN};
+
+#undef K_U
+#undef P_U
+
+/* The yield rate responds to the pump much more sluggishly than the
+ * flow, as the water needs to go through the puck and drip into the
+ * cup first. */
+
+#define K_U 0.1
+#define P_U 3
+
+struct pid mass_rate_pid = {K_U / 3, 0.5 * P_U, P_U / 3, NAN};
+
+#undef K_U
+#undef P_U
+
+static bool temperature_pid_callback(
+    double T, double dT, double t, double dt, double T_raw, uint16_t c)
+{
+    const enum freshness f = sample_loop(TEMPERATURE_LOOP, t);
+
+    if (isnan(temperature_pid.set) || isnan(dt)) {
+        return false;
+    }
+
+    uassert(dt > 0);
+
+    drive_actuator(HEATER, TEMPERATURE_LOOP, t);
+    set_heat_power(
+        isnan(T) || isnan(dT)
+        ? 0
+        : (f == STALE
+           ? hold_pid_output(&temperature_pid, T)
+           : calculate_pid_output(&temperature_pid, T, dT, dt)));
+
+    return false;
+}
+
+static bool pressure_pid_callback(
+    double P, double dP, double t, double dt, double P_raw, uint16_t c)
+{
+    const enum freshness f = sample_loop(PRESSURE_LOOP, t);
+
+    if (isnan(pressure_pid.set) || isnan(dt)) {
+        return false;
+    }
+
+    uassert(dt > 0);
+
+    drive_actuator(PUMP, PRESSURE_LOOP, t);
+    set_pump_flow(
+        isnan(P) || isnan(dP)
+        ? 0
+        : fmax(0.01, (
+                   f == STALE
+                   ? hold_pid_output(&pressure_pid, P)
+                   : calculate_pid_output(&pressure_pid, P, dP, dt))));
+
+    return false;
+}
+
+static bool flow_pid_callback(
+    double Q, double dQ, double t, double dt,  double V, double raw, uint32_t n)
+{
+    const enum freshness f = sample_loop(FLOW_LOOP, t);
+
+    if (isnan(flow_pid.set) || isnan(dt)) {
+        return false;
+    }
+
+    uassert(dt > 0);
+
+    drive_actuator(PUMP, FLOW_LOOP, t);
+    set_pump_flow(
+        isnan(Q) || isnan(dQ)
+        ? 0
+        : fmax(0.01, (
+                   f == STALE
+                   ? hold_pid_output(&flow_pid, Q)
+                   : calculate_pid_output(&flow_pid, Q, dQ, dt))));
+
+    return false;
+}
+
+static bool mass_rate_pid_callback(
+    double m, double dm, double t, double dt, double m_raw, int32_t c)
+{
+    const enum freshness f = sample_loop(MASS_RATE_LOOP, t);
+
+    if (isnan(mass_rate_pid.set) || isnan(mass_rate_filter.dt)) {
+        return false;
+    }
+
+    const double Q = mass_rate_filter.y;
+    const double dQ = mass_rate_filter.dy;
+
+    uassert(mass_rate_filter.dt > 0);
+
+    drive_actuator(PUMP, MASS_RATE_LOOP, t);
+    set_pump_flow(
+        isnan(Q) || isnan(dQ)
+        ? 0
+        : fmax(0.01, (
+                   f == STALE
+                   ? hold_pid_output(&mass_rate_pid, Q)
+                   : calculate_pid_output(
+                       &mass_rate_pid, Q, dQ, mass_rate_filter.dt))));
+
+    return false;
+}
+
+void reset_control(void)
+{
+    add_callback(temperature_pid_callback, temperature_callbacks);
+    add_callback(pressure_pid_callback, pressure_callbacks);
+    add_callback(flow_pid_callback, flow_callbacks);
+    add_callback(mass_rate_pid_callback, mass_callbacks);
+}
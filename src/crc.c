@@ -0,0 +1,60 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "crc.h"
+
+/* CRC-32, as used by zlib etc., calculated a nibble at a time, to
+ * keep the table small.  Pass 0 as the initial crc. */
+
+uint32_t crc32(uint32_t crc, const void *data, size_t n)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+
+    const uint8_t *p = data;
+
+    crc = ~crc;
+
+    for (size_t i = 0; i < n; i++) {
+        crc = (crc >> 4) ^ table[(crc ^ p[i]) & 0xf];
+        crc = (crc >> 4) ^ table[(crc ^ (p[i] >> 4)) & 0xf];
+    }
+
+    return ~crc;
+}
+
+#ifdef TEST
+#include <stdio.h>
+
+int main(void)
+{
+    const char s[] = "123456789";
+    const uint32_t c = crc32(0, s, sizeof(s) - 1);
+
+    /* The standard check value, then the same, in two parts. */
+
+    printf("CRC-32 of \"%s\": %08x (%s)\n", s, c,
+           c == 0xcbf43926 ? "correct" : "INCORRECT");
+    printf("Incremental: %08x (%s)\n", crc32(crc32(0, s, 4), s + 4, 5),
+           crc32(crc32(0, s, 4), s + 4, 5) == c ? "correct" : "INCORRECT");
+
+    return c != 0xcbf43926;
+}
+#endif
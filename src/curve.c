@@ -0,0 +1,318 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+
+#include "curve.h"
+
+/* Compile a stage of n points, the coordinates of which have been
+ * placed in the compiled array, by deriving the coefficients of
+ * the segments and folding in the adjustments.  The input is
+ * adjusted as x - r, or x / r, for relative and ratiometric modes
+ * respectively, and the output as y + r, or y r.  Both can be
+ * folded into the points' coordinates and coefficients, since the
+ * references are fixed for the duration of the stage. */
+
+void compile_curve(struct curve *c, double (*compiled)[4], size_t n,
+                   enum mode input_mode, double input_reference,
+                   enum mode output_mode, double output_reference)
+{
+    for (size_t i = 0; i < n; i++) {
+        double *Q = compiled[i];
+
+        if (i + 1 < n) {
+            const double h = compiled[i + 1][0] - Q[0];
+            const double d = (compiled[i + 1][1] - Q[1]) / h / h;
+
+            Q[2] = 3 * d;
+            Q[3] = -2 * d / h;
+        } else {
+            Q[2] = Q[3] = 0;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        double *Q = compiled[i];
+
+        switch (input_mode) {
+        case ABSOLUTE:
+            break;
+        case RELATIVE:
+            Q[0] += input_reference;
+            break;
+        case RATIOMETRIC:
+            Q[0] *= input_reference;
+            Q[2] /= input_reference * input_reference;
+            Q[3] /= input_reference * input_reference * input_reference;
+            break;
+        }
+
+        switch (output_mode) {
+        case ABSOLUTE:
+            break;
+        case RELATIVE:
+            Q[1] += output_reference;
+            break;
+        case RATIOMETRIC:
+            Q[1] *= output_reference;
+            Q[2] *= output_reference;
+            Q[3] *= output_reference;
+            break;
+        }
+    }
+
+    c->points = compiled;
+    c->size = n;
+    c->cursor = 0;
+
+    /* A negative ratiometric reference reverses the direction of
+     * the input. */
+
+    c->increasing = compiled[0][0] < compiled[1][0];
+}
+
+/* Evaluate the curve at x, returning false if x is past its end.  The
+ * cursor moves from the previous tick's segment, so that, with an
+ * input that changes slowly, as it generally does, only a step or
+ * two is needed. */
+
+bool evaluate_curve(struct curve *c, double x, double *y)
+{
+    double (*P)[4] = c->points;
+    size_t i = c->cursor;
+
+#define PAST(X_0) (c->increasing ? (X_0) <= x : (X_0) >= x)
+
+    while (i + 1 < c->size && PAST(P[i + 1][0])) {
+        i++;
+    }
+
+    while (i > 0 && !PAST(P[i][0])) {
+        i--;
+    }
+
+#undef PAST
+
+    c->cursor = i;
+
+    if (i + 1 == c->size) {
+        return false;
+    }
+
+    const double s = x - P[i][0];
+
+    *y = P[i][1] + s * s * (P[i][2] + s * P[i][3]);
+
+    return true;
+}
+
+#ifdef TEST
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The profile executor's previous approach: adjust the input, scan
+ * the segments from the start, evaluate, then adjust the output. */
+
+static void adjust_value(
+    double *x, double reference, const enum mode mode, const bool output)
+{
+    switch (mode) {
+    case ABSOLUTE:
+        break;
+    case RELATIVE:
+        if (output) {
+            *x += reference;
+        } else {
+            *x -= reference;
+        }
+        break;
+    case RATIOMETRIC:
+        if (output) {
+            *x *= reference;
+        } else {
+            *x /= reference;
+        }
+        break;
+    }
+}
+
+static bool evaluate_reference(
+    double (*P)[4], size_t n, double x, double *y,
+    enum mode input_mode, double input_reference,
+    enum mode output_mode, double output_reference)
+{
+    size_t i;
+
+    adjust_value(&x, input_reference, input_mode, false);
+
+    const bool p = P[0][0] < P[1][0];
+    for (i = 0; (i + 1 < n && (p ? P[i + 1][0] <= x : P[i + 1][0] >= x)); i++);
+
+    if (i + 1 == n) {
+        return false;
+    }
+
+    const double s = x - P[i][0];
+
+    *y = P[i][1] + s * s * (P[i][2] + s * P[i][3]);
+    adjust_value(y, output_reference, output_mode, true);
+
+    return true;
+}
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, n = 32, ticks = 1000000;
+
+    while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 't':
+            ticks = atoi(optarg);
+            break;
+        default:
+            return 1;
+        }
+    }
+
+    assert(n >= 2);
+
+    double (*P)[4] = calloc(n, sizeof(double[4]));
+    double (*compiled)[4] = calloc(n, sizeof(double[4]));
+    double *x = calloc(ticks, sizeof(double));
+    double *y[2] = {calloc(ticks, sizeof(double)), calloc(ticks, sizeof(double))};
+    bool *f[2] = {calloc(ticks, sizeof(bool)), calloc(ticks, sizeof(bool))};
+
+    assert(P && compiled && x && y[0] && y[1] && f[0] && f[1]);
+
+    /* A profile of n points, with increasing input and a relative
+     * input and ratiometric output, the most expensive combination
+     * of adjustments.  The coordinates are given with two decimals
+     * and parsed, as in a profile, and also stored in fixed point,
+     * as the profile reader does. */
+
+    int16_t (*Z)[2] = calloc(n, sizeof(int16_t[2]));
+    assert(Z);
+
+    for (int i = 0; i < n; i++) {
+        char s[16];
+
+        snprintf(s, sizeof(s), "%.2f", i + (double)rand() / RAND_MAX);
+        P[i][0] = strtod(s, NULL);
+        snprintf(s, sizeof(s), "%.2f", 10.0 * rand() / RAND_MAX);
+        P[i][1] = strtod(s, NULL);
+
+        for (int j = 0; j < 2; j++) {
+            Z[i][j] = (int16_t)lround(P[i][j] * POINT_SCALE);
+        }
+    }
+
+    for (int i = 0; i + 1 < n; i++) {
+        const double h = P[i + 1][0] - P[i][0];
+        const double d = (P[i + 1][1] - P[i][1]) / h / h;
+
+        P[i][2] = 3 * d;
+        P[i][3] = -2 * d / h;
+    }
+
+    const double r_x = 3, r_y = 1.5;
+
+    /* An input that sweeps across the whole stage, with some noise,
+     * so that it occasionally steps back. */
+
+    for (int k = 0; k < ticks; k++) {
+        x[k] = r_x + (P[0][0] + (P[n - 1][0] - P[0][0]) * k / ticks
+                      + 0.01 * rand() / RAND_MAX);
+    }
+
+    double t_0 = now();
+
+    for (int k = 0; k < ticks; k++) {
+        f[0][k] = evaluate_reference(
+            P, n, x[k], &y[0][k], RELATIVE, r_x, RATIOMETRIC, r_y);
+    }
+
+    double t_1 = now();
+    struct curve c;
+
+    for (int i = 0; i < n; i++) {
+        compiled[i][0] = (double)Z[i][0] / POINT_SCALE;
+        compiled[i][1] = (double)Z[i][1] / POINT_SCALE;
+    }
+
+    compile_curve(&c, compiled, n, RELATIVE, r_x, RATIOMETRIC, r_y);
+
+    for (int k = 0; k < ticks; k++) {
+        f[1][k] = evaluate_curve(&c, x[k], &y[1][k]);
+    }
+
+    double t_2 = now();
+    double e = 0;
+
+    for (int k = 0; k < ticks; k++) {
+        assert(f[0][k] == f[1][k]);
+
+        if (f[0][k]) {
+            e = fmax(e, fabs(y[0][k] - y[1][k]));
+        }
+    }
+
+    /* The trace must be unchanged by the fixed point storage, that
+     * is identical to one compiled from the parsed coordinates. */
+
+    double (*direct)[4] = calloc(n, sizeof(double[4]));
+    struct curve d;
+    bool identical = true;
+
+    assert(direct);
+
+    for (int i = 0; i < n; i++) {
+        direct[i][0] = P[i][0];
+        direct[i][1] = P[i][1];
+    }
+
+    compile_curve(&d, direct, n, RELATIVE, r_x, RATIOMETRIC, r_y);
+
+    for (int k = 0; k < ticks; k++) {
+        double y_d = 0;
+        const bool f_d = evaluate_curve(&d, x[k], &y_d);
+
+        identical = identical && f_d == f[1][k] && (!f_d || y_d == y[1][k]);
+    }
+
+    printf("Points: %d, ticks: %d\n", n, ticks);
+    printf("Scan: %.1f ns/tick\n", (t_1 - t_0) / ticks * 1e9);
+    printf("Cursor: %.1f ns/tick\n", (t_2 - t_1) / ticks * 1e9);
+    printf("Maximum difference: %g\n", e);
+    printf("Fixed point trace: %s\n", identical ? "identical" : "DIFFERENT");
+
+    return 0;
+}
+#endif
@@ -0,0 +1,41 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CURVE_H
+#define CURVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "profile.h"
+
+/* A stage's points, compiled for evaluation.  Each point holds the
+ * start of a segment and the coefficients of its polynomial, with
+ * the input and output adjustments folded in, so that for s = x -
+ * P[i][0], y = P[i][1] + s^2 (P[i][2] + s P[i][3]). */
+
+struct curve {
+    double (*points)[4];
+    size_t size, cursor;
+    bool increasing;
+};
+
+void compile_curve(struct curve *c, double (*compiled)[4], size_t n,
+                   enum mode input_mode, double input_reference,
+                   enum mode output_mode, double output_reference);
+bool evaluate_curve(struct curve *c, double x, double *y);
+
+#endif
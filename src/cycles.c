@@ -0,0 +1,199 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cycles.h"
+#include "mk20dx.h"
+#include "trace.h"
+#include "usb.h"
+
+/* Per-section statistics of the cycles spent, excluding those spent
+ * in ISRs that preempted the section, with a histogram of their
+ * binary logarithm, from under 64 cycles in the first bin, to 2^20
+ * cycles and over in the last.  Sections can also nest, as a callback
+ * chain does in the ISR that runs it, in which case the outer section
+ * includes the inner one. */
+
+#define BINS 16
+#define MIN_BIN 6
+#define MAX_NESTING 16
+
+#ifdef CYCLES
+static struct cycles {
+    uint32_t count, min, max;
+    uint64_t total;
+
+    /* How many times the section was preempted by an ISR and, for
+     * ISRs, how many times it preempted another section. */
+
+    uint32_t preempted, preempting;
+    uint32_t bins[BINS];
+} cycles[SECTIONS];
+
+/* The sections currently running, innermost last, with the cycle
+ * count on entry and the cycles spent in ISRs that preempted each. */
+
+static struct {
+    uint32_t start, excluded;
+    enum section section;
+} stack[MAX_NESTING];
+
+static int depth;
+
+/* Mask interrupts, so that the stack can be manipulated atomically,
+ * returning the previous mask, as sections may be entered with
+ * interrupts masked. */
+
+static inline uint32_t mask_interrupts(void)
+{
+#ifdef SIL
+    return 0;
+#else
+    uint32_t primask;
+
+    __asm__ volatile ("mrs %0, primask\n\tcpsid i"
+                      : "=r" (primask) :: "memory");
+
+    return primask;
+#endif
+}
+
+static inline void restore_interrupts(uint32_t primask)
+{
+#ifndef SIL
+    __asm__ volatile ("msr primask, %0" :: "r" (primask) : "memory");
+#endif
+}
+
+void begin_cycles(enum section s)
+{
+    const uint32_t primask = mask_interrupts();
+
+    if (s < PRESSURE_CHAIN && depth > 0 && depth <= MAX_NESTING) {
+        cycles[s].preempting++;
+        cycles[stack[depth - 1].section].preempted++;
+    }
+
+    if (depth < MAX_NESTING) {
+        stack[depth].section = s;
+        stack[depth].excluded = 0;
+        stack[depth].start = DWT_CYCCNT;
+    }
+
+    depth++;
+    restore_interrupts(primask);
+
+    trace(BEGIN_EVENT, s, 0);
+}
+
+void end_cycles(enum section s)
+{
+    trace(END_EVENT, s, 0);
+
+    const uint32_t primask = mask_interrupts();
+    const uint32_t now = DWT_CYCCNT;
+
+    depth--;
+
+    if (depth < MAX_NESTING) {
+        const uint32_t elapsed = now - stack[depth].start;
+        const uint32_t n = elapsed - stack[depth].excluded;
+        struct cycles *c = &cycles[s];
+
+        c->count++;
+        c->total += n;
+
+        if (n < c->min) {
+            c->min = n;
+        }
+
+        if (n > c->max) {
+            c->max = n;
+        }
+
+        {
+            const int i = n ? 31 - __builtin_clz(n) - MIN_BIN + 1 : 0;
+
+            c->bins[i < 0 ? 0 : (i >= BINS ? BINS - 1 : i)]++;
+        }
+
+        /* The enclosing section excludes the whole of a preempting
+         * ISR, but only what the section itself excluded, if it's
+         * nested in it. */
+
+        if (depth > 0) {
+            stack[depth - 1].excluded += (
+                s < PRESSURE_CHAIN ? elapsed : stack[depth].excluded);
+        }
+    }
+
+    restore_interrupts(primask);
+}
+#endif
+
+void reset_cycles(void)
+{
+#ifdef CYCLES
+    const uint32_t primask = mask_interrupts();
+
+    for (int i = 0; i < SECTIONS; i++) {
+        cycles[i] = (struct cycles){.min = UINT32_MAX};
+    }
+
+    restore_interrupts(primask);
+#endif
+
+    /* The cycle counter needs the trace unit to be enabled. */
+
+    DEMCR |= DEMCR_TRCENA;
+    DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+}
+
+/* Print, for each section, the number of times it ran, the minimum,
+ * mean and maximum cycles spent in it, the number of times it was
+ * preempted and preempted another section and its histogram, all
+ * since the last call.  Nothing is printed, if sections aren't
+ * timed. */
+
+void print_cycles(void)
+{
+#ifdef CYCLES
+    static const char *names[SECTIONS] = {
+        "porta", "portb", "portc", "portd", "i2c0", "pdb0", "ftm0",
+        "ftm1", "pit0", "pit1", "pit2", "pit3", "usb", "systick",
+        "pressure", "mass", "temperature", "flow", "tick", "turn",
+        "click", "panel"
+    };
+
+    for (int i = 0; i < SECTIONS; i++) {
+        const uint32_t primask = mask_interrupts();
+        const struct cycles c = cycles[i];
+
+        cycles[i] = (struct cycles){.min = UINT32_MAX};
+        restore_interrupts(primask);
+
+        uprintf("%s, %u, %u, %u, %u, %u, %u",
+                names[i], c.count, c.count > 0 ? c.min : 0,
+                c.count > 0 ? (uint32_t)(c.total / c.count) : 0,
+                c.max, c.preempted, c.preempting);
+
+        for (int j = 0; j < BINS; j++) {
+            uprintf(", %u", c.bins[j]);
+        }
+
+        uprintf("\n");
+    }
+#endif
+}
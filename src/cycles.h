@@ -0,0 +1,81 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CYCLES_H
+#define CYCLES_H
+
+#include <inttypes.h>
+
+/* The sections of code timed with the DWT cycle counter: the ISRs,
+ * followed by the callback chains they run. */
+
+enum section {
+    PORTA_ISR,
+    PORTB_ISR,
+    PORTC_ISR,
+    PORTD_ISR,
+    I2C0_ISR,
+    PDB0_ISR,
+    FTM0_ISR,
+    FTM1_ISR,
+    PIT0_ISR,
+    PIT1_ISR,
+    PIT2_ISR,
+    PIT3_ISR,
+    USB_ISR,
+    SYSTICK_ISR,
+
+    PRESSURE_CHAIN,
+    MASS_CHAIN,
+    TEMPERATURE_CHAIN,
+    FLOW_CHAIN,
+    TICK_CHAIN,
+    TURN_CHAIN,
+    CLICK_CHAIN,
+    PANEL_CHAIN,
+
+    SECTIONS
+};
+
+/* Sections are only timed in builds with CYCLES defined. */
+
+#if !defined(CYCLES) || defined(TEST) || defined(HOST)
+#define begin_cycles(S)
+#define end_cycles(S)
+#else
+void begin_cycles(enum section s);
+void end_cycles(enum section s);
+#endif
+
+void reset_cycles(void);
+void print_cycles(void);
+
+/* Define an ISR, timed as the given section.  The body follows, as
+ * for a function, and may return early. */
+
+#define TIMED_ISR(NAME, SECTION)                                        \
+    static inline __attribute__((always_inline)) void NAME ## _body(void); \
+                                                                        \
+    __attribute__((interrupt ("IRQ"))) void NAME(void)                  \
+    {                                                                   \
+        begin_cycles(SECTION);                                          \
+        NAME ## _body();                                                \
+        end_cycles(SECTION);                                            \
+    }                                                                   \
+                                                                        \
+    static inline void NAME ## _body(void)
+
+#endif
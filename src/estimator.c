@@ -0,0 +1,557 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "callbacks.h"
+#include "estimator.h"
+#include "peripherals.h"
+#include "usb.h"
+
+/* An extended Kalman filter, fusing the flow sensor, pressure sensor
+ * and load cell readings, into estimates of the pumped volume V and
+ * flow Q and the yield M, i.e. the mass in the cup, and its rate R:
+ *
+ *   V' = Q,   Q' = w_Q,
+ *   M' = R,   R' = (g Q - R) / T + w_R,
+ *
+ * where w_Q, w_R are white noise.  Water only exits the basket, once
+ * the pressure has risen above OPEN_PRESSURE (g = 1); the yield rate
+ * then follows the flow, delayed by the puck.  Before that (g = 0),
+ * all pumped water is retained in the headspace and the puck, so
+ * that the retained water, V - M, grows.
+ *
+ * The flow sensor reads (1 + S) Q, where S, the sensor's relative
+ * error, drifts slowly.  While water flows through the puck, the load
+ * cell observes the flow as well, which allows estimating S and
+ * correcting the integrated volume's drift.  Conversely, the flow
+ * sensor reduces the lag of the yield rate. */
+
+#define OPEN_PRESSURE 1.0       /* bar */
+#define RETENTION_TIME 1.5      /* s */
+
+/* Process noise spectral densities, in (ml/s^2)^2/s, (g/s^2)^2/s
+ * and 1/s. */
+
+#define FLOW_NOISE 4.0
+#define YIELD_RATE_NOISE 4.0
+#define FLOW_GAIN_NOISE 1e-5
+
+/* Measurement noise standard deviations.  The flow sensor's error is
+ * mostly proportional to the flow. */
+
+#define FLOW_SIGMA 0.05
+#define FLOW_SIGMA_RELATIVE 0.05
+#define MASS_SIGMA 0.1
+
+#define V VOLUME_ESTIMATE
+#define Q FLOW_ESTIMATE
+#define M YIELD_ESTIMATE
+#define R YIELD_RATE_ESTIMATE
+#define S FLOW_GAIN_ESTIMATE
+
+static struct {
+    double x[ESTIMATES], P[ESTIMATES][ESTIMATES];
+    double t, pressure;
+} estimator;
+
+static void predict(double t)
+{
+    double (*P)[ESTIMATES] = estimator.P;
+    double *x = estimator.x;
+
+    if (isnan(estimator.t)) {
+        estimator.t = t;
+        return;
+    }
+
+    const double dt = t - estimator.t;
+
+    /* Measurements can arrive slightly out of order (flow is
+     * processed in batches), in which case we apply them to the
+     * current state. */
+
+    if (!(dt > 0)) {
+        return;
+    }
+
+    estimator.t = t;
+
+    const double g = estimator.pressure >= OPEN_PRESSURE;
+    const double a = fmin(dt / RETENTION_TIME, 1);
+    const double F[ESTIMATES][ESTIMATES] = {
+        {1, dt, 0, 0, 0},
+        {0, 1, 0, 0, 0},
+        {0, 0, 1, dt, 0},
+        {0, a * g, 0, 1 - a, 0},
+        {0, 0, 0, 0, 1}
+    };
+
+    /* x = F x, P = F P F^T + Q.  This runs at the pressure sensor's
+     * rate and F is mostly zeros, so skip those, to save on
+     * (software) floating point operations. */
+
+    double y[ESTIMATES], FP[ESTIMATES][ESTIMATES];
+
+    for (int i = 0; i < ESTIMATES; i++) {
+        y[i] = 0;
+
+        for (int j = 0; j < ESTIMATES; j++) {
+            FP[i][j] = 0;
+        }
+
+        for (int k = 0; k < ESTIMATES; k++) {
+            if (F[i][k] == 0) {
+                continue;
+            }
+
+            y[i] += F[i][k] * x[k];
+
+            for (int j = 0; j < ESTIMATES; j++) {
+                FP[i][j] += F[i][k] * P[k][j];
+            }
+        }
+    }
+
+    for (int i = 0; i < ESTIMATES; i++) {
+        x[i] = y[i];
+
+        for (int j = 0; j < ESTIMATES; j++) {
+            P[i][j] = 0;
+
+            for (int k = 0; k < ESTIMATES; k++) {
+                if (F[j][k] != 0) {
+                    P[i][j] += FP[i][k] * F[j][k];
+                }
+            }
+        }
+    }
+
+    /* Each rate is driven by white noise, which also propagates
+     * into its integral. */
+
+    const double q[2] = {FLOW_NOISE, YIELD_RATE_NOISE};
+
+    for (int i = 0; i < 2; i++) {
+        const int j = 2 * i, k = 2 * i + 1;
+
+        P[j][j] += q[i] * dt * dt * dt / 3;
+        P[j][k] += q[i] * dt * dt / 2;
+        P[k][j] += q[i] * dt * dt / 2;
+        P[k][k] += q[i] * dt;
+    }
+
+    P[S][S] += FLOW_GAIN_NOISE * dt;
+}
+
+/* Update the state with a scalar measurement z, with standard
+ * deviation sigma, given its predicted value h and the gradient H of
+ * the latter with respect to the state. */
+
+static void update(
+    double z, double sigma, double h, const double H[ESTIMATES])
+{
+    double (*P)[ESTIMATES] = estimator.P;
+    double *x = estimator.x;
+    double PH[ESTIMATES], K[ESTIMATES], HP[ESTIMATES];
+    double s = sigma * sigma;
+
+    if (isnan(z)) {
+        return;
+    }
+
+    for (int i = 0; i < ESTIMATES; i++) {
+        PH[i] = HP[i] = 0;
+
+        for (int j = 0; j < ESTIMATES; j++) {
+            PH[i] += P[i][j] * H[j];
+            HP[i] += H[j] * P[j][i];
+        }
+
+        s += H[i] * PH[i];
+    }
+
+    if (!(s > 0)) {
+        return;
+    }
+
+    for (int i = 0; i < ESTIMATES; i++) {
+        K[i] = PH[i] / s;
+        x[i] += K[i] * (z - h);
+    }
+
+    for (int i = 0; i < ESTIMATES; i++) {
+        for (int j = 0; j < ESTIMATES; j++) {
+            P[i][j] -= K[i] * HP[j];
+        }
+    }
+}
+
+static bool flow_estimator_callback(
+    double y, double dy, double t, double dt, double r, int32_t c)
+{
+    /* Use the flow corresponding to the raw pulse frequency, as the
+     * flow sensor's own filter would only add lag. */
+
+    const double z = r > 0 ? calibrate_flow(r) : 0;
+
+    predict(t);
+
+    const double *x = estimator.x;
+    const double H[ESTIMATES] = {[Q] = 1 + x[S], [S] = x[Q]};
+
+    update(z, FLOW_SIGMA + FLOW_SIGMA_RELATIVE * z, (1 + x[S]) * x[Q], H);
+
+    return false;
+}
+
+static bool pressure_estimator_callback(
+    double y, double dy, double t, double dt, double p, int32_t c)
+{
+    predict(t);
+    estimator.pressure = y;
+
+    return false;
+}
+
+static bool mass_estimator_callback(
+    double y, double dy, double t, double dt, double m, int32_t c)
+{
+    predict(t);
+
+    const double H[ESTIMATES] = {[M] = 1};
+
+    update(y, MASS_SIGMA, estimator.x[M], H);
+
+    return false;
+}
+
+void reset_estimator(void)
+{
+    memset(&estimator, 0, sizeof(estimator));
+    estimator.t = estimator.pressure = NAN;
+
+    /* The volume is known to be zero at first, but the yield is only
+     * known once the load cell has been read. */
+
+    estimator.P[Q][Q] = 1e2;
+    estimator.P[M][M] = 1e6;
+    estimator.P[R][R] = 1e2;
+    estimator.P[S][S] = 1e-2;
+
+    add_callback(flow_estimator_callback, flow_callbacks);
+    add_callback(pressure_estimator_callback, pressure_callbacks);
+    add_callback(mass_estimator_callback, mass_callbacks);
+}
+
+void tare_volume_estimate(void)
+{
+    estimator.x[V] = 0;
+
+    for (int i = 0; i < ESTIMATES; i++) {
+        estimator.P[V][i] = estimator.P[i][V] = 0;
+    }
+}
+
+void tare_yield_estimate(double m)
+{
+    estimator.x[M] -= m;
+}
+
+double get_estimate(enum estimate e)
+{
+    return estimator.x[e];
+}
+
+double get_estimate_sigma(enum estimate e)
+{
+    return sqrt(estimator.P[e][e]);
+}
+
+double get_retained_water(void)
+{
+    return estimator.x[V] - estimator.x[M];
+}
+
+double get_retained_water_sigma(void)
+{
+    const double (*P)[ESTIMATES] = estimator.P;
+
+    return sqrt(fmax(P[V][V] + P[M][M] - 2 * P[V][M], 0));
+}
+
+double get_flow(void)
+{
+    return estimator.x[Q];
+}
+
+double get_volume(void)
+{
+    return estimator.x[V];
+}
+
+double get_yield(void)
+{
+    return estimator.x[M];
+}
+
+#ifndef TEST
+void print_estimator(void)
+{
+    for (int i = 0; i < ESTIMATES; i++) {
+        uprintf("%.3f, %.3f, ",
+                (double)get_estimate(i), (double)get_estimate_sigma(i));
+    }
+
+    uprintf("%.3f, %.3f\n",
+            (double)get_retained_water(),
+            (double)get_retained_water_sigma());
+}
+#endif
+
+#ifdef TEST
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void *pressure_callbacks[N_CALLBACKS];
+void *mass_callbacks[N_CALLBACKS];
+void *flow_callbacks[N_CALLBACKS];
+
+void _uassert(const char *msg, int line, const char *func)
+{
+    fprintf(stderr, msg, line, func);
+    abort();
+}
+
+double calibrate_flow(double r)
+{
+    return r;
+}
+
+static double gaussian(double sigma)
+{
+    /* Via the Box-Muller transform. */
+
+    const double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    const double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+    return sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+/* A synthetic shot: preinfusion at 4 ml/s, which fills the headspace
+ * and wets the puck, until pressure builds, then 2.5 ml/s until
+ * 30s.  The puck behaves as a resistance, with some compliance, and
+ * the coffee takes a while to drip into the cup. */
+
+#define STEP 1e-3
+#define STEPS 40000
+
+#define HEADSPACE 20.0          /* ml */
+#define COMPLIANCE 2.0          /* bar/ml */
+#define CONDUCTANCE 0.25        /* (ml/s)/bar */
+#define DRIP_STEPS 200          /* 0.2s */
+
+/* The flow sensor reads 5% high, with 3% noise, the load cell output
+ * has 0.1g of noise and the pressure sensor 0.05 bar. */
+
+#define FLOW_BIAS 1.05
+#define FLOW_NOISE_RELATIVE 0.03
+#define MASS_NOISE 0.1
+#define PRESSURE_NOISE 0.05
+
+static double pump(double t)
+{
+    if (t < 2) {
+        return 0;
+    } else if (t < 8) {
+        return 4;
+    } else if (t < 30) {
+        return 2.5;
+    } else {
+        return 0;
+    }
+}
+
+enum {TRUTH, SEPARATE, FUSED, TRACES};
+enum {FLOW, VOLUME, YIELD, YIELD_RATE, CHANNELS};
+
+static struct trace {
+    double y[CHANNELS][STEPS + 1];
+} traces[TRACES];
+
+static double rms(int i, int c, double tau)
+{
+    const int k = lrint(tau / STEP);
+    double e = 0;
+    int n = 0;
+
+    for (int j = k; j <= STEPS; j++) {
+        const double d = traces[i].y[c][j] - traces[TRUTH].y[c][j - k];
+
+        e += d * d;
+        n++;
+    }
+
+    return sqrt(e / n);
+}
+
+static double lag(int i, int c)
+{
+    double tau_min = 0, e_min = INFINITY;
+
+    for (double tau = 0; tau < 1; tau += 0.005) {
+        const double e = rms(i, c, tau);
+
+        if (e < e_min) {
+            e_min = e;
+            tau_min = tau;
+        }
+    }
+
+    return tau_min;
+}
+
+int main(int argc, char *argv[])
+{
+    struct filter flow_filter = SINGLE_FILTER(0.5);
+    struct filter mass_filter = SINGLE_FILTER(0.03);
+    struct filter mass_rate_filter = SINGLE_FILTER(0.3);
+
+    double W = 0, V = 0, V_s = 0;
+    double drip[DRIP_STEPS] = {0}, cup = 0;
+
+    reset_estimator();
+    tare_volume_estimate();
+
+    printf("$data << end\n");
+
+    for (int j = 0; j <= STEPS; j++) {
+        const double t = j * STEP;
+
+        /* Advance the plant. */
+
+        const double Q_t = pump(t);
+        const double p = COMPLIANCE * fmax(W - HEADSPACE, 0);
+        const double R_t = CONDUCTANCE * p;
+
+        W += (Q_t - R_t) * STEP;
+        V += Q_t * STEP;
+
+        /* The drip delay line, holding the output of each step. */
+
+        const double R_cup = drip[j % DRIP_STEPS] / STEP;
+
+        cup += drip[j % DRIP_STEPS];
+        drip[j % DRIP_STEPS] = R_t * STEP;
+
+        /* Sample the sensors: pressure at 200Hz, mass at 20Hz and
+         * flow in 20Hz batches, as in the firmware. */
+
+        if (j % 5 == 0) {
+            const double p_k = p + gaussian(PRESSURE_NOISE);
+
+            RUN_CALLBACKS(
+                pressure_callbacks,
+                bool (*)(double, double, double, double, double, int32_t),
+                p_k, 0, t, 5 * STEP, p_k, 0);
+        }
+
+        if (j % 50 == 0) {
+            const double m = cup + gaussian(MASS_NOISE);
+
+            filter_sample(&mass_filter, m, t);
+            filter_sample(
+                &mass_rate_filter, mass_filter.dy / mass_filter.dt, t);
+
+            RUN_CALLBACKS(
+                mass_callbacks,
+                bool (*)(double, double, double, double, double, int32_t),
+                mass_filter.y, mass_filter.dy,
+                mass_filter.t, mass_filter.dt, m, 0);
+        }
+
+        if (j % 50 == 25) {
+            const double r = (
+                Q_t > 0
+                ? Q_t * (FLOW_BIAS + gaussian(FLOW_NOISE_RELATIVE))
+                : 0);
+
+            filter_sample(&flow_filter, r, t);
+            V_s += flow_filter.y * 50 * STEP;
+
+            RUN_CALLBACKS(
+                flow_callbacks,
+                bool (*)(double, double, double, double, double, int32_t),
+                flow_filter.y, flow_filter.dy,
+                flow_filter.t, flow_filter.dt, r, 0);
+        }
+
+        const double y[TRACES][CHANNELS] = {
+            {Q_t, V, cup, R_cup},
+            {flow_filter.y, V_s, mass_filter.y, mass_rate_filter.y},
+            {get_flow(), get_volume(), get_yield(),
+             get_estimate(YIELD_RATE_ESTIMATE)}
+        };
+
+        for (int i = 0; i < TRACES; i++) {
+            for (int c = 0; c < CHANNELS; c++) {
+                traces[i].y[c][j] = isnan(y[i][c]) ? 0 : y[i][c];
+            }
+        }
+
+        if (j % 100 == 0) {
+            printf("%f", t);
+
+            for (int c = 0; c < CHANNELS; c++) {
+                for (int i = 0; i < TRACES; i++) {
+                    printf(", %f", traces[i].y[c][j]);
+                }
+            }
+
+            printf(", %f, %f\n", W, get_retained_water());
+        }
+    }
+
+    static const char *names[CHANNELS] = {
+        "Flow", "Volume", "Yield", "Yield rate"
+    };
+
+    printf("end\n");
+    printf("set datafile separator ','\n");
+    printf("plot $data using 1:8 with lines title 'Yield', "
+           "$data using 1:9 with lines title 'Separate', "
+           "$data using 1:10 with lines title 'Fused'\n");
+    printf("set print '-'\n");
+
+    for (int c = 0; c < CHANNELS; c++) {
+        printf("print '%s error: %f (separate), %f (fused)'\n",
+               names[c], rms(SEPARATE, c, 0), rms(FUSED, c, 0));
+        printf("print '%s lag: %f (separate), %f (fused)'\n",
+               names[c], lag(SEPARATE, c), lag(FUSED, c));
+    }
+
+    printf("print 'Retained water: %f (true), %f (fused) +/- %f'\n",
+           W, get_retained_water(), get_retained_water_sigma());
+    printf("print 'Flow sensor error: %f (true), %f (fused) +/- %f'\n",
+           FLOW_BIAS - 1, get_estimate(FLOW_GAIN_ESTIMATE),
+           get_estimate_sigma(FLOW_GAIN_ESTIMATE));
+    printf("pause mouse keypress \"Hit enter\"\n");
+
+    return 0;
+}
+#endif
@@ -0,0 +1,39 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ESTIMATOR_H
+#define ESTIMATOR_H
+
+enum estimate {
+    VOLUME_ESTIMATE,            /* Pumped volume, in ml */
+    FLOW_ESTIMATE,              /* Pump flow, in ml/s */
+    YIELD_ESTIMATE,             /* Mass in the cup, in g */
+    YIELD_RATE_ESTIMATE,        /* in g/s */
+    FLOW_GAIN_ESTIMATE,         /* Relative flow sensor error */
+
+    ESTIMATES
+};
+
+void reset_estimator(void);
+void tare_volume_estimate(void);
+void tare_yield_estimate(double m);
+double get_estimate(enum estimate e);
+double get_estimate_sigma(enum estimate e);
+double get_retained_water(void);
+double get_retained_water_sigma(void);
+void print_estimator(void);
+
+#endif
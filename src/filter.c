@@ -49,6 +49,51 @@ void filter_sample(struct filter *f, double y_k, double t)
     f->t = t;
 }
 
+void reset_cic(struct cic *f, int decimation)
+{
+    *f = CIC_FILTER(decimation);
+}
+
+bool cic_sample(struct cic *f, int32_t x_k, double *y)
+{
+    /* The integrators are allowed to overflow; as long as the
+     * arithmetic is modular, the combs recover the correct value, as
+     * long as it fits.  With 24-bit input this means a gain R^N of
+     * up to 2^40. */
+
+    uint64_t z = (uint64_t)(int64_t)x_k;
+
+    for (int i = 0; i < CIC_ORDER; i++) {
+        f->integrators[i] += z;
+        z = f->integrators[i];
+    }
+
+    if (++f->n < f->decimation) {
+        return false;
+    }
+
+    f->n = 0;
+
+    for (int i = 0; i < CIC_ORDER; i++) {
+        const uint64_t w = z - f->combs[i];
+
+        f->combs[i] = z;
+        z = w;
+    }
+
+    /* The impulse response spans N(R - 1) + 1 input samples, so the
+     * first N - 1 outputs are only partial sums. */
+
+    if (f->outputs < CIC_ORDER - 1) {
+        f->outputs++;
+        return false;
+    }
+
+    *y = (double)(int64_t)z / pow(f->decimation, CIC_ORDER);
+
+    return true;
+}
+
 #ifdef TEST
 #include <assert.h>
 #include <stdbool.h>
@@ -57,14 +102,93 @@ void filter_sample(struct filter *f, double y_k, double t)
 #include <string.h>
 #include <unistd.h>
 
+/* A synthetic load cell signal, sampled at the NAU7802's rate:
+ * coffee starts dripping into the cup at 10s, at 2 g/s, for 20s. */
+
+#define SYNTHETIC_RATE 320.0
+#define SYNTHETIC_LENGTH 40.0
+
+static double synthesize(double t)
+{
+    const double y = t > 10 ? 2 * (fmin(t, 30) - 10) : 0;
+
+    /* Add Gaussian noise with a standard deviation of 0.3g, via the
+     * Box-Muller transform. */
+
+    const double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    const double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+    return y + 0.3 * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static struct trace {
+    double *t, *y;
+    size_t n, size;
+} raw, filtered;
+
+static void record(struct trace *r, double t, double y)
+{
+    if (r->n == r->size) {
+        r->size = r->size ? 2 * r->size : 1024;
+        r->t = realloc(r->t, r->size * sizeof(double));
+        r->y = realloc(r->y, r->size * sizeof(double));
+        assert(r->t && r->y);
+    }
+
+    r->t[r->n] = t;
+    r->y[r->n] = y;
+    r->n++;
+}
+
+static double estimate_lag(void)
+{
+    /* Find the time shift of the input, that best matches the
+     * output, in the least squares sense.  The input's noise adds a
+     * constant to the error, so it doesn't affect the minimum. */
+
+    double tau_min = NAN, e_min = INFINITY;
+
+    for (double tau = 0; tau < 1; tau += 1e-3) {
+        double e = 0;
+        size_t i = 0, m = 0;
+
+        for (size_t j = 0; j < filtered.n; j++) {
+            const double t = filtered.t[j] - tau;
+
+            while (i + 1 < raw.n && raw.t[i + 1] < t) {
+                i++;
+            }
+
+            if (i + 1 >= raw.n || raw.t[i] > t || isnan(filtered.y[j])) {
+                continue;
+            }
+
+            const double a = (t - raw.t[i]) / (raw.t[i + 1] - raw.t[i]);
+            const double d = (filtered.y[j]
+                              - (1 - a) * raw.y[i] - a * raw.y[i + 1]);
+
+            e += d * d;
+            m++;
+        }
+
+        if (m > 0 && e / m < e_min) {
+            e_min = e / m;
+            tau_min = tau;
+        }
+    }
+
+    return tau_min;
+}
+
 int main(int argc, char *argv[])
 {
     struct filter filter = DOUBLE_FILTER(1, 0.1);
+    struct cic cic;
 
-    bool d = false;
-    int opt, average = 0, moving = 0;
+    bool d = false, synthetic = false;
+    int opt, average = 0, moving = 0, decimation = 0;
 
-    while ((opt = getopt(argc, argv, "da:m:")) != -1) {
+    while ((opt = getopt(argc, argv, "da:m:c:st:")) != -1) {
         switch (opt) {
         case 'd':
             d = true;
@@ -75,29 +199,50 @@ int main(int argc, char *argv[])
         case 'm':
             moving = atoi(optarg);
             break;
+        case 'c':
+            decimation = atoi(optarg);
+            break;
+        case 's':
+            synthetic = true;
+            break;
+        case 't':
+            filter = SINGLE_FILTER(atof(optarg));
+            break;
         default:
             return 1;
         }
     }
 
+    reset_cic(&cic, decimation);
+
     double v[moving];
     memset(v, 0, sizeof(v));
 
     printf("$data << end\n");
 
     double I = 0, P = 0, y = 0, y_0 = NAN;
-    int n, m;
+    int n, m = 0, k = 0;
 
     for (n = 0; ; n++) {
         double t_k, y_k, dy_dt_k, y_f;
         unsigned int c;
 
-        int x = scanf(
+        if (synthetic) {
+            t_k = n / SYNTHETIC_RATE;
+
+            if (t_k > SYNTHETIC_LENGTH) {
+                break;
+            }
+
+            y_k = synthesize(t_k);
+        } else {
+            int x = scanf(
                 "%lf,%lf,%lf,%lf,%u\n",
                 &t_k, &y_f, &dy_dt_k, &y_k, &c);
 
-        if (x == EOF) {
-            break;
+            if (x == EOF) {
+                break;
+            }
         }
 
 #if 0
@@ -110,6 +255,8 @@ int main(int argc, char *argv[])
         }
 #endif
 
+        record(&raw, t_k, y_k);
+
         if (average > 0) {
             y += y_k;
             m++;
@@ -128,11 +275,21 @@ int main(int argc, char *argv[])
             i = (i + 1) % moving;
 
             y = sum / moving;
+        } else if (decimation > 0) {
+            /* Work in milligrams, as the CIC filter needs integer
+             * input. */
+
+            if (!cic_sample(&cic, lrint(y_k * 1e3), &y)) {
+                continue;
+            }
+
+            y /= 1e3;
         } else {
             y = y_k;
         }
 
         filter_sample(&filter, y, t_k);
+        record(&filtered, t_k, filter.y);
 
         if (!d) {
             printf("%f, %f, %f\n", t_k, y_k, filter.y);
@@ -151,6 +308,7 @@ int main(int argc, char *argv[])
         I += filter.dy;
         P += ((filter.dy / filter.dt)
               * (filter.dy / filter.dt));
+        k++;
 
       skip:
         y_0 = y;
@@ -162,7 +320,9 @@ int main(int argc, char *argv[])
     printf("plot $data using 1:2 with lines,  $data using 1:3 with lines\n");
     printf("set print '-'\n");
     printf("print 'Integral: %f'\n", I);
-    printf("print 'RMS differential: %f'\n", sqrt(P / n));
+    printf("print 'RMS differential: %f'\n", sqrt(P / k));
+    printf("print 'Output rate: %f'\n", filtered.n / raw.t[raw.n - 1]);
+    printf("print 'Lag: %f'\n", estimate_lag());
     printf("pause mouse keypress \"Hit enter\"\n");
 
     return 0;
@@ -17,15 +17,30 @@
 #ifndef FILTER_H
 #define FILTER_H
 
+#include <stdbool.h>
+#include <inttypes.h>
+
 struct filter {
     double tau, sigma;
     double y, dy, t, dt;
 };
 
+/* Cascaded integrator-comb decimator. */
+
+#define CIC_ORDER 2
+
+struct cic {
+    int decimation, n, outputs;
+    uint64_t integrators[CIC_ORDER], combs[CIC_ORDER];
+};
+
 void filter_sample_dt(struct filter *f, double y_k, double dt);
 void filter_sample(struct filter *f, double y_k, double t);
+void reset_cic(struct cic *f, int decimation);
+bool cic_sample(struct cic *f, int32_t x_k, double *y);
 
 #define SINGLE_FILTER(TAU) (struct filter){TAU, NAN, NAN, NAN, NAN, NAN}
 #define DOUBLE_FILTER(TAU, SIGMA) \
     (struct filter){TAU, SIGMA, NAN, NAN, NAN, NAN}
+#define CIC_FILTER(R) (struct cic){R, 0, 0, {0}, {0}}
 #endif
@@ -0,0 +1,95 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "flash.h"
+#include "mk20dx.h"
+#include "uassert.h"
+
+/* Run an FTFL command on the FlexNVM and wait for it to complete.
+ * Since code executes from program flash, which is a separate block,
+ * the FlexNVM can be erased or programmed without stalling it, as
+ * long as nothing reads the FlexNVM in the meantime.  The flash
+ * controller always completes a command, so there's no need for a
+ * timeout. */
+
+static bool run_flash_command(uint8_t command, uintptr_t address,
+                              uint32_t data)
+{
+    const uint32_t a = FLEXNVM_FTFL_ADDRESS(address);
+
+    while (!(FTFL_FSTAT & FTFL_FSTAT_CCIF));
+
+    FTFL_FSTAT = FTFL_FSTAT_ACCERR | FTFL_FSTAT_FPVIOL;
+
+    FTFL_FCCOB0 = command;
+    FTFL_FCCOB1 = (uint8_t)(a >> 16);
+    FTFL_FCCOB2 = (uint8_t)(a >> 8);
+    FTFL_FCCOB3 = (uint8_t)a;
+    FTFL_FCCOB4 = (uint8_t)(data >> 24);
+    FTFL_FCCOB5 = (uint8_t)(data >> 16);
+    FTFL_FCCOB6 = (uint8_t)(data >> 8);
+    FTFL_FCCOB7 = (uint8_t)data;
+
+    FTFL_FSTAT = FTFL_FSTAT_CCIF;
+
+    while (!(FTFL_FSTAT & FTFL_FSTAT_CCIF));
+
+    return !(FTFL_FSTAT & (FTFL_FSTAT_ACCERR
+                           | FTFL_FSTAT_FPVIOL
+                           | FTFL_FSTAT_MGSTAT0));
+}
+
+/* The size of the FlexNVM partitioned as data flash.  Only the
+ * partition codes of an unpartitioned part and of one with no EEPROM
+ * backup are recognized; a part partitioned for EEPROM emulation is
+ * taken to have no data flash at all, rather than risk erasing its
+ * backup. */
+
+size_t get_data_flash_size(void)
+{
+    const uint32_t c = SIM_FCFG1_DEPART(SIM_FCFG1);
+
+    return c == 0b0000 || c == 0b1111 ? FLEXNVM_SIZE : 0;
+}
+
+bool erase_flash_sector(uintptr_t address)
+{
+    uassert(address % FLEXNVM_SECTOR_SIZE == 0);
+
+    return run_flash_command(FTFL_ERASE_SECTOR, address, 0);
+}
+
+/* Program n bytes of data into erased flash, a longword at a time.
+ * The last longword is padded with 0xff, i.e. left erased. */
+
+bool program_flash(uintptr_t address, const void *data, size_t n)
+{
+    uassert(address % 4 == 0);
+
+    for (size_t i = 0; i < n; i += 4) {
+        uint32_t w = 0xffffffff;
+
+        memcpy(&w, (const uint8_t *)data + i, n - i < 4 ? n - i : 4);
+
+        if (!run_flash_command(FTFL_PROGRAM_LONGWORD, address + i, w)) {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,28 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLASH_H
+#define FLASH_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+size_t get_data_flash_size(void);
+bool erase_flash_sector(uintptr_t address);
+bool program_flash(uintptr_t address, const void *data, size_t n);
+
+#endif
@@ -18,113 +18,250 @@
 #include <string.h>
 
 #include "callbacks.h"
+#include "cycles.h"
+#include "estimator.h"
 #include "filter.h"
+#include "health.h"
+#include "jitter.h"
 #include "mk20dx.h"
 #include "time.h"
 #include "uassert.h"
 
+/* The timer runs at 48 Mhz / 128 = 375Khz. */
+
+#define TICKS_PER_S 375e3
+
+/* Pulse edges are captured on FTM0 channel 0 and their 16-bit
+ * timestamps are moved into a ring by DMA, without interrupting the
+ * CPU.  They're processed in batches, every BATCH_TICKS timer ticks,
+ * i.e. at 20Hz, driven by a software output compare on channel 2.
+ * The ring wraps by destination address modulo, so that the DMA
+ * major loop count is free to count the edges, over EDGE_COUNT_MAX
+ * of them, to detect overruns. */
+
+#define DMA_CHANNEL 1
+#define BATCH_TICKS 18750
+#define EDGE_RING_SIZE 64
+#define EDGE_COUNT_MAX 0x7fff
+
+/* The calibration gives the volume, in ml, per pair of pulses, as a
+ * function of the pulse frequency.  It was fitted to the periods the
+ * 16-bit timer could measure, i.e. down to LOW_FLOW_F, or about
+ * 5.7Hz.  Lower frequencies are now measured too, but there's no
+ * calibration data for them yet.  Once there is, the volume per pair
+ * at zero frequency can be set (see set_low_flow_volume), and the
+ * calibration joins it linearly to the quadratic at LOW_FLOW_F.
+ * Until then the quadratic is extrapolated, and it's nearly flat,
+ * at about 0.11ml per pair, in that range. */
+
+#define A 1.8021e-06
+#define B -3.7826e-04
+#define C 1.1075e-01
+
+#define LOW_FLOW_F (TICKS_PER_S / 65536)
+
 struct filter flow_filter = SINGLE_FILTER(0.5);
 
+static volatile uint16_t edges[EDGE_RING_SIZE]
+    __attribute__((aligned(EDGE_RING_SIZE * sizeof(uint16_t))));
+
+static struct {
+    /* Timestamps, extended to 32 bits, of the last batch and the
+     * last edge, as well as the last stagnation report. */
+
+    uint32_t now, edge, stagnation;
+
+    /* The time, 16-bit timer count and DMA major loop count of the
+     * last batch and the read index into the edge ring. */
+
+    double t;
+    uint16_t count, iterations;
+    int head;
+    bool valid;
+} batch = {.t = NAN, .iterations = EDGE_COUNT_MAX};
+
+/* Periods longer than the stagnation timeout are considered
+ * "stagnation", i.e. no flow, or too low to bother about
+ * measuring. */
+
+static uint32_t stagnation_ticks = 0.5 * TICKS_PER_S;
+
 static int32_t pulses;
 static double flow = NAN, derivative = NAN, volume = NAN;
+static double low_flow_volume = NAN;
 
-__attribute__((interrupt ("IRQ"))) void ftm0_isr(void)
+static double calibrate(double r)
 {
-    static uint16_t overflows[2];
-    const double t = get_time();
+    if (r < LOW_FLOW_F && !isnan(low_flow_volume)) {
+        const double V = A * LOW_FLOW_F * LOW_FLOW_F + B * LOW_FLOW_F + C;
 
-    /* Count the overflows before and after the first edge.  We
-     * consider more than 1 overflow at either phase as signifying
-     * stagnation.  (Within the period, this may be the case even with
-     * only 1; see below).
+        return low_flow_volume + (V - low_flow_volume) * r / LOW_FLOW_F;
+    }
 
-     * If both overflow and capture interrupt flags were raised on
-     * entry, there's a potential race.  Maybe the overflow came
-     * before the capture and should therefore be reset, but it might
-     * have come after it, while the ISR, was waiting to execute.  In
-     * the latter case the overflow must be considered in the period
-     * calculation.
+    return A * r * r + B * r + C;
+}
 
-     * Since an overflow less can lead to a wrong period calculation,
-     * while an overflow more can only lead to a skipped sample, we
-     * always assume the overflow came after the capture. */
+/* Process the m edges captured since the last batch, given the timer
+ * count, read after the edge count, and the time at which it was
+ * read. */
 
-    if (FTM0_SC & FTM_SC_TOF) {
-        FTM0_SC &= ~FTM_SC_TOF;
-        overflows[(FTM0_C0SC & FTM_CSC_CHF) > 0] += 1;
+static void process_edges(int m, uint16_t count, double t)
+{
+    const int tail = (batch.head + m) % EDGE_RING_SIZE;
+    uint32_t ticks = 0;
+    int n = 0;
+
+    /* Batches are normally much closer together than the timer's
+     * period, so 16-bit arithmetic gives the correct elapsed time and
+     * the same holds for the edges captured since the last batch.  If
+     * this one is late by more than half the period, or more edges
+     * were captured than the ring holds, that no longer holds, or
+     * some edges were overwritten.  The edges are still counted
+     * towards the volume, at the last measured rate, but the batch
+     * yields no rate and the next period is timed afresh. */
+
+    const bool late = t - batch.t > 32768 / TICKS_PER_S;
+
+    if (late || m >= EDGE_RING_SIZE) {
+        count_error(FLOW_SENSOR, OVERRUN_ERROR);
+
+        batch.now += (late
+                      ? (uint32_t)lround((t - batch.t) * TICKS_PER_S)
+                      : (uint16_t)(count - batch.count));
+        batch.count = count;
+        batch.t = t;
+        batch.head = tail;
+
+        if (m > 0) {
+            batch.edge = batch.stagnation = batch.now;
+            batch.valid = false;
+            pulses += m;
+
+            if (!isnan(flow)) {
+                volume += m * calibrate(flow_filter.y) / 2;
+            }
+        }
+
+        return;
     }
 
-    bool stagnated = (overflows[1] > 1);
+    batch.now += (uint16_t)(count - batch.count);
+    batch.count = count;
+    batch.t = t;
 
-    if (FTM0_C1SC & FTM_CSC_CHF) {
-        FTM0_C0SC &= ~FTM_CSC_CHF;
-        FTM0_C1SC &= ~FTM_CSC_CHF;
+    for (; batch.head != tail;
+         batch.head = (batch.head + 1) % EDGE_RING_SIZE) {
+        const uint32_t e = (
+            batch.now - (uint16_t)(count - edges[batch.head]));
+        const uint32_t period = e - batch.edge;
 
-        const uint16_t t_0 = FTM0_C0V;
-        const uint16_t t_1 = FTM0_C1V;
+        if (batch.valid && period < stagnation_ticks) {
+            ticks += period;
+            n++;
+        }
 
-        /* The 16-bit unsigned arithmetic below calculates the correct
-         * signal period, as long as it is below the maximum timer
-         * period, i.e. 65536/375000, or about 17ms.  This is the case
-         * when there are 0 overflows, or when there's 1, but the end
-         * time, hasn't caught up with the start time yet.
+        batch.edge = batch.stagnation = e;
+        batch.valid = true;
+        pulses++;
 
-         * We consider anything else "stagnation", i.e. no flow, or
-         * too low to bother about measuring. */
+        count_transaction(FLOW_SENSOR);
+    }
 
-        stagnated = (stagnated || (overflows[1] == 1 && t_1 >= t_0));
+    /* Sample the mean pulse frequency over the batch, at the time of
+     * its last edge. */
 
-        overflows[0] = overflows[1] = 0;
-        pulses++;
+    if (n > 0) {
+        const double r = n * TICKS_PER_S / ticks;
+        const double dt = ticks / TICKS_PER_S;
 
-        if (!stagnated) {
-            const double r = 375e3 / (uint16_t)(t_1 - t_0);
+        const double t_e = t - (batch.now - batch.edge) / TICKS_PER_S;
 
-            filter_sample(&flow_filter, r, t);
+        filter_sample(&flow_filter, r, t_e);
+        count_sample(FLOW_SENSOR, flow_filter.t);
 
-            const double y = flow_filter.y;
-            const double dy = flow_filter.dy;
-            const double dt = flow_filter.dt;
+        const double y = flow_filter.y;
+        const double dy = flow_filter.dy;
 
-#define A 1.8021e-06
-#define B -3.7826e-04
-#define C 1.1075e-01
+        /* Each period is half of a calibrated pair. */
 
-            const double dV = A * y * y + B * y + C;
-            const double ddV = A * dy * (2 * y + dy) + B * dy;
-#undef A
-#undef B
-#undef C
+        const double dV = n * calibrate(y) / 2;
+        const double ddV = n * (calibrate(y + dy) - calibrate(y)) / 2;
 
-            flow = dV / dt;
-            const double delta = ddV / dt;
+        flow = dV / dt;
+        const double delta = ddV / dt;
 
-            volume += dV;
-            derivative = delta / dt;
+        volume += dV;
+        derivative = delta / dt;
 
-            RUN_CALLBACKS(
-                flow_callbacks,
-                bool (*)(double, double, double, double, double, int32_t),
-                flow, delta, flow_filter.t, dt, r, pulses);
+        begin_cycles(FLOW_CHAIN);
+        RUN_CALLBACKS(
+            flow_callbacks,
+            bool (*)(double, double, double, double, double, int32_t),
+            flow, delta, flow_filter.t, dt, r, pulses);
+        end_cycles(FLOW_CHAIN);
+    } else if (batch.valid && !isnan(flow)) {
+        /* Between pulses, the flow can be no more than one pulse's
+         * volume over the time since the last one, which lets low
+         * flows decay smoothly, before they're considered
+         * stagnant. */
+
+        const uint32_t elapsed = batch.now - batch.edge;
+
+        if (elapsed > 0) {
+            flow = fmin(
+                flow, calibrate(flow_filter.y) / 2 * TICKS_PER_S / elapsed);
         }
     }
 
-    if (stagnated || overflows[0] > 1) {
+    /* Report stagnation once per timeout, for as long as it lasts. */
+
+    if (batch.now - batch.stagnation >= stagnation_ticks) {
+        batch.stagnation = batch.now;
+        batch.valid = false;
+
         filter_sample(&flow_filter, 0, t);
+        count_sample(FLOW_SENSOR, t);
 
         flow = derivative = NAN;
 
+        begin_cycles(FLOW_CHAIN);
         RUN_CALLBACKS(
             flow_callbacks,
             bool (*)(double, double, double, double, double, int32_t),
             0, 0, flow_filter.t, flow_filter.dt, 0, pulses);
+        end_cycles(FLOW_CHAIN);
+    }
+}
+
+#if !defined(TEST) && !defined(HOST)
+TIMED_ISR(ftm0_isr, FTM0_ISR)
+{
+    if (!(FTM0_C2SC & FTM_CSC_CHF)) {
+        return;
     }
+
+    FTM0_C2SC &= ~FTM_CSC_CHF;
+    FTM0_C2V = (uint16_t)(FTM0_C2V + BATCH_TICKS);
+
+    /* Read the DMA major loop count before the timer count, so that
+     * all edges counted precede the count.  It counts down, from
+     * EDGE_COUNT_MAX to 1, and is then reloaded. */
+
+    const uint16_t i = DMA_TCD_CITER(DMA_CHANNEL);
+    const uint16_t count = FTM0_CNT;
+    const int m = (batch.iterations - i + EDGE_COUNT_MAX) % EDGE_COUNT_MAX;
+
+    batch.iterations = i;
+    process_edges(m, count, get_time());
 }
 
 void reset_flow(void)
 {
+    set_loop_period(FLOW_LOOP, BATCH_TICKS / TICKS_PER_S);
+
     SIM_SCGC5 |= SIM_SCGC5_PORTC | SIM_SCGC5_PORTD;
-    SIM_SCGC6 |= SIM_SCGC6_FTM0;
+    SIM_SCGC6 |= SIM_SCGC6_FTM0 | SIM_SCGC6_DMAMUX;
+    SIM_SCGC7 |= SIM_SCGC7_DMA;
 
     /* Sensor power */
 
@@ -138,33 +275,92 @@ void reset_flow(void)
 
     PORTC_PCR1 |= PORT_PCR_MUX(4);
 
+    /* Configure a DMA channel to copy each captured timestamp into
+     * the edge ring, wrapping around at its end, which is aligned to
+     * its size, by address modulo. */
+
+    DMAMUX0_CHCFG(DMA_CHANNEL) = 0;
+
+    DMA_TCD_SADDR(DMA_CHANNEL) = (uint32_t)&FTM0_C0V;
+    DMA_TCD_SOFF(DMA_CHANNEL) = 0;
+    DMA_TCD_ATTR(DMA_CHANNEL) = (DMA_TCD_ATTR_SSIZE(DMA_TCD_ATTR_16BIT)
+                                 | DMA_TCD_ATTR_DSIZE(DMA_TCD_ATTR_16BIT)
+                                 | DMA_TCD_ATTR_DMOD(
+                                     __builtin_ctz(sizeof(edges))));
+    DMA_TCD_NBYTES(DMA_CHANNEL) = sizeof(edges[0]);
+    DMA_TCD_SLAST(DMA_CHANNEL) = 0;
+    DMA_TCD_DADDR(DMA_CHANNEL) = (uint32_t)edges;
+    DMA_TCD_DOFF(DMA_CHANNEL) = sizeof(edges[0]);
+    DMA_TCD_CITER(DMA_CHANNEL) = EDGE_COUNT_MAX;
+    DMA_TCD_BITER(DMA_CHANNEL) = EDGE_COUNT_MAX;
+    DMA_TCD_DLASTSGA(DMA_CHANNEL) = 0;
+    DMA_TCD_CSR(DMA_CHANNEL) = 0;
+
+    DMAMUX0_CHCFG(DMA_CHANNEL) = (
+        DMAMUX_ENBL | DMAMUX_SOURCE(DMAMUX_SOURCE_FTM0_CH0));
+    DMA_SERQ = DMA_CHANNEL;
+
     /* Configure the timer for input capture.  Set system clock source with
      * 1/128 prescaler for a clock frequency of 48 Mhz / 128 =
      * 375Khz */
 
     FTM0_MODE |= FTM_MODE_WPDIS;
-    FTM0_MODE |= FTM_MODE_FTMEN;
 
-    FTM0_COMBINE |= (FTM_COMBINE_DECAPEN0 | FTM_COMBINE_DECAP0);
-    FTM0_FILTER = FTM_FILTER_CH0FVAL(15) | FTM_FILTER_CH1FVAL(15);
+    FTM0_FILTER = FTM_FILTER_CH0FVAL(15);
     FTM0_MOD = 65535;
     FTM0_CNT = 0;
 
-    FTM0_C0SC = FTM_CSC_MSA | FTM_CSC_ELSB;
-    FTM0_C1SC = FTM_CSC_ELSB | FTM_CSC_CHIE;
-    FTM0_SC = FTM_SC_CLKS(1) | FTM_SC_PS(7) | FTM_SC_TOIE;
+    /* Capture falling edges on channel 0, requesting a DMA transfer
+     * instead of an interrupt, and use channel 2 as a software-only
+     * output compare, to time the batches. */
+
+    FTM0_C0SC = FTM_CSC_ELSB | FTM_CSC_CHIE | FTM_CSC_DMA;
+    FTM0_C2SC = FTM_CSC_MSA | FTM_CSC_CHIE;
+    FTM0_C2V = BATCH_TICKS;
+    FTM0_SC = FTM_SC_CLKS(1) | FTM_SC_PS(7);
 
     prioritize_interrupt(FTM0_IRQ, 8);
     enable_interrupt(FTM0_IRQ);
 }
+#endif
+
+void set_flow_timeout(double t)
+{
+    stagnation_ticks = fmin(fmax(t, 0.05), 5) * TICKS_PER_S;
+}
+
+double get_flow_timeout(void)
+{
+    return stagnation_ticks / TICKS_PER_S;
+}
+
+/* Set the volume per pair of pulses at zero frequency, in ml, for the
+ * low-flow calibration, or NAN to extrapolate the quadratic. */
+
+void set_low_flow_volume(double V)
+{
+    low_flow_volume = V > 0 ? fmin(V, 1) : NAN;
+}
+
+double get_low_flow_volume(void)
+{
+    return low_flow_volume;
+}
 
 void tare_flow(void)
 {
     pulses = 0;
     volume = 0;
+
+    tare_volume_estimate();
 }
 
-double get_flow(void)
+double calibrate_flow(double r)
+{
+    return r * calibrate(r) / 2;
+}
+
+double get_measured_flow(void)
 {
     return flow;
 }
@@ -174,7 +370,355 @@ double get_flow_derivative(void)
     return derivative;
 }
 
-double get_volume(void)
+double get_measured_volume(void)
 {
     return volume;
 }
+
+#ifdef TEST
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct health health[SENSORS];
+void *flow_callbacks[N_CALLBACKS];
+
+void count_sample(enum sensor s, double t)
+{
+}
+
+void tare_volume_estimate(void)
+{
+}
+
+static int evaluations;
+static double highest;
+
+static bool count_evaluation(
+    double Q, double dQ, double t, double dt, double r, int32_t c)
+{
+    evaluations += (r > 0);
+    highest = fmax(highest, r);
+
+    return false;
+}
+
+/* A synthetic pulse train: a short preinfusion at low flow, a pause
+ * long enough to count as stagnation, then a ramp up to full flow,
+ * which slowly declines as the puck erodes. */
+
+static double synthesize(double t)
+{
+    if (t < 2) {
+        return 0;
+    } else if (t < 8) {
+        return 10;
+    } else if (t < 10) {
+        return 2;
+    } else if (t < 15) {
+        return 10 + 10 * (t - 10);
+    } else {
+        return 60 - (t - 15);
+    }
+}
+
+static double *train;
+static size_t train_length, train_size;
+
+static void add_edge(double t)
+{
+    if (train_length == train_size) {
+        train_size = train_size ? 2 * train_size : 1024;
+        train = realloc(train, train_size * sizeof(double));
+        assert(train);
+    }
+
+    train[train_length++] = t;
+}
+
+static void add_edges(double (*f)(double), double k, double length)
+{
+    for (double t = 0; t < length;) {
+        const double f_t = k * f(t);
+
+        if (f_t == 0) {
+            t += 0.01;
+            continue;
+        }
+
+        /* Add 2% of Gaussian jitter to the period, via the
+         * Box-Muller transform. */
+
+        const double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+        const double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+        t += (1 + 0.02 * sqrt(-2 * log(u)) * cos(2 * M_PI * v)) / f_t;
+        add_edge(t);
+    }
+}
+
+/* Feed the pulse train to the batched implementation, through a
+ * simulated DMA transfer of the 16-bit timestamps into the edge ring,
+ * with one batch every `skip' batch periods.  Optionally print the
+ * volume alongside a reference and return whether a flow was
+ * reported in every batch after t_0. */
+
+static bool replay(const double *V_0, double t_0, int skip, int *interrupts)
+{
+    bool measured = true;
+    int tail = 0;
+    size_t i = 0;
+
+    memset(&batch, 0, sizeof(batch));
+    memset(health, 0, sizeof(health));
+    flow_filter = SINGLE_FILTER(0.5);
+    flow = derivative = NAN;
+    evaluations = *interrupts = 0;
+
+    tare_flow();
+
+    for (long now = skip * BATCH_TICKS; ; now += skip * BATCH_TICKS) {
+        const double t = now / TICKS_PER_S;
+        int n = 0;
+
+        for (; i < train_length && train[i] <= t; i++, n++) {
+            edges[tail] = lrint(train[i] * TICKS_PER_S);
+            tail = (tail + 1) % EDGE_RING_SIZE;
+        }
+
+        process_edges(n, now, t);
+        (*interrupts)++;
+
+        if (t > t_0 && !(get_measured_flow() > 0)) {
+            measured = false;
+        }
+
+        if (V_0) {
+            printf("%f, %f, %f\n", t, get_measured_volume(), V_0[i > 0 ? i - 1 : 0]);
+        }
+
+        if (i == train_length) {
+            break;
+        }
+    }
+
+    return measured;
+}
+
+static double constant(double t)
+{
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    bool synthetic = false, sweep = false, overrun = false, low = false;
+    double k = 1;
+    int opt, interrupts;
+
+    flow_callbacks[0] = count_evaluation;
+
+    while ((opt = getopt(argc, argv, "sk:t:loc")) != -1) {
+        switch (opt) {
+        case 's':
+            synthetic = true;
+            break;
+        case 'k':
+            k = atof(optarg);
+            break;
+        case 't':
+            set_flow_timeout(atof(optarg));
+            break;
+        case 'l':
+            sweep = true;
+            break;
+        case 'o':
+            overrun = true;
+            break;
+        case 'c':
+            low = true;
+            break;
+        default:
+            return 1;
+        }
+    }
+
+    if (sweep) {
+        /* Find the lowest steady pulse frequency, at which a flow is
+         * still reported, i.e. the upper end of the dead zone, for
+         * the previous timeout of one timer period, as well as the
+         * current setting. */
+
+        const double timeouts[] = {65536 / TICKS_PER_S, get_flow_timeout()};
+
+        for (size_t j = 0; j < sizeof(timeouts) / sizeof(timeouts[0]); j++) {
+            double f;
+
+            set_flow_timeout(timeouts[j]);
+
+            for (f = 0.25; f <= 10; f += 0.25) {
+                train_length = 0;
+                add_edges(constant, f, 10);
+
+                if (replay(NULL, 5, 1, &interrupts)) {
+                    break;
+                }
+            }
+
+            printf(
+                "Timeout: %.3fs, lowest frequency: %.2fHz, "
+                "flow: %.3fml/s, measured: %.3fml/s\n",
+                get_flow_timeout(), f, f * calibrate(f) / 2, get_measured_flow());
+        }
+
+        return 0;
+    }
+
+    if (low) {
+        /* Without a low-flow calibration, the quadratic is
+         * extrapolated.  With one, the volume per pair must start at
+         * the set volume, join the quadratic continuously and be
+         * applied to the flow measured from a steady 3Hz train. */
+
+        const double f = 3, r = LOW_FLOW_F;
+
+        assert(isnan(get_low_flow_volume()));
+        assert(calibrate(f) == A * f * f + B * f + C);
+
+        set_low_flow_volume(0.15);
+
+        assert(fabs(calibrate(0) - 0.15) < 1e-12);
+        assert(fabs(calibrate(r - 1e-9) - calibrate(r)) < 1e-9);
+
+        for (int j = 1; j <= 30; j++) {
+            add_edge(j / f);
+        }
+
+        replay(NULL, INFINITY, 1, &interrupts);
+
+        printf("Low-flow volume: %.3fml, at %.0fHz: %.4fml, "
+               "flow: %.4fml/s, measured: %.4fml/s\n",
+               get_low_flow_volume(), f, calibrate(f),
+               f * calibrate(f) / 2, get_measured_flow());
+
+        assert(fabs(get_measured_flow() / (f * calibrate(f) / 2) - 1) < 0.01);
+
+        set_low_flow_volume(0);
+        assert(isnan(get_low_flow_volume()));
+
+        return 0;
+    }
+
+    if (overrun) {
+        /* A steady 30Hz pulse train must time without overruns.  A
+         * burst of more edges than the ring holds must overrun once,
+         * without reporting its rate, and batches late by more than
+         * a timer period must all overrun. */
+
+        for (int j = 1; j <= 300; j++) {
+            add_edge(j / 30.0);
+        }
+
+        assert(replay(NULL, 1, 1, &interrupts));
+        assert(health[FLOW_SENSOR].errors[OVERRUN_ERROR] == 0);
+
+        train_length = 0;
+
+        for (int j = 1; j <= 300; j++) {
+            add_edge(j / 30.0);
+
+            for (int l = 1; j == 150 && l <= 2 * EDGE_RING_SIZE; l++) {
+                add_edge(j / 30.0 + l * 1e-4);
+            }
+        }
+
+        highest = 0;
+
+        assert(replay(NULL, 6, 1, &interrupts));
+        assert(health[FLOW_SENSOR].errors[OVERRUN_ERROR] == 1);
+        assert(highest < 31);
+
+        assert(!replay(NULL, 1, 4, &interrupts));
+        assert(health[FLOW_SENSOR].errors[OVERRUN_ERROR]
+               == (unsigned)interrupts);
+
+        printf("Overruns detected\n");
+
+        return 0;
+    }
+
+    if (synthetic) {
+        add_edges(synthesize, k, 35);
+    } else {
+        /* Replay a flow log, as produced by the "lf" command.  Each
+         * sample measured the period between a pair of edges. */
+
+        for (;;) {
+            double t, y, dy_dt, r;
+            int c;
+
+            int x = scanf("%lf,%lf,%lf,%lf,%d\n", &t, &y, &dy_dt, &r, &c);
+
+            if (x == EOF) {
+                break;
+            }
+
+            if (x == 5 && r > 0) {
+                add_edge(t - 1 / r);
+                add_edge(t);
+            }
+        }
+    }
+
+    if (train_length < 2) {
+        return 1;
+    }
+
+    /* The previous implementation: the timer captured pairs of
+     * edges, interrupting once per pair and once per overflow, and
+     * any period longer than the timer's was considered stagnant. */
+
+    struct filter reference = SINGLE_FILTER(0.5);
+    double V_0 = 0, *V = calloc(train_length, sizeof(double));
+    int interrupts_0 = 0, evaluations_0 = 0;
+
+    assert(V);
+
+    for (size_t i = 1; i < train_length; i += 2) {
+        const long period = lround((train[i] - train[i - 1]) * TICKS_PER_S);
+
+        interrupts_0++;
+
+        if (period < 65536) {
+            filter_sample(&reference, TICKS_PER_S / period, train[i]);
+
+            const double y = reference.y;
+
+            evaluations_0++;
+            V_0 += A * y * y + B * y + C;
+        }
+
+        V[i - 1] = V[i] = V_0;
+    }
+
+    interrupts_0 += lrint(train[train_length - 1] * TICKS_PER_S / 65536);
+
+    printf("$data << end\n");
+    replay(V, INFINITY, 1, &interrupts);
+    printf("end\n");
+    printf("set datafile separator ','\n");
+    printf("plot $data using 1:2 with lines,  $data using 1:3 with lines\n");
+    printf("set print '-'\n");
+    printf("print 'Volume: %f'\n", get_measured_volume());
+    printf("print 'Reference volume: %f'\n", V_0);
+    printf("print 'Difference: %f%%'\n", 100 * (get_measured_volume() / V_0 - 1));
+    printf("print 'Interrupts: %d'\n", interrupts);
+    printf("print 'Reference interrupts: %d'\n", interrupts_0);
+    printf("print 'Evaluations: %d'\n", evaluations);
+    printf("print 'Reference evaluations: %d'\n", evaluations_0);
+    printf("pause mouse keypress \"Hit enter\"\n");
+
+    return 0;
+}
+#endif
@@ -0,0 +1,151 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "format.h"
+#include "usb.h"
+
+/* Number conversions for the console: formatting, written out over
+ * USB, and a minimal replacement for the C library's strtod, for
+ * parsing. */
+
+void utostr(uint64_t n, unsigned int radix, int width, int precision)
+{
+    if (n >= radix || width > 1 || precision > 1) {
+        utostr(n / radix, radix, width - 1, precision - 1);
+    }
+
+    if (n == 0) {
+        write_usb(precision > 0 ? "0" : " ", 1, false);
+    } else {
+        n %= radix;
+        const char c = n + (n < 10 ? '0' : 'a' - 10);
+        write_usb(&c, 1, false);
+    }
+}
+
+void itostr(int64_t n, unsigned int radix, int width, int precision)
+{
+    if (n < 0) {
+        write_usb("-", 1, false);
+        utostr((uint64_t)(-n), radix, width, precision);
+    } else {
+        utostr((uint64_t)n, radix, width, precision);
+    }
+}
+
+void ftostr(double n, int width, int precision)
+{
+    if (isnan(n)) {
+        write_usb("nan", 3, true);
+        return;
+    }
+
+    {
+        const int i = isinf(n);
+
+        if (i) {
+            write_usb(i > 0 ? "+" : "-", 1, false);
+            write_usb("inf", 3, true);
+            return;
+        }
+    }
+
+    if (n < 0) {
+        write_usb("-", 1, false);
+
+        utostr(-n, 10, width - precision - 1 - (n < 0), 1);
+    } else {
+        utostr(n, 10, width - precision - 1 - (n < 0), 1);
+    }
+
+    const double f = fmod(n, 1);
+
+    if (f == 0) {
+        return;
+    }
+
+    write_usb(".", 1, false);
+
+    {
+        int i;
+        uint32_t u;
+
+        for (u = fabs(f * pow(10, precision)), i = 0;
+             u > 0 && u % 10 == 0;
+             u /= 10, i++);
+
+        if (!u) {
+            write_usb("0", 1, true);
+        } else {
+            utostr(u, 10, 0, precision - i);
+        }
+    }
+}
+
+double strtod(const char *s, char **e)
+{
+    int n = 0, i = 1, u = 0;
+    bool p = false;
+
+    if (!strncmp(s, "nan", 3)) {
+        if (e) {
+            *e = (char *)s + 3;
+        }
+
+        return NAN;
+    }
+
+    if (*s == '-') {
+        i = -1;
+        s++;
+    } else if (*s == '+') {
+        s++;
+    }
+
+    if (!strncmp(s, "inf", 3)) {
+        if (e) {
+            *e = (char *)s + 3;
+        }
+
+        return i * INFINITY;
+    }
+
+    while (*s) {
+        if (isdigit((int)*s)) {
+            u = u * 10 + *s++ - '0';
+
+            if (p) {
+                n--;
+            }
+        } else if (!p && *s == '.') {
+            p = true;
+            s++;
+        } else {
+            break;
+        }
+    }
+
+    if (e) {
+        *e = (char *)s;
+    }
+
+    return (i * u * exp10(n));
+}
@@ -0,0 +1,65 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "health.h"
+#include "usb.h"
+
+struct health health[SENSORS];
+
+void count_sample(enum sensor s, double t)
+{
+    struct health *h = &health[s];
+
+    /* The gap is only meaningful between two samples taken since the
+     * last reset. */
+
+    if (h->samples > 0 && t - h->t > h->max_gap) {
+        h->max_gap = t - h->t;
+    }
+
+    h->samples++;
+    h->t = t;
+}
+
+void reset_health(void)
+{
+    memset(health, 0, sizeof(health));
+}
+
+void print_health(void)
+{
+    static const char *names[SENSORS] = {"p", "m", "t", "f"};
+
+    for (int i = 0; i < SENSORS; i++) {
+        const struct health *h = &health[i];
+
+        uprintf("%s, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %.1f\n",
+                names[i],
+                h->transactions,
+                h->samples,
+                h->errors[NACK_ERROR],
+                h->errors[ARBITRATION_ERROR],
+                h->errors[BUSY_ERROR],
+                h->errors[MASTER_ERROR],
+                h->errors[TIMEOUT_ERROR],
+                h->errors[FAULT_ERROR],
+                h->errors[OVERRUN_ERROR],
+                h->recoveries,
+                (double)h->max_gap * 1e3);
+    }
+}
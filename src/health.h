@@ -0,0 +1,61 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <inttypes.h>
+
+#include "trace.h"
+
+enum sensor {
+    PRESSURE_SENSOR,            /* NSA2862X */
+    MASS_SENSOR,                /* NAU7802 */
+    TEMPERATURE_SENSOR,         /* MAX31865 */
+    FLOW_SENSOR,
+
+    SENSORS
+};
+
+enum sensor_error {
+    NACK_ERROR,
+    ARBITRATION_ERROR,
+    BUSY_ERROR,
+    MASTER_ERROR,
+    TIMEOUT_ERROR,
+    FAULT_ERROR,
+    OVERRUN_ERROR,
+
+    SENSOR_ERRORS
+};
+
+struct health {
+    uint32_t transactions, samples, recoveries;
+    uint32_t errors[SENSOR_ERRORS];
+    double t, max_gap;
+};
+
+extern struct health health[SENSORS];
+
+#define count_transaction(S) (health[S].transactions++)
+#define count_error(S, E) (health[S].errors[E]++, trace(ERROR_EVENT, S, E))
+#define count_recovery(S) (health[S].recoveries++)
+
+void count_sample(enum sensor s, double t);
+void reset_health(void);
+void print_health(void);
+
+#endif
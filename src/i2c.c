@@ -17,9 +17,12 @@
 #include <math.h>
 #include <stddef.h>
 
-#include "callbacks.h"
-#include "filter.h"
+#include "cycles.h"
+#include "health.h"
+#include "jitter.h"
 #include "mk20dx.h"
+#include "peripherals.h"
+#include "sensors.h"
 #include "time.h"
 #include "uassert.h"
 #include "usb.h"
@@ -29,6 +32,8 @@ enum slave {
     NSA2862X=0xda,
 };
 
+#define SENSOR(SLAVE) ((SLAVE) == NSA2862X ? PRESSURE_SENSOR : MASS_SENSOR)
+
 #define WAIT()                                  \
     WAIT_WHILE(!(I2C0_S & I2C_S_IICIF), 50);    \
     I2C0_S |= I2C_S_IICIF;
@@ -49,21 +54,19 @@ enum slave {
         }                                                               \
     }
 
-struct filter pressure_filter = DOUBLE_FILTER(0.12, 60.0);
-struct filter mass_filter = SINGLE_FILTER(0.1);
-
 static struct {
     enum slave slave;
     uint8_t *buffer, length, phase, reg, value;
 } context;
 
 static bool run[2];
-static int taring_state = 1;
 
 static void read_noblock(uint8_t slave, uint8_t reg, size_t n)
 {
     static uint8_t b[3];
 
+    count_transaction(SENSOR(slave));
+
     context.phase = 0;
     context.slave = slave;
     context.reg = reg;
@@ -126,73 +129,192 @@ void run_mass(bool r)
     run[1] = r;
 }
 
-void tare_mass(void)
-{
-    taring_state = 1;
-}
+/* The PDB delay, in units of 10 bus clock cycles, between successive
+ * sensor polls and between successive half-periods of the bus
+ * recovery sequence respectively. */
+
+#define POLL_DELAY 24000
+#define RECOVERY_DELAY 24
+
+#define N_RECOVERIES 8
 
-bool is_taring_mass(void)
+static struct recovery {
+    double t, duration, latency;
+    int pulses;
+} recoveries[N_RECOVERIES];
+
+static size_t recovery_count;
+static int recovery_step = -1;
+
+static void set_pdb_delay(uint32_t n)
 {
-    return taring_state > 0;
+    PDB0_IDLY = n;
+    PDB0_SC |= PDB_SC_LDOK;
 }
 
-__attribute__((interrupt ("IRQ"))) void pdb0_isr(void)
+static void begin_recovery(double t)
 {
-    PDB0_SC &= ~PDB_SC_PDBIF;
+    struct recovery *r = &recoveries[recovery_count % N_RECOVERIES];
 
-    const double t = get_time();
+    r->t = t;
+    r->duration = r->latency = NAN;
+    r->pulses = 0;
 
-    if (t - pressure_filter.t > 0.1) {
-        filter_sample(&pressure_filter, NAN, get_time());
-    }
+    recovery_count++;
+    recovery_step = 0;
 
-    if (t - mass_filter.t > 1) {
-        filter_sample(&mass_filter, NAN, get_time());
-    }
+    count_recovery(SENSOR(context.slave));
 
-    if (!(I2C0_C1 & I2C_C1_IICEN)) {
-        PORTB_PCR2 = PORTB_PCR3 = (
-            PORT_PCR_MUX(2) | PORT_PCR_ODE | PORT_PCR_DSE);
-        I2C0_C1 |= I2C_C1_IICEN;
-    } else if (I2C0_C1 & I2C_C1_MST) {
-        uprintf("I2C module in master mode (S: %b, C1: %b)\n", I2C0_S, I2C0_C1);
+    /* Turn off the IIC module and take over the pins, with SCL and
+     * SDA released. */
 
-        I2C0_C1 = 0;
-    } else if (I2C0_S & I2C_S_BUSY) {
-        uprintf("I2C bus is busy (S: %b, C1: %b)\n", I2C0_S, I2C0_C1);
+    I2C0_C1 = 0;
 
-        /* A STOP condition was missed for some reason.  Turn off the
-         * IIC module and try to create it manually. several of these
-         * in succession might conseivably also count as clocking the
-         * slave, which might help if it is stuck. */
+    GPIOB_PDDR |= (PT(2) | PT(3));
+    GPIOB_PSOR = (PT(2) | PT(3));
+    PORTB_PCR2 = PORTB_PCR3 = (
+        PORT_PCR_MUX(1) | PORT_PCR_ODE | PORT_PCR_DSE);
 
-        I2C0_C1 = 0;
+    set_pdb_delay(RECOVERY_DELAY);
+}
 
-        /* SCL, SDA high */
+static void step_recovery(void)
+{
+    struct recovery *r = &recoveries[(recovery_count - 1) % N_RECOVERIES];
 
-        GPIOB_PDDR |= (PT(2) | PT(3));
-        GPIOB_PSOR = (PT(2) | PT(3));
-        PORTB_PCR2 = PORTB_PCR3 = (
-            PORT_PCR_MUX(1) | PORT_PCR_ODE | PORT_PCR_DSE);
+    /* Each step is executed on a separate PDB interrupt, half an SCL
+     * period (5us) apart.  While SDA is held low, presumably by a
+     * slave stuck in the middle of a byte, clock SCL to let it
+     * finish, up to 9 times.  Then generate a STOP condition
+     * manually. */
+
+    const int i = recovery_step++;
 
+    if (i < 2 * 9) {
+        if (i % 2 == 1) {
+            /* SCL high */
+
+            GPIOB_PSOR = PT(2);
+            r->pulses++;
+        } else if (!(GPIOB_PDIR & PT(3))) {
+            /* SCL low */
+
+            GPIOB_PCOR = PT(2);
+        } else {
+            /* SDA has been released; skip to the STOP. */
+
+            recovery_step = 2 * 9;
+            step_recovery();
+        }
+
+        return;
+    }
+
+    switch (i - 2 * 9) {
+    case 0:
         /* SCL low */
 
         GPIOB_PCOR = PT(2);
-        delay_us(1);
+        break;
 
+    case 1:
         /* SDA low */
 
         GPIOB_PCOR = PT(3);
-        delay_us(9);
+        break;
 
+    case 2:
         /* SCL high */
 
         GPIOB_PSOR = PT(2);
-        delay_us(1);
+        break;
 
+    case 3:
         /* SDA high, i.e. STOP */
 
         GPIOB_PSOR = PT(3);
+        break;
+
+    default:
+        /* Hand the pins back to the IIC module and resume
+         * polling. */
+
+        PORTB_PCR2 = PORTB_PCR3 = (
+            PORT_PCR_MUX(2) | PORT_PCR_ODE | PORT_PCR_DSE);
+        I2C0_C1 = I2C_C1_IICEN;
+
+        set_pdb_delay(POLL_DELAY);
+
+        r->duration = get_time() - r->t;
+        recovery_step = -1;
+    }
+}
+
+static void end_recovery(double t)
+{
+    /* Record the time from the detection of the stuck bus, to the
+     * first subsequent sample. */
+
+    if (recovery_count > 0) {
+        struct recovery *r =
+            &recoveries[(recovery_count - 1) % N_RECOVERIES];
+
+        if (isnan(r->latency)) {
+            r->latency = t - r->t;
+        }
+    }
+}
+
+void print_i2c_recoveries(void)
+{
+    const size_t n = recovery_count;
+
+    for (size_t i = n > N_RECOVERIES ? n - N_RECOVERIES : 0; i < n; i++) {
+        const struct recovery *r = &recoveries[i % N_RECOVERIES];
+
+        uprintf("%u, %.3f, %.3f, %.3f, %d\n",
+                i,
+                (double)r->t,
+                (double)r->duration * 1e3,
+                (double)r->latency * 1e3,
+                r->pulses);
+    }
+}
+
+TIMED_ISR(pdb0_isr, PDB0_ISR)
+{
+    PDB0_SC &= ~PDB_SC_PDBIF;
+
+    if (recovery_step >= 0) {
+        step_recovery();
+        PDB0_SC |= PDB_SC_SWTRIG;
+
+        return;
+    }
+
+    const double t = get_time();
+
+    expire_samples(t);
+
+    if (!(I2C0_C1 & I2C_C1_IICEN)) {
+        PORTB_PCR2 = PORTB_PCR3 = (
+            PORT_PCR_MUX(2) | PORT_PCR_ODE | PORT_PCR_DSE);
+        I2C0_C1 |= I2C_C1_IICEN;
+    } else if (I2C0_C1 & I2C_C1_MST) {
+        uprintf("I2C module in master mode (S: %b, C1: %b)\n", I2C0_S, I2C0_C1);
+        count_error(SENSOR(context.slave), MASTER_ERROR);
+
+        I2C0_C1 = 0;
+    } else if (I2C0_S & I2C_S_BUSY) {
+        uprintf("I2C bus is busy (S: %b, C1: %b)\n", I2C0_S, I2C0_C1);
+        count_error(SENSOR(context.slave), BUSY_ERROR);
+
+        /* A STOP condition was missed for some reason.  Turn off the
+         * IIC module and try to create it manually, clocking the
+         * slave first, in case it is stuck.  This happens
+         * asynchronously; see step_recovery. */
+
+        begin_recovery(t);
     } else if (run[0]) {
         read_noblock(NSA2862X, 0x2, 1);
     } else if (run[1]) {
@@ -204,19 +326,23 @@ __attribute__((interrupt ("IRQ"))) void pdb0_isr(void)
     PDB0_SC |= PDB_SC_SWTRIG;
 }
 
-__attribute__((interrupt ("IRQ"))) void i2c0_isr(void)
+TIMED_ISR(i2c0_isr, I2C0_ISR)
 {
     I2C0_S |= I2C_S_IICIF;
 
     if (I2C0_S & I2C_S_ARBL) {
         uprintf("I2C master lost arbitration.\n");
+        count_error(SENSOR(context.slave), ARBITRATION_ERROR);
         goto error;
     }
 
-    WAIT_WHILE(!(I2C0_S & I2C_S_TCF), 10);
+    WAIT_WHILE(
+        !(I2C0_S & I2C_S_TCF), 10,
+        count_error(SENSOR(context.slave), TIMEOUT_ERROR));
 
     if (context.phase <= 2 && (I2C0_S & I2C_S_RXAK)) {
         uprintf("No ACK from I2C slave.\n");
+        count_error(SENSOR(context.slave), NACK_ERROR);
         goto error;
     }
 
@@ -287,7 +413,9 @@ __attribute__((interrupt ("IRQ"))) void i2c0_isr(void)
 
         if (i == context.length - 1) {
             I2C0_C1 &= ~I2C_C1_MST;
-            WAIT_WHILE(I2C0_S & I2C_S_BUSY, 10);
+            WAIT_WHILE(
+                I2C0_S & I2C_S_BUSY, 10,
+                count_error(SENSOR(context.slave), TIMEOUT_ERROR));
 
             if (context.length == 1) {
                 /* This is the read-back of the register containing
@@ -321,120 +449,21 @@ __attribute__((interrupt ("IRQ"))) void i2c0_isr(void)
 
                 switch (context.slave) {
                 case NSA2862X:
-                {
-                    /* Calculate the pressure in bars. */
-
-                    const double P = (double)12.0 * ldexp(d, -23);
-                    filter_sample(&pressure_filter, P, get_time());
-
-                    RUN_CALLBACKS(
-                        pressure_callbacks,
-                        bool (*)(double, double, double, double, double, int32_t),
-                        pressure_filter.y, pressure_filter.dy,
-                        pressure_filter.t, pressure_filter.dt,
-                        P, d);
+                    process_pressure_sample(d);
+                    end_recovery(pressure_filter.t);
 
                     if (run[1]) {
                         read_noblock(NAU7802, 0x0, 1);
                     }
 
                     break;
-                }
                 case NAU7802:
-                {
-                    const double t = get_time();
-
-                    static double tare, m[2], s[2];
-                    static int n[2];
-
-                    /* Calculate the mass in grams. */
-
-                    const double y =
-                        (double)1.3287e-03 * d - (double)5.6135e+02;
-
-                    /* There's a lot of noise in the load cell's
-                     * signal.  Handling it via exponential smoothing
-                     * leads to long filter delays, esp. for the
-                     * derivative.  We therefore average 20, or about
-                     * 100ms worth os samples and then perform
-                     * exponential smoothing on these averaged values.
-                     * This gives a usable derivative signal, albeit
-                     * at a reduced output rate of 10Hz. */
-
-                    n[0]++;
-                    const double m_0 = m[0];
-                    m[0] += (y - m_0) / n[0];
-                    s[0] += (y - m_0) * (y - m[0]);
-
-                    if (n[0] < 20) {
-                        break;
+                    if (process_mass_sample(d)) {
+                        end_recovery(mass_filter.t);
                     }
 
-                    s[0] /= (n[0] - 1);
-
-                    /* Mass accuracy is important when the reading is
-                     * stable.  When weighing coffee beans for
-                     * instance, a tolerance below 0.1g might be
-                     * significant, when the weight increases at 2-3
-                     * g/s as coffee is produced, a 0.1g tolerance is
-                     * arguably of less importance.  We therefore keep
-                     * accumulating averaged values when successive
-                     * means are close enough, giving increased noise
-                     * reduction the longer you wait. */
-
-                    const bool p = fabs(m[0] - m[1]) < (double)0.25;
-
-                    if (p) {
-                        const double nn = n[0] + n[1];
-                        const double mm = m[0] - m[1];
-
-                        s[1] =
-                            ((n[0] - 1) * s[0] + (n[1] - 1) * s[1]) / (nn - 1)
-                            + n[0] * n[1] * mm * mm / nn / (nn - 1);
-                        m[1] = (m[0] * n[0] + m[1] * n[1]) / (n[0] + n[1]);
-                        n[1] += n[0];
-                    }
-
-                    /* Take a first tare at 3s then stay in taring
-                     * mode, while no disturbance is detected, but
-                     * don't accumulate more than 5s worth os samples
-                     * at any time, as there seems to be drift in the
-                     * sensor's ouput (perhaps due to
-                     * temperature?). */
-
-                    if ((taring_state == 1 && n[1] == 600)
-                        || (taring_state > 1 && n[1] == 1000)) {
-                        tare = m[1];
-                        mass_filter.y = mass_filter.dy = 0;
-                        taring_state++;
-                    }
-
-                    if (!p || n[1] > 1000) {
-                        s[1] = s[0];
-                        m[1] = m[0];
-                        n[1] = n[0];
-                    }
-
-                    filter_sample(&mass_filter, m[1] - tare, t);
-
-                    if (fabs(mass_filter.dy / mass_filter.dt) > 100.0) {
-                        taring_state = 1;
-                    } else if (!p && taring_state > 1) {
-                        taring_state = 0;
-                    }
-
-                    RUN_CALLBACKS(
-                        mass_callbacks,
-                        bool (*)(double, double, double, double, double, int32_t),
-                        mass_filter.y, mass_filter.dy,
-                        mass_filter.t, mass_filter.dt,
-                        m[0], d);
-
-                    s[0] = m[0] = n[0] = 0;
-
                     break;
                 }
-                }
             } else {
                 uassert(false);
             }
@@ -574,6 +603,8 @@ error:
 
 void reset_i2c(void)
 {
+    set_loop_period(MASS_RATE_LOOP, get_mass_decimation() / MASS_RATE);
+
     SIM_SCGC4 |= SIM_SCGC4_I2C0;
     SIM_SCGC5 |= SIM_SCGC5_PORTC | SIM_SCGC5_PORTB;
 
@@ -661,7 +692,7 @@ void reset_i2c(void)
      * converts at 320Hz.  Set the timer to 5ms, which seems to be a
      * good compromise. */
 
-    PDB0_IDLY = 24000;
+    PDB0_IDLY = POLL_DELAY;
     PDB0_SC = (PDB_SC_MULT(1) | PDB_SC_TRGSEL(15) | PDB_SC_PDBEN | PDB_SC_PDBIE
                | PDB_SC_LDOK);
 
@@ -671,4 +702,8 @@ void reset_i2c(void)
     PDB0_SC |= PDB_SC_SWTRIG;
 }
 
+#undef SENSOR
+#undef POLL_DELAY
+#undef RECOVERY_DELAY
+#undef N_RECOVERIES
 #undef WAIT_WHILE
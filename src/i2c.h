@@ -21,5 +21,6 @@ void reset_i2c(void);
 uint8_t read_i2c(uint8_t slave, uint8_t reg, uint8_t *buffer, size_t n);
 void write_i2c(uint8_t slave, uint8_t reg, uint8_t value);
 bool probe_i2c(uint8_t slave);
+void print_i2c_recoveries(void);
 
 #endif
@@ -0,0 +1,676 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* System identification from recorded logs.  Given a controller's
+ * log, as printed by lT, lP or lF, it fits a first-order-plus-dead-
+ * time model, from the controller's output to its process variable,
+ * and derives gains for the controller from it, by the same rules as
+ * those in control.c.
+ *
+ * The log is resampled at a fixed interval h, so that, for a dead
+ * time of d intervals, the model is
+ *
+ *   y[k + 1] = a y[k] + b u[k - d] + c,
+ *
+ * which is linear in a, b and c and can be fitted by least squares.
+ * That fit, of the model's predictions a step ahead, is biased
+ * though, when the output is noisy or the model only approximate, as
+ * when the process is held at its set-point, so it only serves as a
+ * starting point for a fit of the model's simulated output, from the
+ * first sample on, which is refined by the Levenberg-Marquardt
+ * method.  The fit is repeated for each dead time, up to a maximum,
+ * spread over a number of threads, and the dead time with the
+ * smallest residual is chosen.  The gain, time constant and resting
+ * value of the model then follow as K = b / (1 - a), tau = -h / ln(a)
+ * and y_0 = c / (1 - a), with confidence intervals from the
+ * covariance of the fit, widened to allow for the correlation of
+ * successive errors.  These still leave out any mismatch of the
+ * model, so are best taken as a lower bound on the uncertainty.
+ *
+ * Unless it is to be fitted, the resting value is taken as given,
+ * holding c at (1 - a) y_0: a log of the boiler warming up and
+ * then held at its set-point, say, mostly determines the initial
+ * slope K / tau and the steady state y_0 + K u, so that, with y_0
+ * free, K, tau and y_0 can be traded for one another, with little
+ * change in the residual. */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COLUMNS 7
+
+/* The columns of the controller logs. */
+
+enum {TIME, OUTPUT, PROCESS, SET_POINT, P_TERM, I_TERM, D_TERM};
+
+/* The quantile of the normal and chi-squared (with one degree of
+ * freedom) distributions, for 95% confidence. */
+
+#define Z_95 1.96
+#define CHI2_95 3.84
+
+/* The controllers, named after the l command that logs them, with
+ * the c command that sets their gains and the fractions of the
+ * ultimate gain and period that make up their gains, as in
+ * control.c. */
+
+static const struct loop {
+    char name, command;
+    const char *pid_name, *unit;
+    double k_p, t_i, t_d;
+} loops[] = {
+    {'T', 'h', "temperature_pid", "C", 0.6, 0.5, 0.125},
+    {'P', 'p', "pressure_pid", "bar", 0.6, 0.5, 0.125},
+    {'F', 'f', "flow_pid", "ml/s", 1.0 / 3, 0.5, 1.0 / 3},
+};
+
+#define N_LOOPS (sizeof(loops) / sizeof(loops[0]))
+
+static struct {
+    double (*x)[COLUMNS];
+    size_t n, size;
+} records;
+
+/* The resampled input and output and the residuals of the fit for
+ * each dead time. */
+
+static struct {
+    double *u, *y, *mse, rest;
+    int n, start, delays, threads, parameters;
+} data;
+
+/* Read the records of the log, skipping lines that don't parse,
+ * such as those of other logs, printed at the same time. */
+
+static size_t read_records(FILE *f)
+{
+    char line[256];
+    size_t skipped = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        double x[COLUMNS];
+        char *s = line, *end;
+        int i;
+
+        for (i = 0; i < COLUMNS; i++) {
+            x[i] = strtod(s, &end);
+
+            if (end == s
+                || (i < COLUMNS - 1 ? *end != ',' : !strchr("\r\n", *end))) {
+                break;
+            }
+
+            s = end + 1;
+        }
+
+        if (i < COLUMNS) {
+            skipped++;
+            continue;
+        }
+
+        if (records.n == records.size) {
+            records.size = records.size ? 2 * records.size : 1024;
+            records.x = realloc(records.x, records.size * sizeof(*records.x));
+
+            if (!records.x) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+
+        memcpy(records.x[records.n++], x, sizeof(x));
+    }
+
+    return skipped;
+}
+
+static int compare(const void *a, const void *b)
+{
+    const double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* The median interval between records. */
+
+static double median_interval(void)
+{
+    double *dt = malloc((records.n - 1) * sizeof(double));
+
+    if (!dt) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    for (size_t i = 1; i < records.n; i++) {
+        dt[i - 1] = records.x[i][TIME] - records.x[i - 1][TIME];
+    }
+
+    qsort(dt, records.n - 1, sizeof(double), compare);
+
+    const double h = dt[(records.n - 1) / 2];
+
+    free(dt);
+
+    return h;
+}
+
+/* Interpolate the controller's output, as a fraction, and the
+ * process variable at intervals of h, from the start of the log up
+ * to the end of the given length of time after skipping the given
+ * time, where the fit starts. */
+
+static void resample(double h, double skip, double length)
+{
+    const double t_0 = records.x[0][TIME];
+    const double t_1 = fmin(records.x[records.n - 1][TIME],
+                            t_0 + skip + length);
+    size_t i = 0;
+
+    data.start = (int)ceil(skip / h);
+    data.n = (int)floor((t_1 - t_0) / h) + 1;
+    data.u = malloc(data.n * sizeof(double));
+    data.y = malloc(data.n * sizeof(double));
+
+    if (!data.u || !data.y) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    for (int k = 0; k < data.n; k++) {
+        const double t = t_0 + k * h;
+
+        while (i + 2 < records.n && records.x[i + 1][TIME] <= t) {
+            i++;
+        }
+
+        const double *x_0 = records.x[i], *x_1 = records.x[i + 1];
+        const double s = fmin(fmax(
+            (t - x_0[TIME]) / (x_1[TIME] - x_0[TIME]), 0), 1);
+
+        data.u[k] = (x_0[OUTPUT] + s * (x_1[OUTPUT] - x_0[OUTPUT])) / 100;
+        data.y[k] = x_0[PROCESS] + s * (x_1[PROCESS] - x_0[PROCESS]);
+    }
+}
+
+/* Invert a symmetric 3x3 matrix, returning its determinant. */
+
+static double invert(double A[3][3], double B[3][3])
+{
+    B[0][0] = A[1][1] * A[2][2] - A[1][2] * A[2][1];
+    B[0][1] = A[0][2] * A[2][1] - A[0][1] * A[2][2];
+    B[0][2] = A[0][1] * A[1][2] - A[0][2] * A[1][1];
+    B[1][1] = A[0][0] * A[2][2] - A[0][2] * A[2][0];
+    B[1][2] = A[0][2] * A[1][0] - A[0][0] * A[1][2];
+    B[2][2] = A[0][0] * A[1][1] - A[0][1] * A[1][0];
+    B[1][0] = B[0][1];
+    B[2][0] = B[0][2];
+    B[2][1] = B[1][2];
+
+    const double det = A[0][0] * B[0][0] + A[0][1] * B[1][0] + A[0][2] * B[2][0];
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            B[i][j] /= det;
+        }
+    }
+
+    return det;
+}
+
+/* With the resting value given, the output is taken relative to it
+ * and c is held at zero, by leaving its row and column of the normal
+ * equations empty but for a unit diagonal and its variance at zero,
+ * once they are inverted. */
+
+static void hold_rest(double A[3][3])
+{
+    if (!isnan(data.rest)) {
+        A[2][2] = 1;
+    }
+}
+
+static void release_rest(double C[3][3])
+{
+    if (!isnan(data.rest)) {
+        C[2][2] = 0;
+    }
+}
+
+/* Fit the model for a dead time of d intervals.  The fits for all
+ * dead times are made over the same samples, so that their residuals
+ * are comparable, taking the process to have been at rest, with no
+ * input, before the log.  Returns the mean squared residual, or NaN if the
+ * problem is degenerate, e.g. for a constant input. */
+
+static double fit(int d, double theta[3], double C[3][3])
+{
+    double A[3][3] = {{0}}, v[3] = {0}, S = 0;
+
+    for (int k = data.start; k + 1 < data.n; k++) {
+        const double x[3] = {data.y[k], k >= d ? data.u[k - d] : 0,
+                             isnan(data.rest)};
+
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                A[i][j] += x[i] * x[j];
+            }
+
+            v[i] += x[i] * data.y[k + 1];
+        }
+    }
+
+    hold_rest(A);
+
+    if (fabs(invert(A, C)) < 1e-12) {
+        return NAN;
+    }
+
+    release_rest(C);
+
+    for (int i = 0; i < 3; i++) {
+        theta[i] = C[i][0] * v[0] + C[i][1] * v[1] + C[i][2] * v[2];
+    }
+
+    for (int k = data.start; k + 1 < data.n; k++) {
+        const double u = k >= d ? data.u[k - d] : 0;
+        const double e = data.y[k + 1] - (
+            theta[0] * data.y[k] + theta[1] * u + theta[2]);
+
+        S += e * e;
+    }
+
+    return S / (data.n - 1 - data.start - data.parameters);
+}
+
+/* Simulate the model, from the first sample of the fit, returning
+ * the sum of the squared errors of its output and, if J isn't null,
+ * accumulating the normal equations of its sensitivities to a, b and
+ * c. */
+
+static double simulate(int d, const double theta[3],
+                       double J[3][3], double v[3])
+{
+    double y = data.y[data.start], s[3] = {0}, S = 0;
+
+    for (int k = data.start; k + 1 < data.n; k++) {
+        const double u = k >= d ? data.u[k - d] : 0;
+
+        if (J) {
+            s[0] = y + theta[0] * s[0];
+            s[1] = u + theta[0] * s[1];
+            s[2] = isnan(data.rest) + theta[0] * s[2];
+        }
+
+        y = theta[0] * y + theta[1] * u + theta[2];
+
+        const double e = data.y[k + 1] - y;
+
+        S += e * e;
+
+        if (J) {
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    J[i][j] += s[i] * s[j];
+                }
+
+                v[i] += s[i] * e;
+            }
+        }
+    }
+
+    return S;
+}
+
+/* Refine a fit of the model so as to minimize the errors of its
+ * simulated output, rather than of its one-step predictions, by the
+ * Levenberg-Marquardt method.  Returns the mean squared error, with
+ * the covariance of the parameters, to be scaled by it, in C. */
+
+static double refine(int d, double theta[3], double C[3][3])
+{
+    double S = simulate(d, theta, NULL, NULL), lambda = 1e-3;
+
+    for (int n = 0; n < 100 && lambda < 1e9; n++) {
+        double J[3][3] = {{0}}, v[3] = {0}, A[3][3], B[3][3], next[3];
+
+        simulate(d, theta, J, v);
+        hold_rest(J);
+        memcpy(A, J, sizeof(A));
+
+        for (int i = 0; i < 3; i++) {
+            A[i][i] *= 1 + lambda;
+        }
+
+        if (fabs(invert(A, B)) == 0) {
+            break;
+        }
+
+        for (int i = 0; i < 3; i++) {
+            next[i] = theta[i]
+                + B[i][0] * v[0] + B[i][1] * v[1] + B[i][2] * v[2];
+        }
+
+        const double T = next[0] > 0 && next[0] < 1
+            ? simulate(d, next, NULL, NULL) : (double)INFINITY;
+
+        if (T < S) {
+            const bool done = S - T < 1e-12 * S;
+
+            memcpy(theta, next, sizeof(next));
+            S = T;
+            lambda /= 10;
+
+            if (done) {
+                break;
+            }
+        } else {
+            lambda *= 10;
+        }
+    }
+
+    double J[3][3] = {{0}}, v[3] = {0};
+
+    simulate(d, theta, J, v);
+    hold_rest(J);
+    invert(J, C);
+    release_rest(C);
+
+    return S / (data.n - 1 - data.start - data.parameters);
+}
+
+/* The lag-one autocorrelation of the errors of the simulated output. */
+
+static double autocorrelation(int d, const double theta[3])
+{
+    double y = data.y[data.start], e_0 = 0, S_0 = 0, S_1 = 0;
+
+    for (int k = data.start; k + 1 < data.n; k++) {
+        y = theta[0] * y + theta[1] * (k >= d ? data.u[k - d] : 0) + theta[2];
+
+        const double e = data.y[k + 1] - y;
+
+        S_0 += e * e;
+        S_1 += e * e_0;
+        e_0 = e;
+    }
+
+    return S_1 / S_0;
+}
+
+static void *fit_delays(void *arg)
+{
+    for (int d = (int)(size_t)arg; d < data.delays; d += data.threads) {
+        double theta[3], C[3][3];
+
+        data.mse[d] = fit(d, theta, C);
+
+        if (!isnan(data.mse[d])) {
+            data.mse[d] = theta[0] > 0 && theta[0] < 1
+                ? refine(d, theta, C) : (double)NAN;
+        }
+    }
+
+    return NULL;
+}
+
+/* The frequency at which the model's phase lag is half a cycle, for
+ * a nonzero dead time, by bisection. */
+
+static double ultimate_frequency(double tau, double theta)
+{
+    double w_0 = 0, w_1 = M_PI / theta;
+
+    while (w_1 - w_0 > 1e-9 * w_1) {
+        const double w = (w_0 + w_1) / 2;
+
+        if (atan(w * tau) + w * theta < M_PI) {
+            w_0 = w;
+        } else {
+            w_1 = w;
+        }
+    }
+
+    return (w_0 + w_1) / 2;
+}
+
+int main(int argc, char *argv[])
+{
+    const struct loop *loop = &loops[0];
+    double h = NAN, skip = 0, length = INFINITY, max_delay = 60, set = NAN;
+    double rest = NAN;
+    bool free_rest = false;
+    int opt, threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "k:h:s:l:d:r:fS:j:")) != -1) {
+        switch (opt) {
+        case 'k':
+            for (loop = loops;
+                 loop < loops + N_LOOPS && loop->name != optarg[0];
+                 loop++);
+
+            if (loop == loops + N_LOOPS || optarg[1]) {
+                fprintf(stderr, "Unknown log %s\n", optarg);
+                return 1;
+            }
+
+            break;
+        case 'h':
+            h = atof(optarg);
+            break;
+        case 's':
+            skip = atof(optarg);
+            break;
+        case 'l':
+            length = atof(optarg);
+            break;
+        case 'd':
+            max_delay = atof(optarg);
+            break;
+        case 'r':
+            rest = atof(optarg);
+            break;
+        case 'f':
+            free_rest = true;
+            break;
+        case 'S':
+            set = atof(optarg);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-k T|P|F] [-h INTERVAL] [-s SKIP] [-l LENGTH] "
+                    "[-d MAX_DELAY] [-r REST | -f] [-S SET] [-j THREADS] "
+                    "[FILE]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    FILE *f = stdin;
+
+    if (optind < argc && !(f = fopen(argv[optind], "r"))) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    const size_t skipped = read_records(f);
+
+    if (records.n < 2) {
+        fprintf(stderr, "Need at least two records to fit\n");
+        return 1;
+    }
+
+    if (isnan(h)) {
+        h = median_interval();
+    }
+
+    /* The set-point for the c command, unless given, is the last one
+     * logged. */
+
+    for (size_t i = records.n; i > 0 && isnan(set); i--) {
+        set = records.x[i - 1][SET_POINT];
+    }
+
+    /* The resting value, unless given or to be fitted, is the first
+     * one logged, since the fit takes the process to have been at
+     * rest before the log. */
+
+    data.rest = free_rest ? (double)NAN
+        : isnan(rest) ? records.x[0][PROCESS] : rest;
+    data.parameters = free_rest ? 3 : 2;
+    resample(h, skip, length);
+
+    for (int k = 0; k < data.n && !isnan(data.rest); k++) {
+        data.y[k] -= data.rest;
+    }
+    data.delays = (int)floor(max_delay / h) + 1;
+    data.threads = threads > 0 ? threads : 1;
+    data.mse = malloc(data.delays * sizeof(double));
+
+    if (!data.mse) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    const int m = data.n - 1 - data.start;
+
+    if (m < data.delays + 10) {
+        fprintf(stderr, "Too few samples for the maximum dead time\n");
+        return 1;
+    }
+
+    pthread_t workers[data.threads];
+
+    for (int i = 0; i < data.threads; i++) {
+        if (pthread_create(&workers[i], NULL, fit_delays, (void *)(size_t)i)) {
+            fprintf(stderr, "Can't create thread\n");
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < data.threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    /* Choose the dead time with the smallest residual and, for its
+     * interval, take those whose residual isn't significantly
+     * larger, by a likelihood ratio test. */
+
+    int d = -1, d_0 = -1, d_1 = -1;
+
+    for (int i = 0; i < data.delays; i++) {
+        if (!isnan(data.mse[i]) && (d < 0 || data.mse[i] < data.mse[d])) {
+            d = i;
+        }
+    }
+
+    if (d < 0) {
+        fprintf(stderr, "The log doesn't excite the process\n");
+        return 1;
+    }
+
+    for (int i = 0; i < data.delays; i++) {
+        if (data.mse[i] <= data.mse[d] * (1 + CHI2_95 / (m - data.parameters))) {
+            d_1 = i;
+            d_0 = d_0 < 0 ? i : d_0;
+        }
+    }
+
+    double theta[3], C[3][3];
+    double s2 = fit(d, theta, C);
+
+    if (theta[0] > 0 && theta[0] < 1) {
+        s2 = refine(d, theta, C);
+    }
+    const double a = theta[0], b = theta[1], c = theta[2];
+
+    printf("# %s, %zu records, %zu skipped, %d samples at %g s, "
+           "dead times up to %g s, %d threads\n",
+           loop->pid_name, records.n, skipped, m, h,
+           (data.delays - 1) * h, data.threads);
+
+    if (!(a > 0 && a < 1)) {
+        printf("# Not a stable first-order response (a = %g)\n", a);
+        return 1;
+    }
+
+    /* Propagate the covariance of a, b and c to the model's
+     * parameters, to first order, widening it by (1 + r) / (1 - r),
+     * for errors with a lag-one autocorrelation of r, as if they
+     * followed a first-order autoregression. */
+
+    const double g_K[3] = {b / (1 - a) / (1 - a), 1 / (1 - a), 0};
+    const double g_tau[3] = {h / (a * log(a) * log(a)), 0, 0};
+    const double g_y[3] = {c / (1 - a) / (1 - a), 0, 1 / (1 - a)};
+    const double *g[3] = {g_K, g_tau, g_y};
+    const double r = fmax(autocorrelation(d, theta), 0);
+    double sigma[3];
+
+    for (int i = 0; i < 3; i++) {
+        double v = 0;
+
+        for (int j = 0; j < 3; j++) {
+            for (int k = 0; k < 3; k++) {
+                v += g[i][j] * C[j][k] * g[i][k];
+            }
+        }
+
+        sigma[i] = Z_95 * sqrt(s2 * v * (1 + r) / (1 - r));
+    }
+
+    const double K = b / (1 - a), tau = -h / log(a);
+    const double y_0 = isnan(data.rest) ? c / (1 - a) : data.rest;
+    const double L = d * h;
+
+    printf("# K = %g +/- %g %s, tau = %g +/- %g s, "
+           "theta = %g (%g-%g) s, y_0 = %g +/- %g %s\n",
+           K, sigma[0], loop->unit, tau, sigma[1],
+           L, d_0 * h, d_1 * h, y_0, sigma[2], loop->unit);
+    printf("# RMS residual %g %s\n", sqrt(s2), loop->unit);
+
+    if (d == 0 || K <= 0) {
+        printf("# No ultimate gain, for %s\n",
+               K <= 0 ? "a negative process gain" : "a zero dead time");
+        return 1;
+    }
+
+    /* The ultimate gain and period, at which the loop would oscillate
+     * under proportional control, from which the gains follow. */
+
+    const double w = ultimate_frequency(tau, L);
+    const double K_U = sqrt(1 + w * tau * w * tau) / K, P_U = 2 * M_PI / w;
+    const double gains[3] = {loop->k_p * K_U, loop->t_i * P_U,
+                             loop->t_d * P_U};
+
+    printf("# K_U = %g, P_U = %g s\n", K_U, P_U);
+    printf("struct pid %s = {%g, %g, %g, NAN};\n",
+           loop->pid_name, gains[0], gains[1], gains[2]);
+
+    if (!isnan(set)) {
+        printf("c%c%g,%g,%g,%g\n",
+               loop->command, set, gains[0], gains[1], gains[2]);
+    }
+
+    return 0;
+}
@@ -17,6 +17,7 @@
 #include <stdbool.h>
 
 #include "callbacks.h"
+#include "cycles.h"
 #include "mk20dx.h"
 #include "usb.h"
 #include "time.h"
@@ -60,7 +61,7 @@ void reset_input(void)
 
     if (!(GPIOD_PDIR & PT(4))) {
         await_usb_enumeration();
-         __asm__ volatile ("bkpt #251");
+        enter_loader();
     }
 
     /* Encoder pulses */
@@ -102,7 +103,7 @@ void reset_input(void)
     enable_interrupt(PIT3_IRQ);
 }
 
-__attribute__((interrupt ("IRQ"))) void pit2_isr(void)
+TIMED_ISR(pit2_isr, PIT2_ISR)
 {
     /* If end-of-rotation-cycle debouncing is complete, reset the
      * current rotation direction and disable the timer. */
@@ -110,12 +111,14 @@ __attribute__((interrupt ("IRQ"))) void pit2_isr(void)
     PIT_TFLG(2) |= PIT_TFLG_TIF;
     PIT_TCTRL(2) &= ~PIT_TCTRL_TEN;
 
+    begin_cycles(TURN_CHAIN);
     RUN_CALLBACKS(turn_callbacks, bool (*)(int), delta);
+    end_cycles(TURN_CHAIN);
 
     delta = 0;
 }
 
-__attribute__((interrupt ("IRQ"))) void pit3_isr(void)
+TIMED_ISR(pit3_isr, PIT3_ISR)
 {
     /* Register the click and disable the timer. */
 
@@ -133,9 +136,11 @@ __attribute__((interrupt ("IRQ"))) void pit3_isr(void)
     if (panel_button && (
             ((PORTB_PCR16 & PORT_PCR_IRQC(1)) == 0)
             == (((GPIOB_PDIR & PT(16)) == 0)))) {
+        begin_cycles(PANEL_CHAIN);
         RUN_CALLBACKS(
             panel_callbacks, bool (*)(bool),
             (PORTB_PCR16 & PORT_PCR_IRQC(1)) == 0);
+        end_cycles(PANEL_CHAIN);
 
         PORTB_PCR16 ^= PORT_PCR_IRQC(3);
     }
@@ -143,9 +148,11 @@ __attribute__((interrupt ("IRQ"))) void pit3_isr(void)
     if (encoder_button && (
             ((PORTD_PCR4 & PORT_PCR_IRQC(1)) == 0)
             == (((GPIOD_PDIR & PT(4)) == 0)))) {
+        begin_cycles(CLICK_CHAIN);
         RUN_CALLBACKS(
             click_callbacks, bool (*)(bool),
             (PORTD_PCR4 & PORT_PCR_IRQC(1)) == 0);
+        end_cycles(CLICK_CHAIN);
 
         PORTD_PCR4 ^= PORT_PCR_IRQC(3);
     }
@@ -154,7 +161,7 @@ __attribute__((interrupt ("IRQ"))) void pit3_isr(void)
     encoder_button = 0;
 }
 
-__attribute__((interrupt ("IRQ"))) void portb_isr(void)
+TIMED_ISR(portb_isr, PORTB_ISR)
 {
     PORTB_PCR16 |= PORT_PCR_ISF;
 
@@ -169,7 +176,7 @@ __attribute__((interrupt ("IRQ"))) void portb_isr(void)
     panel_button = 1;
 }
 
-__attribute__((interrupt ("IRQ"))) void portd_isr(void)
+TIMED_ISR(portd_isr, PORTD_ISR)
 {
     if (PORTD_ISFR & PT(4)) {
         PORTD_ISFR |= PT(4);
@@ -0,0 +1,222 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+
+#include "jitter.h"
+#include "mk20dx.h"
+#include "time.h"
+#include "usb.h"
+
+/* Statistics of the interval between successive samples of each
+ * loop and of the latency from a sample to the actuation of the
+ * output computed from it, in seconds, with a histogram of their
+ * binary logarithm in milliseconds, from under 1ms in the first bin
+ * to 1024ms and over in the last. */
+
+#define BINS 12
+
+struct statistics {
+    unsigned int count;
+    double sum, sum_squares, max;
+    unsigned int bins[BINS];
+};
+
+/* The nominal period of the flow and mass rate loops depends on the
+ * configuration of their drivers, which set it (see set_loop_period);
+ * the ones given here are their defaults. */
+
+static struct {
+    const char *name;
+    double period, limit;
+} loops[LOOPS] = {
+    {"temperature", 1.0 / 16, 0.5},
+    {"pressure", 0.01, 0.1},
+    {"flow", 0.05, 1},
+    {"mass_rate", 0.05, 1},
+};
+
+static struct {
+    double t;
+    unsigned int late, stale;
+    struct statistics intervals, latencies;
+} timing[LOOPS];
+
+/* The sample time behind the output last written to each actuator,
+ * until it's actuated. */
+
+static struct {
+    double t;
+    enum control_loop loop;
+} pending[ACTUATORS];
+
+/* Mask interrupts, returning the previous mask, so that callers that
+ * already had them masked stay masked.  Host builds, such as the
+ * simulator's, have no interrupts to mask, while the software-in-the-
+ * loop build only runs ISRs between statements of the firmware. */
+
+static inline uint32_t mask_interrupts(void)
+{
+#if defined(HOST) || defined(SIL)
+    return 0;
+#else
+    uint32_t primask;
+
+    __asm__ volatile ("mrs %0, primask\n\tcpsid i"
+                      : "=r" (primask) :: "memory");
+
+    return primask;
+#endif
+}
+
+static inline void restore_interrupts(uint32_t primask)
+{
+#if !defined(HOST) && !defined(SIL)
+    __asm__ volatile ("msr primask, %0" :: "r" (primask) : "memory");
+#endif
+}
+
+static void add_sample(struct statistics *s, double x)
+{
+    int i = 0;
+
+    for (double y = x * 1e3; y >= 1 && i < BINS - 1; y /= 2, i++);
+
+    s->count++;
+    s->sum += x;
+    s->sum_squares += x * x;
+    s->max = fmax(s->max, x);
+    s->bins[i]++;
+}
+
+/* Time a sample of a loop's process variable, taken at t, returning
+ * its freshness, so that the controller can degrade gracefully.
+ * Repeated samples, e.g. those the temperature sensor rejects, don't
+ * count. */
+
+enum freshness sample_loop(enum control_loop l, double t)
+{
+    const double dt = t - timing[l].t;
+
+    if (!(dt > 0)) {
+        if (isnan(timing[l].t)) {
+            timing[l].t = t;
+        }
+
+        return FRESH;
+    }
+
+    timing[l].t = t;
+    add_sample(&timing[l].intervals, dt);
+
+    if (dt > loops[l].limit) {
+        timing[l].stale++;
+        return STALE;
+    }
+
+    if (dt > 2 * loops[l].period) {
+        timing[l].late++;
+        return LATE;
+    }
+
+    return FRESH;
+}
+
+/* Note that the output about to be written to an actuator was
+ * computed from a loop's sample taken at t.  The latency is measured
+ * once the actuator acts on it, either immediately, or at the next
+ * trigger pulse. */
+
+void drive_actuator(enum actuator a, enum control_loop l, double t)
+{
+    const uint32_t primask = mask_interrupts();
+
+    pending[a].t = t;
+    pending[a].loop = l;
+    restore_interrupts(primask);
+}
+
+void actuate(enum actuator a)
+{
+    if (isnan(pending[a].t)) {
+        return;
+    }
+
+    add_sample(&timing[pending[a].loop].latencies,
+               get_time() - pending[a].t);
+    pending[a].t = NAN;
+}
+
+/* Set the nominal period of a loop, in seconds. */
+
+void set_loop_period(enum control_loop l, double T)
+{
+    loops[l].period = T;
+}
+
+void reset_jitter(void)
+{
+    for (int i = 0; i < LOOPS; i++) {
+        timing[i].t = NAN;
+    }
+
+    for (int i = 0; i < ACTUATORS; i++) {
+        pending[i].t = NAN;
+    }
+}
+
+static void print_statistics(const struct statistics *s)
+{
+    const double mean = s->count > 0 ? s->sum / s->count : 0;
+    const double variance = (
+        s->count > 0 ? s->sum_squares / s->count - mean * mean : 0);
+
+    uprintf("%.2f, %.2f, %.2f",
+            mean * 1e3, sqrt(fmax(variance, 0)) * 1e3, s->max * 1e3);
+
+    for (int i = 0; i < BINS; i++) {
+        uprintf(", %u", s->bins[i]);
+    }
+
+    uprintf("\n");
+}
+
+/* Print, for each loop, a line for the sample intervals, with the
+ * number of samples and how many were late and stale, followed by
+ * the mean, standard deviation and maximum in milliseconds and the
+ * histogram, and a similar line for the latencies, all since the
+ * last call. */
+
+void print_jitter(void)
+{
+    for (int i = 0; i < LOOPS; i++) {
+        const uint32_t primask = mask_interrupts();
+        const struct statistics intervals = timing[i].intervals;
+        const struct statistics latencies = timing[i].latencies;
+        const unsigned int late = timing[i].late, stale = timing[i].stale;
+
+        timing[i].intervals = timing[i].latencies = (struct statistics){0};
+        timing[i].late = timing[i].stale = 0;
+        restore_interrupts(primask);
+
+        uprintf("%s, interval, %u, %u, %u, ",
+                loops[i].name, intervals.count, late, stale);
+        print_statistics(&intervals);
+
+        uprintf("%s, latency, %u, ", loops[i].name, latencies.count);
+        print_statistics(&latencies);
+    }
+}
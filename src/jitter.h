@@ -0,0 +1,58 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JITTER_H
+#define JITTER_H
+
+/* The control loops, timed from the samples of their process
+ * variable to the actuator their output drives. */
+
+enum control_loop {
+    TEMPERATURE_LOOP,
+    PRESSURE_LOOP,
+    FLOW_LOOP,
+    MASS_RATE_LOOP,
+
+    LOOPS
+};
+
+/* In the order of the PIT channels that fire them. */
+
+enum actuator {
+    HEATER,
+    PUMP,
+
+    ACTUATORS
+};
+
+/* A sample is late, when it arrives more than two nominal periods
+ * after the previous one, and stale, when it arrives after a gap
+ * long enough for the controller's state to no longer apply. */
+
+enum freshness {
+    FRESH,
+    LATE,
+    STALE
+};
+
+enum freshness sample_loop(enum control_loop l, double t);
+void set_loop_period(enum control_loop l, double T);
+void drive_actuator(enum actuator a, enum control_loop l, double t);
+void actuate(enum actuator a);
+void reset_jitter(void);
+void print_jitter(void);
+
+#endif
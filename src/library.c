@@ -0,0 +1,337 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "crc.h"
+#include "flash.h"
+#include "library.h"
+#include "mk20dx.h"
+#include "profile.h"
+#include "time.h"
+#include "usb.h"
+
+/* The first sector(s) of the FlexNVM hold the selection log, a
+ * sequence of programmed longwords, each the slot selected at the
+ * time, followed by erased ones.  The log is only erased when full,
+ * to spread the wear.  Each library slot follows, holding an entry
+ * and an image of the program buffer, the stages of which point
+ * into it. */
+
+#define SLOT_SIZE 2048
+#define LOG_ADDRESS FLEXNVM_BASE
+#define LOG_SIZE (SLOT_SIZE / sizeof(uint32_t))
+#define SLOT_ADDRESS(i) (FLEXNVM_BASE + ((i) + 1) * SLOT_SIZE)
+#define ERASED 0xffffffff
+
+/* A selection is only logged once it has settled, i.e. hasn't
+ * changed for this many seconds, as the wheel steps through the
+ * profiles on the way to the one wanted and programming the FlexNVM
+ * both wears it and takes milliseconds, too long for an ISR. */
+
+#define SETTLE_TIME 5
+
+/* Bump when the layout of stages changes, to invalidate stored
+ * profiles. */
+
+#define VERSION 1
+
+struct entry {
+    uint32_t crc, version;
+    uintptr_t base;
+    struct profile profile;
+    char name[LIBRARY_NAME_SIZE];
+};
+
+_Static_assert(SLOT_SIZE % FLEXNVM_SECTOR_SIZE == 0,
+               "Slots must consist of whole sectors.");
+_Static_assert(SLOT_ADDRESS(LIBRARY_SLOTS) <= FLEXNVM_BASE + FLEXNVM_SIZE,
+               "The library must fit in the FlexNVM.");
+_Static_assert(sizeof(struct entry) % 4 == 0,
+               "Entries must consist of whole longwords.");
+
+static const uint32_t * const selection_log = (const uint32_t *)LOG_ADDRESS;
+static size_t selection = SIZE_MAX, logged = SIZE_MAX;
+static double selection_time;
+
+/* Set while the FlexNVM is being erased or programmed, during which
+ * it can't be read, e.g. from a preempting interrupt. */
+
+static volatile bool busy;
+
+/* A store requested from an ISR, carried out from the main loop (see
+ * save_library_profile). */
+
+static struct {
+    size_t slot;
+    char name[LIBRARY_NAME_SIZE];
+} request = {.slot = SIZE_MAX};
+
+/* Whether a range of the FlexNVM is data flash, which it isn't on a
+ * part partitioned for EEPROM emulation. */
+
+static bool is_data_flash(uintptr_t address, size_t n)
+{
+    return address + n <= FLEXNVM_BASE + get_data_flash_size();
+}
+
+static uint32_t calculate_entry_crc(const struct entry *e, const void *image)
+{
+    const size_t n = sizeof(struct entry) - sizeof(e->crc);
+
+    return crc32(crc32(0, &e->version, n), image, e->profile.alloc);
+}
+
+/* Validate a slot's entry, returning NULL if it's erased, corrupt or
+ * was stored by an incompatible firmware. */
+
+static const struct entry *get_entry(size_t slot)
+{
+    if (slot >= LIBRARY_SLOTS || busy
+        || !is_data_flash(SLOT_ADDRESS(slot), SLOT_SIZE)) {
+        return NULL;
+    }
+
+    const struct entry *e = (const struct entry *)SLOT_ADDRESS(slot);
+
+    if (e->version != (VERSION << 16 | sizeof(struct stage))
+        || e->base != (uintptr_t)get_profile_image()
+        || e->profile.size == 0
+        || e->profile.alloc > SLOT_SIZE - sizeof(struct entry)
+        || e->crc != calculate_entry_crc(e, e + 1)) {
+        return NULL;
+    }
+
+    return e;
+}
+
+/* The log is programmed in order, so the first erased longword can
+ * be found by bisection. */
+
+static size_t find_log_end(void)
+{
+    size_t a = 0, b = LOG_SIZE;
+
+    while (a < b) {
+        const size_t c = (a + b) / 2;
+
+        if (selection_log[c] == ERASED) {
+            b = c;
+        } else {
+            a = c + 1;
+        }
+    }
+
+    return a;
+}
+
+static size_t get_logged_selection(void)
+{
+    if (logged == SIZE_MAX) {
+        if (!is_data_flash(LOG_ADDRESS, SLOT_SIZE)) {
+            logged = LIBRARY_BUILTIN;
+
+            return logged;
+        }
+
+        const size_t n = find_log_end();
+
+        if (n == 0 || selection_log[n - 1] > LIBRARY_BUILTIN) {
+            logged = LIBRARY_BUILTIN;
+        } else {
+            logged = selection_log[n - 1];
+        }
+    }
+
+    return logged;
+}
+
+size_t get_library_selection(void)
+{
+    if (selection == SIZE_MAX) {
+        selection = get_logged_selection();
+    }
+
+    return selection;
+}
+
+const char *get_library_name(size_t slot)
+{
+    if (slot == LIBRARY_BUILTIN) {
+        return "Built-in";
+    }
+
+    const struct entry *e = get_entry(slot);
+
+    return e ? e->name : NULL;
+}
+
+/* Request that the current profile be stored in a slot, under the
+ * given name.  Erasing and programming the slot takes too long for
+ * an ISR, which is where requests come from, so the store is carried
+ * out later on (see save_library_profile).  Only one request can be
+ * pending and none are accepted during a shot. */
+
+bool store_library_profile(size_t slot, const char *name)
+{
+    if (slot >= LIBRARY_SLOTS || busy || request.slot != SIZE_MAX
+        || !isnan(get_shot_time())) {
+        return false;
+    }
+
+    memset(request.name, 0, LIBRARY_NAME_SIZE);
+    strncpy(request.name, name, LIBRARY_NAME_SIZE - 1);
+    request.slot = slot;
+
+    return true;
+}
+
+bool is_library_store_pending(void)
+{
+    return request.slot != SIZE_MAX;
+}
+
+/* Carry out a pending store.  This is called periodically, outside
+ * of ISRs. */
+
+void save_library_profile(void)
+{
+    if (request.slot == SIZE_MAX) {
+        return;
+    }
+
+    const struct profile *p = get_profile();
+    struct entry e = {
+        .version = VERSION << 16 | sizeof(struct stage),
+        .base = (uintptr_t)get_profile_image(),
+        .profile = *p,
+    };
+
+    memcpy(e.name, request.name, LIBRARY_NAME_SIZE);
+    e.crc = calculate_entry_crc(&e, get_profile_image());
+
+    /* A shot may have started since the request.  Program the entry
+     * last, so that an interrupted store leaves the slot invalid. */
+
+    const uintptr_t a = SLOT_ADDRESS(request.slot);
+    bool success = (p->size > 0
+                    && p->alloc <= SLOT_SIZE - sizeof(struct entry)
+                    && is_data_flash(a, SLOT_SIZE)
+                    && isnan(get_shot_time()));
+
+    busy = success;
+
+    for (size_t i = 0; success && i < SLOT_SIZE; i += FLEXNVM_SECTOR_SIZE) {
+        success = erase_flash_sector(a + i);
+    }
+
+    success = (success
+               && program_flash(a + sizeof(e), get_profile_image(), p->alloc)
+               && program_flash(a, &e, sizeof(e)));
+
+    busy = false;
+    request.slot = SIZE_MAX;
+}
+
+/* Load a slot's profile, in time independent of its contents, save
+ * for a CRC and copy of its image.  The built-in profile is parsed
+ * instead. */
+
+bool load_library_profile(size_t slot)
+{
+    if (slot == LIBRARY_BUILTIN) {
+        return load_default_profile();
+    }
+
+    const struct entry *e = get_entry(slot);
+
+    return e && load_profile(&e->profile, e + 1);
+}
+
+/* Load a slot's profile, making it the selection.  It's only loaded
+ * into RAM here, as this is called from ISRs; the selection is logged
+ * later on (see save_library_selection). */
+
+bool select_library_profile(size_t slot)
+{
+    if (busy || !load_library_profile(slot)) {
+        return false;
+    }
+
+    selection = slot;
+    selection_time = get_time();
+
+    return true;
+}
+
+/* Log the selection, once it has settled, so that it's loaded at
+ * boot.  This is called periodically, outside of ISRs. */
+
+void save_library_selection(void)
+{
+    disable_interrupts();
+    const size_t slot = get_library_selection();
+    const double t = selection_time;
+    enable_interrupts();
+
+    if (busy || slot == get_logged_selection()
+        || get_time() - t < SETTLE_TIME
+        || !is_data_flash(LOG_ADDRESS, SLOT_SIZE)) {
+        return;
+    }
+
+    const uint32_t w = slot;
+    size_t n = find_log_end();
+    bool success = true;
+
+    busy = true;
+
+    if (n == LOG_SIZE) {
+        for (size_t i = 0; success && i < SLOT_SIZE;
+             i += FLEXNVM_SECTOR_SIZE) {
+            success = erase_flash_sector(LOG_ADDRESS + i);
+        }
+
+        n = 0;
+    }
+
+    success = (success
+               && program_flash((uintptr_t)(selection_log + n), &w, sizeof(w)));
+
+    busy = false;
+
+    /* Retry a failed attempt once the selection settles again. */
+
+    if (success) {
+        logged = slot;
+    } else {
+        selection_time = get_time();
+    }
+}
+
+void print_library(void)
+{
+    const size_t k = get_library_selection();
+
+    for (size_t i = 0; i <= LIBRARY_BUILTIN; i++) {
+        const char *name = get_library_name(i);
+
+        if (name) {
+            uprintf("%s%u: %s\n", i == k ? "*" : " ", (unsigned)i, name);
+        }
+    }
+}
@@ -0,0 +1,40 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The library holds a number of named profiles, in slots, plus the
+ * built-in profile, which can be selected as slot LIBRARY_SLOTS. */
+
+#define LIBRARY_SLOTS 8
+#define LIBRARY_BUILTIN LIBRARY_SLOTS
+#define LIBRARY_NAME_SIZE 16
+
+bool store_library_profile(size_t slot, const char *name);
+bool is_library_store_pending(void);
+void save_library_profile(void);
+bool load_library_profile(size_t slot);
+bool select_library_profile(size_t slot);
+void save_library_selection(void);
+size_t get_library_selection(void);
+const char *get_library_name(size_t slot);
+void print_library(void);
+
+#endif
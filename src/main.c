@@ -20,91 +20,26 @@
 #include <math.h>
 
 #include "callbacks.h"
+#include "cycles.h"
+#include "estimator.h"
 #include "fonts.h"
+#include "health.h"
 #include "i2c.h"
+#include "jitter.h"
+#include "library.h"
+#include "memory.h"
 #include "mk20dx.h"
+#include "parse.h"
 #include "peripherals.h"
 #include "profile.h"
 #include "time.h"
+#include "trace.h"
 #include "uassert.h"
 #include "usb.h"
+#include "yield.h"
 
 static bool update_display = true;
 
-#define K_U 0.125
-#define P_U 16.5
-
-struct pid temperature_pid = {0.6 * K_U, 0.5 * P_U, 0.125 * P_U, NAN};
-
-#undef K_U
-#undef P_U
-
-#define K_U 0.2
-#define P_U 1.5
-
-struct pid pressure_pid = {0.6 * K_U, 0.5 * P_U, 0.125 * P_U, NAN};
-
-#undef K_U
-#undef P_U
-
-#define K_U 0.24
-#define P_U 0.6
-
-struct pid flow_pid = {K_U / 3, 0.5 * P_U, P_U / 3, NAN};
-
-#undef K_U
-#undef P_U
-
-double strtod(const char *s, char **e)
-{
-    int n = 0, i = 1, u = 0;
-    bool p = false;
-
-    if (!strncmp(s, "nan", 3)) {
-        if (e) {
-            *e = (char *)s + 3;
-        }
-
-        return NAN;
-    }
-
-    if (*s == '-') {
-        i = -1;
-        s++;
-    } else if (*s == '+') {
-        s++;
-    }
-
-    if (!strncmp(s, "inf", 3)) {
-        if (e) {
-            *e = (char *)s + 3;
-        }
-
-        return i * INFINITY;
-    }
-
-    while (*s) {
-        if (isdigit((int)*s)) {
-            u = u * 10 + *s++ - '0';
-
-            if (p) {
-                n--;
-            }
-        } else if (!p && *s == '.') {
-            p = true;
-            s++;
-        } else {
-            break;
-        }
-    }
-
-    if (e) {
-        *e = (char *)s;
-    }
-
-    return (i * u * exp10(n));
-}
-
 static int log_line_count;
 
 #define LOGGING_CALLBACK_BODY(FMT, ...)         \
@@ -131,17 +66,29 @@ LOGGING_CALLBACK_BODY("wheel %s\n", down ? "down" : "up")
 static bool panel_logging_callback(bool down)
 LOGGING_CALLBACK_BODY("panel %s\n", down ? "down" : "up")
 
+/* Shots are logged off the profile tick, but decimated like the
+ * profile log, so that raising the tick rate doesn't flood the
+ * console. */
+
 static bool shot_logging_callback(void)
-LOGGING_CALLBACK_BODY(
-    "%.3f, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f\n",
-    (double)get_time(),
-    (double)temperature_filter.y,
-    (double)pressure_filter.y,
-    (double)get_flow(),
-    (double)get_volume(),
-    (double)mass_filter.y,
-    (double)get_heat_power(),
-    (double)get_pump_flow());
+{
+    static unsigned int ticks;
+
+    if (log_line_count != 0 && ticks++ % get_log_decimation() != 0) {
+        return false;
+    }
+
+    LOGGING_CALLBACK_BODY(
+        "%.3f, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f\n",
+        (double)get_time(),
+        (double)temperature_filter.y,
+        (double)pressure_filter.y,
+        (double)get_flow(),
+        (double)get_volume(),
+        (double)mass_filter.y,
+        (double)get_heat_power(),
+        (double)get_pump_flow());
+}
 
 #define DEFINE_SENSOR_LOGGING_CALLBACK(WHAT)                            \
 static bool WHAT ##_logging_callback(                                   \
@@ -170,6 +117,21 @@ DEFINE_PID_LOGGING_CALLBACK(temperature, get_heat_power())
 DEFINE_PID_LOGGING_CALLBACK(pressure, get_pump_flow())
 DEFINE_PID_LOGGING_CALLBACK(flow, get_pump_flow())
 
+/* The mass rate PID is run off the mass callbacks, so the logged
+ * values need to be taken from the rate filter instead. */
+
+static bool mass_rate_pid_logging_callback(
+    double y, double dy, double t, double dt,  double y_raw, int32_t c)
+LOGGING_CALLBACK_BODY(
+    "%.3f, %.1f, %.3f, %.1f, %.3f, %.3f, %.3f\n",
+    (double)t, 100 * (double)get_pump_flow(), (double)mass_rate_filter.y,
+    (double)mass_rate_pid.set,
+    (double)(mass_rate_pid.K_p * (mass_rate_pid.set - mass_rate_filter.y)),
+    (double)(mass_rate_pid.K_p *
+             mass_rate_pid.integral / mass_rate_pid.T_i),
+    (double)(-mass_rate_pid.K_p * mass_rate_pid.T_d
+             * mass_rate_filter.dy / mass_rate_filter.dt))
+
 #undef DEFINE_SENSOR_LOGGING_CALLBACK
 #undef DEFINE_PID_LOGGING_CALLBACK
 #undef LOGGING_CALLBACK_BODY
@@ -204,7 +166,7 @@ static bool spi_print_callback(void)
     return true;
 }
 
-static uint8_t setting_print_target;
+static int setting_print_target;
 static bool setting_print_callback(void)
 {
     uprintf("%d\n", setting_print_target);
@@ -226,6 +188,69 @@ static bool profile_log_print_callback(void)
     return true;
 }
 
+static bool i2c_recoveries_print_callback(void)
+{
+    print_i2c_recoveries();
+
+    return true;
+}
+
+static bool health_print_callback(void)
+{
+    print_health();
+
+    return true;
+}
+
+static bool estimator_print_callback(void)
+{
+    print_estimator();
+
+    return true;
+}
+
+static bool yields_print_callback(void)
+{
+    print_yields();
+
+    return true;
+}
+
+static bool tick_load_print_callback(void)
+{
+    print_tick_load();
+
+    return true;
+}
+
+static bool cycles_print_callback(void)
+{
+    print_cycles();
+
+    return true;
+}
+
+static bool memory_print_callback(void)
+{
+    print_memory();
+
+    return true;
+}
+
+static bool jitter_print_callback(void)
+{
+    print_jitter();
+
+    return true;
+}
+
+static bool trace_print_callback(void)
+{
+    print_trace();
+
+    return true;
+}
+
 static bool profile_stored_callback(void)
 {
     const struct profile *profile = get_profile();
@@ -234,6 +259,35 @@ static bool profile_stored_callback(void)
     return true;
 }
 
+static size_t profile_error_column;
+static bool profile_error_callback(void)
+{
+    uprintf("! %u: %s\n", profile_error_column,
+            get_profile_error()->message);
+
+    return true;
+}
+
+static bool library_print_callback(void)
+{
+    print_library();
+
+    return true;
+}
+
+/* Print the library once a requested store has been carried out. */
+
+static bool library_store_callback(void)
+{
+    if (is_library_store_pending()) {
+        return false;
+    }
+
+    print_library();
+
+    return true;
+}
+
 static void usb_data_in(uint8_t *data, size_t n)
 {
     uassert(n > 0);
@@ -248,7 +302,7 @@ static void usb_data_in(uint8_t *data, size_t n)
 
     switch(*(c++)) {
     case 'b':
-         __asm__ volatile ("bkpt #251");
+        enter_loader();
         break;
 
     case 'l':
@@ -280,6 +334,9 @@ static void usb_data_in(uint8_t *data, size_t n)
             case 'F':
                 add_callback(flow_pid_logging_callback, flow_callbacks);
                 break;
+            case 'Y':
+                add_callback(mass_rate_pid_logging_callback, mass_callbacks);
+                break;
             case 's':
                 add_callback(shot_logging_callback, tick_callbacks);
                 break;
@@ -350,6 +407,113 @@ static void usb_data_in(uint8_t *data, size_t n)
 
             break;
         }
+
+        case 'm':
+        {
+            char *e;
+            const long r = strtol(c, &e, 10);
+
+            if (e == c) {
+                setting_print_target = get_mass_decimation();
+                add_callback(setting_print_callback, tick_callbacks);
+            } else {
+                set_mass_decimation(r);
+            }
+
+            break;
+        }
+
+        case 'f':
+        {
+            char *e;
+            const long r = strtol(c, &e, 10);
+
+            if (e == c) {
+                setting_print_target = lrint(get_flow_timeout() * 1000);
+                add_callback(setting_print_callback, tick_callbacks);
+            } else {
+                set_flow_timeout(r / 1000.0);
+            }
+
+            break;
+        }
+
+        case 'v':
+        {
+            char *e;
+            const long r = strtol(c, &e, 10);
+
+            if (e == c) {
+                const double V = get_low_flow_volume();
+
+                setting_print_target = isnan(V) ? 0 : lrint(V * 1000);
+                add_callback(setting_print_callback, tick_callbacks);
+            } else {
+                set_low_flow_volume(r / 1000.0);
+            }
+
+            break;
+        }
+
+        case 'y':
+        {
+            char *e;
+            const long r = strtol(c, &e, 10);
+
+            if (e == c) {
+                setting_print_target = lrint(get_drip_lag() * 1000);
+                add_callback(setting_print_callback, tick_callbacks);
+            } else {
+                set_drip_lag(r / 1000.0);
+            }
+
+            break;
+        }
+
+        case 't':
+        {
+            char *e;
+            const long r = strtol(c, &e, 10);
+
+            if (e == c) {
+                setting_print_target = lrint(get_tick_rate());
+                add_callback(setting_print_callback, tick_callbacks);
+            } else {
+                set_tick_rate(r);
+            }
+
+            break;
+        }
+
+        case 'l':
+        {
+            char *e;
+            const long r = strtol(c, &e, 10);
+
+            if (e == c) {
+                setting_print_target = get_log_decimation();
+                add_callback(setting_print_callback, tick_callbacks);
+            } else {
+                set_log_decimation(r);
+            }
+
+            break;
+        }
+
+        case 'e':
+        {
+            char *e;
+            const long r = strtol(c, &e, 10);
+
+            if (e == c) {
+                setting_print_target = get_trace_mask();
+                add_callback(setting_print_callback, tick_callbacks);
+            } else {
+                set_trace_mask(r);
+            }
+
+            break;
+        }
         }
 
 #undef SET_OR_GET
@@ -369,6 +533,9 @@ static void usb_data_in(uint8_t *data, size_t n)
         case 'f':
             pid = &flow_pid;
             goto set;
+        case 'y':
+            pid = &mass_rate_pid;
+            goto set;
         set:
             {
                 double f;
@@ -505,6 +672,10 @@ static void usb_data_in(uint8_t *data, size_t n)
         case 'm':
             tare_mass();
             break;
+
+        case 'h':
+            reset_health();
+            break;
         }
 
         break;
@@ -575,14 +746,72 @@ static void usb_data_in(uint8_t *data, size_t n)
     case 'p':
         switch (*c) {
         case ',':
-            if (read_profile(c)) {
+        case 'b':
+        {
+            /* Read a profile in text, or packed and encoded in
+             * Base64, reporting any error at its column in the
+             * line, counting from 1. */
+
+            const bool encoded = (*c == 'b');
+            char *s = (char *)c + encoded;
+
+            if (encoded ? read_encoded_profile(s) : read_profile(s)) {
                 add_callback(profile_stored_callback, tick_callbacks);
+            } else {
+                profile_error_column =
+                    s - (char *)data + get_profile_error()->offset + 1;
+                add_callback(profile_error_callback, tick_callbacks);
             }
 
             break;
+        }
         case 'l':
             add_callback(profile_log_print_callback, tick_callbacks);
             break;
+        case 'i':
+            add_callback(library_print_callback, tick_callbacks);
+            break;
+        case 'w':
+        {
+            /* Store the current profile in slot N, with the rest of
+             * the line as its name. */
+
+            char name[LIBRARY_NAME_SIZE] = {0};
+            unsigned long i;
+            char *e;
+
+            c++;
+            i = strtoul(c, &e, 10);
+
+            if (e > c) {
+                for (; *e == ' '; e++);
+                for (size_t j = 0;
+                     (j < LIBRARY_NAME_SIZE - 1
+                      && isprint((int)e[j]) && e[j] != '%');
+                     j++) {
+                    name[j] = e[j];
+                }
+
+                store_library_profile(i, name);
+                add_callback(library_store_callback, tick_callbacks);
+            }
+
+            break;
+        }
+        case 'u':
+        {
+            /* Use the profile in slot N, or the built-in one. */
+
+            unsigned long i;
+            char *e;
+
+            c++;
+            i = strtoul(c, &e, 10);
+            select_library_profile(e > c ? i : LIBRARY_BUILTIN);
+            add_callback(library_print_callback, tick_callbacks);
+
+            break;
+        }
         default:
             add_callback(profile_print_callback, tick_callbacks);
             break;
@@ -590,6 +819,39 @@ static void usb_data_in(uint8_t *data, size_t n)
 
         break;
 
+    case 'd':
+        switch (*(c++)) {
+        case 'h':
+            add_callback(health_print_callback, tick_callbacks);
+            break;
+        case 'r':
+            add_callback(i2c_recoveries_print_callback, tick_callbacks);
+            break;
+        case 'e':
+            add_callback(estimator_print_callback, tick_callbacks);
+            break;
+        case 'y':
+            add_callback(yields_print_callback, tick_callbacks);
+            break;
+        case 'l':
+            add_callback(tick_load_print_callback, tick_callbacks);
+            break;
+        case 'i':
+            add_callback(cycles_print_callback, tick_callbacks);
+            break;
+        case 's':
+            add_callback(memory_print_callback, tick_callbacks);
+            break;
+        case 'j':
+            add_callback(jitter_print_callback, tick_callbacks);
+            break;
+        case 't':
+            add_callback(trace_print_callback, tick_callbacks);
+            break;
+        }
+
+        break;
+
     case 'r':
         /* Request a system reset. */
 
@@ -609,57 +871,6 @@ static enum {
     MODES
 } mode;
 
-static bool temperature_pid_callback(
-    double T, double dT, double t, double dt, double T_raw, uint16_t c)
-{
-    if (isnan(temperature_pid.set) || isnan(dt)) {
-        return false;
-    }
-
-    uassert(dt > 0);
-
-    set_heat_power(
-        isnan(T) || isnan(dT)
-        ? 0
-        : calculate_pid_output(&temperature_pid, T, dT, dt));
-
-    return false;
-}
-
-static bool pressure_pid_callback(
-    double P, double dP, double t, double dt, double P_raw, uint16_t c)
-{
-    if (isnan(pressure_pid.set) || isnan(dt)) {
-        return false;
-    }
-
-    uassert(dt > 0);
-
-    set_pump_flow(
-        isnan(P) || isnan(dP)
-        ? 0
-        : fmax(0.01, calculate_pid_output(&pressure_pid, P, dP, dt)));
-
-    return false;
-}
-
-static bool flow_pid_callback(
-    double Q, double dQ, double t, double dt,  double V, double raw, uint32_t n)
-{
-    if (isnan(flow_pid.set) || isnan(dt)) {
-        return false;
-    }
-
-    uassert(dt > 0);
-
-    set_pump_flow(
-        isnan(Q) || isnan(dQ)
-        ? 0
-        : fmax(0.01, calculate_pid_output(&flow_pid, Q, dQ, dt)));
-
-    return false;
-}
-
 static bool mode_switch_callback(bool down)
 {
     if (down) {
@@ -674,6 +885,7 @@ static bool mode_switch_callback(bool down)
              && mode != MANUAL_PRESSURE
              && mode != MANUAL_PUMP);
 
+    trace(MODE_EVENT, mode, 0);
     enable_profile(mode == AUTO);
 
     return false;
@@ -684,6 +896,20 @@ static bool adjust_callback(int delta)
 #define ADJUST(X, DX, MIN, MAX) fmin(MAX, fmax(MIN, X + delta * DX))
     switch (mode) {
     case AUTO:
+        /* Outside of a shot, step through the library, skipping
+         * empty slots. */
+
+        if (isnan(get_shot_time())) {
+            const size_t n = LIBRARY_BUILTIN + 1;
+            size_t k = get_library_selection();
+
+            do {
+                k = (k + (delta > 0 ? 1 : n - 1)) % n;
+            } while (!get_library_name(k));
+
+            select_library_profile(k);
+        }
+
         break;
 
     case MANUAL_TEMPERATURE:
@@ -695,6 +921,7 @@ static bool adjust_callback(int delta)
 
     case MANUAL_PRESSURE:
         flow_pid.set = NAN;
+        mass_rate_pid.set = NAN;
         pressure_pid.set =
             isnan(pressure_pid.set)
             ? fmax(0, pressure_filter.y)
@@ -703,6 +930,7 @@ static bool adjust_callback(int delta)
 
     case MANUAL_FLOW:
         pressure_pid.set = NAN;
+        mass_rate_pid.set = NAN;
         flow_pid.set =
             isnan(flow_pid.set)
             ? flow_filter.y
@@ -717,6 +945,7 @@ static bool adjust_callback(int delta)
     case MANUAL_PUMP:
         flow_pid.set = NAN;
         pressure_pid.set = NAN;
+        mass_rate_pid.set = NAN;
         set_pump_flow(ADJUST(get_pump_flow(), 0.05, 0, 1));
         break;
 
@@ -764,6 +993,7 @@ int main(void)
     SPI0_MCR &= ~SPI_MCR_MDIS;
     SPI0_MCR = SPI_MCR_MSTR;
 
+    reset_cycles();
     reset_time();
     reset_usb();
     set_usb_data_in_callback(usb_data_in);
@@ -774,18 +1004,18 @@ int main(void)
 
     /* Initialize the peripherals. */
 
+    reset_jitter();
     reset_input();
     reset_power();
     reset_temperature();
     reset_i2c();
     reset_flow();
+    reset_estimator();
     reset_display();
     reset_profile();
+    reset_control();
     enable_profile(mode == AUTO);
 
-    add_callback(temperature_pid_callback, temperature_callbacks);
-    add_callback(pressure_pid_callback, pressure_callbacks);
-    add_callback(flow_pid_callback, flow_callbacks);
     add_callback(mode_switch_callback, click_callbacks);
     add_callback(adjust_callback, turn_callbacks);
 
@@ -799,6 +1029,9 @@ int main(void)
     display("\x3f\a\4\x1d\2-  \v");
 
     while (true) {
+        save_library_selection();
+        save_library_profile();
+
         if (!update_display) {
             delay_ms(100);
             continue;
@@ -835,6 +1068,29 @@ int main(void)
 
         UPDATE_DISPLAY(t, false, "\4\x1d", get_shot_time(), "s");
 
+        /* Selected profile, shown in place of the shot time for a
+         * couple of seconds after it changes, or at boot. */
+
+        {
+            static size_t k_0 = SIZE_MAX;
+            static double t_k = NAN;
+            const size_t k = get_library_selection();
+
+            if (k != k_0) {
+                char s[8 + LIBRARY_NAME_SIZE] = "\a\4\x1d\1";
+
+                strcat(s, get_library_name(k) ?: "-");
+                strcat(s, "\v");
+                display(s);
+
+                k_0 = k;
+                t_k = get_time();
+            } else if (get_time() - t_k > 2) {
+                t_0 = -INFINITY;
+                t_k = NAN;
+            }
+        }
+
         /* Temperature */
 
         UPDATE_DISPLAY(
@@ -0,0 +1,69 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memory.h"
+#include "profile.h"
+#include "usb.h"
+
+/* Symbols provided by the linker script.  The stack occupies the top
+ * of the RAM, growing down from __stack_end to __scratch_end, the end
+ * of the scratch region where the profile log is kept. */
+
+extern char __data_start, __data_end, __bss_start, __bss_end;
+extern unsigned long __scratch_end, __stack_end;
+
+/* Whether the stack is laid out as above, i.e. clear of the data and
+ * bss sections, so that it can be painted without overwriting them,
+ * should a different linker script place it otherwise. */
+
+bool is_stack_separate(void)
+{
+    return ((char *)&__scratch_end >= &__bss_end
+            && (char *)&__scratch_end >= &__data_end
+            && &__scratch_end < &__stack_end);
+}
+
+size_t get_stack_usage(void)
+{
+    const unsigned long *w;
+
+    if (!is_stack_separate()) {
+        return 0;
+    }
+
+    for (w = &__scratch_end; w < &__stack_end && *w == STACK_PAINT; w++);
+
+    return (char *)&__stack_end - (char *)w;
+}
+
+/* Print the static data and bss sizes, followed by the used and
+ * total sizes of the stack, the program buffer of the current profile
+ * and the profile log, in bytes. */
+
+void print_memory(void)
+{
+    size_t program, program_size, log, log_size;
+
+    program = get_program_usage(&program_size);
+    log = get_log_usage(&log_size);
+
+    uprintf("data, %u\n", &__data_end - &__data_start);
+    uprintf("bss, %u\n", &__bss_end - &__bss_start);
+    uprintf("stack, %u, %u\n", get_stack_usage(),
+            (char *)&__stack_end - (char *)&__scratch_end);
+    uprintf("program, %u, %u\n", program, program_size);
+    uprintf("log, %u, %u\n", log, log_size);
+}
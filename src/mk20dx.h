@@ -47,6 +47,20 @@
 #define FTFL_FCCOBA (*(volatile uint8_t *)0x4002000D)
 #define FTFL_FCCOB9 (*(volatile uint8_t *)0x4002000E)
 #define FTFL_FCCOB8 (*(volatile uint8_t *)0x4002000F)
+#define FTFL_PROGRAM_LONGWORD 0x06
+#define FTFL_ERASE_SECTOR 0x09
+
+/* FlexNVM, used as data flash.  The FTFL addresses it with bit 23
+ * set. */
+
+#define FLEXNVM_BASE 0x10000000
+#define FLEXNVM_SIZE 0x8000
+#define FLEXNVM_FTFL_ADDRESS(a) (0x800000 | ((a) - FLEXNVM_BASE))
+#ifdef TEENSY30
+#define FLEXNVM_SECTOR_SIZE 1024
+#else
+#define FLEXNVM_SECTOR_SIZE 2048
+#endif
 
 #define NVIC_ISER(n) (*((volatile uint32_t *)0xe000e100 + n))
 #define NVIC_ICER(n) (*((volatile uint32_t *)0xe000e180 + n))
@@ -54,12 +68,33 @@
 #define NVIC_ICPR(n) (*((volatile uint32_t *)0xe000e280 + n))
 #define NVIC_IPR(n)  (*((volatile uint32_t *)0xe000e400 + n))
 
+#ifdef SIL
+/* In the software-in-the-loop build (see sil.c), the NVIC's set and
+ * clear registers, the processor's interrupt mask and breakpoints
+ * are simulated, as they can't be modelled by plain memory.  The
+ * priority registers are left as they are. */
+
+void enable_sil_interrupt(int n, int enable);
+void pend_sil_interrupt(int n, int pend);
+int is_sil_interrupt_enabled(int n);
+int is_sil_interrupt_pending(int n);
+void mask_sil_interrupts(int mask);
+void break_sil(void);
+
+#define enable_interrupt(n) enable_sil_interrupt(n, 1)
+#define disable_interrupt(n) enable_sil_interrupt(n, 0)
+#define pend_interrupt(n) pend_sil_interrupt(n, 1)
+#define unpend_interrupt(n) pend_sil_interrupt(n, 0)
+#define is_interrupt_enabled(n) is_sil_interrupt_enabled(n)
+#define is_interrupt_pending(n) is_sil_interrupt_pending(n)
+#else
 #define enable_interrupt(n) (NVIC_ISER((n) / 32) = ((uint32_t)1 << ((n) % 32)))
 #define disable_interrupt(n) (NVIC_ICER((n) / 32) = ((uint32_t)1 << ((n) % 32)))
 #define pend_interrupt(n) (NVIC_ISPR((n) / 32) = ((uint32_t)1 << ((n) % 32)))
 #define unpend_interrupt(n) (NVIC_ICPR((n) / 32) = ((uint32_t)1 << ((n) % 32)))
 #define is_interrupt_enabled(n) (NVIC_ISER((n) / 32) & ((uint32_t)1 << ((n) % 32)))
 #define is_interrupt_pending(n) (NVIC_ISPR((n) / 32) & ((uint32_t)1 << ((n) % 32)))
+#endif
 #define prioritize_interrupt(n, p)                                      \
     {                                                                   \
         int i = n / 4, j = 8 * (n % 4) + 4;                             \
@@ -68,14 +103,30 @@
                        ((p & 0xf) << j));                               \
     }
 
+#ifdef SIL
+#define disable_interrupts() mask_sil_interrupts(1)
+#define enable_interrupts() mask_sil_interrupts(0)
+#define enter_loader() break_sil()
+
+#define disable_all_interrupts()                                \
+    {                                                           \
+        for (int _n = 0; _n < 64; _n++) {                       \
+            if (_n % 32) {                                      \
+                disable_interrupt(_n);                          \
+            }                                                   \
+        }                                                       \
+    }
+#else
 #define disable_interrupts() asm("cpsid i")
 #define enable_interrupts() asm("cpsie i")
+#define enter_loader() __asm__ volatile ("bkpt #251")
 
 #define disable_all_interrupts()                                \
     {                                                           \
         NVIC_ICER(0) = ~(uint32_t)1;                            \
         NVIC_ICER(1) = ~(uint32_t)1;                            \
     }
+#endif
 
 #define OSC0_CR (*((volatile uint8_t *)0x40065000))
 #define OSC_SC8P ((uint8_t)1 << 1)
@@ -114,6 +165,13 @@
 #define SYST_CSR_TICKINT ((uint32_t)1 << 1)
 #define SYST_CSR_ENABLE ((uint32_t)1 << 0)
 
+#define DEMCR (*(volatile uint32_t *)0xe000edfc)
+#define DEMCR_TRCENA ((uint32_t)1 << 24)
+
+#define DWT_CTRL (*(volatile uint32_t *)0xe0001000)
+#define DWT_CYCCNT (*(volatile uint32_t *)0xe0001004)
+#define DWT_CTRL_CYCCNTENA ((uint32_t)1 << 0)
+
 #define SIM_CLKDIV1 (*((volatile uint32_t *)0x40048044))
 #define SIM_CLKDIV2 (*((volatile uint32_t *)0x40048048))
 #define SIM_CLKDIV1_OUTDIV1(n) (((uint32_t)(n) & 0b1111) << 28)
@@ -137,12 +195,69 @@
 #define SIM_SCGC5_PORTE ((uint32_t)1 << 13)
 
 #define SIM_SCGC6 (*(volatile uint32_t *)0x4004803C)
+#define SIM_SCGC6_DMAMUX ((uint32_t)1 << 1)
 #define SIM_SCGC6_SPI0 ((uint32_t)1 << 12)
 #define SIM_SCGC6_PDB ((uint32_t)1 << 22)
 #define SIM_SCGC6_PIT ((uint32_t)1 << 23)
 #define SIM_SCGC6_FTM0 ((uint32_t)1 << 24)
 #define SIM_SCGC6_FTM1 ((uint32_t)1 << 25)
 
+#define SIM_SCGC7 (*(volatile uint32_t *)0x40048040)
+#define SIM_SCGC7_DMA ((uint32_t)1 << 1)
+#define SIM_FCFG1 (*(volatile uint32_t *)0x4004804C)
+#define SIM_FCFG1_DEPART(x) (((x) >> 8) & 0b1111)
+
+#ifdef TEENSY30
+#define DMA_ERROR_IRQ 4
+#else
+#define DMA_ERROR_IRQ 16
+#endif
+
+#define DMA_CH_IRQ(n) (n)
+
+#define DMAMUX0_CHCFG(n) (*((volatile uint8_t *)(0x40021000 + (n))))
+#define DMAMUX_ENBL ((uint8_t)1 << 7)
+#define DMAMUX_TRIG ((uint8_t)1 << 6)
+#define DMAMUX_SOURCE(n) ((uint8_t)(n) & 0b111111)
+#define DMAMUX_SOURCE_FTM0_CH0 20
+
+#define DMA_CR (*(volatile uint32_t *)0x40008000)
+#define DMA_ES (*(volatile uint32_t *)0x40008004)
+#define DMA_ERQ (*(volatile uint32_t *)0x4000800c)
+#define DMA_CERQ (*(volatile uint8_t *)0x4000801a)
+#define DMA_SERQ (*(volatile uint8_t *)0x4000801b)
+#define DMA_CDNE (*(volatile uint8_t *)0x4000801c)
+#define DMA_CERR (*(volatile uint8_t *)0x4000801e)
+#define DMA_CINT (*(volatile uint8_t *)0x4000801f)
+#define DMA_INT (*(volatile uint32_t *)0x40008024)
+#define DMA_ERR (*(volatile uint32_t *)0x4000802c)
+#define DMA_CR_EMLM ((uint32_t)1 << 7)
+#define DMA_CR_ERCA ((uint32_t)1 << 2)
+
+#define DMA_TCD_SADDR(n) (*((volatile uint32_t *)(0x40009000 + 0x20 * (n))))
+#define DMA_TCD_SOFF(n) (*((volatile int16_t *)(0x40009004 + 0x20 * (n))))
+#define DMA_TCD_ATTR(n) (*((volatile uint16_t *)(0x40009006 + 0x20 * (n))))
+#define DMA_TCD_NBYTES(n) (*((volatile uint32_t *)(0x40009008 + 0x20 * (n))))
+#define DMA_TCD_SLAST(n) (*((volatile int32_t *)(0x4000900c + 0x20 * (n))))
+#define DMA_TCD_DADDR(n) (*((volatile uint32_t *)(0x40009010 + 0x20 * (n))))
+#define DMA_TCD_DOFF(n) (*((volatile int16_t *)(0x40009014 + 0x20 * (n))))
+#define DMA_TCD_CITER(n) (*((volatile uint16_t *)(0x40009016 + 0x20 * (n))))
+#define DMA_TCD_DLASTSGA(n) (*((volatile int32_t *)(0x40009018 + 0x20 * (n))))
+#define DMA_TCD_CSR(n) (*((volatile uint16_t *)(0x4000901c + 0x20 * (n))))
+#define DMA_TCD_BITER(n) (*((volatile uint16_t *)(0x4000901e + 0x20 * (n))))
+#define DMA_TCD_ATTR_SSIZE(n) (((uint16_t)(n) & 0b111) << 8)
+#define DMA_TCD_ATTR_DSIZE(n) (((uint16_t)(n) & 0b111) << 0)
+#define DMA_TCD_ATTR_DMOD(n) (((uint16_t)(n) & 0b11111) << 3)
+#define DMA_TCD_ATTR_8BIT 0
+#define DMA_TCD_ATTR_16BIT 1
+#define DMA_TCD_ATTR_32BIT 2
+#define DMA_TCD_CSR_START ((uint16_t)1 << 0)
+#define DMA_TCD_CSR_INTMAJOR ((uint16_t)1 << 1)
+#define DMA_TCD_CSR_INTHALF ((uint16_t)1 << 2)
+#define DMA_TCD_CSR_DREQ ((uint16_t)1 << 3)
+#define DMA_TCD_CSR_ACTIVE ((uint16_t)1 << 6)
+#define DMA_TCD_CSR_DONE ((uint16_t)1 << 7)
+
 #ifdef TEENSY30
 #define PIT0_IRQ 30
 #define PIT1_IRQ 31
@@ -302,6 +417,8 @@
 #define FTM0_C0V (*(volatile uint32_t *)0x40038010)
 #define FTM0_C1SC (*(volatile uint32_t *)0x40038014)
 #define FTM0_C1V (*(volatile uint32_t *)0x40038018)
+#define FTM0_C2SC (*(volatile uint32_t *)0x4003801c)
+#define FTM0_C2V (*(volatile uint32_t *)0x40038020)
 #define FTM0_CNTIN (*(volatile uint32_t *)0x4003804c)
 #define FTM0_MODE (*(volatile uint32_t *)0x40038054)
 #define FTM0_COMBINE (*(volatile uint32_t *)0x40038064)
@@ -318,6 +435,7 @@
 #define FTM_COMBINE_DECAPEN0 ((uint32_t)1 << 2)
 #define FTM_COMBINE_DECAP0 ((uint32_t)1 << 3)
 
+#define FTM_CSC_DMA ((uint32_t)1 << 0)
 #define FTM_CSC_ELSA ((uint32_t)1 << 2)
 #define FTM_CSC_ELSB ((uint32_t)1 << 3)
 #define FTM_CSC_MSA ((uint32_t)1 << 4)
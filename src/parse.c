@@ -0,0 +1,1071 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "crc.h"
+#include "parse.h"
+
+/* Profiles are parsed in two passes over their source, be it text or
+ * binary.  The first validates it completely and counts the stages,
+ * points and actions, so that the space they need can be checked
+ * against the buffer's size.  The second, which can't fail, writes
+ * the stages into the buffer, followed by their points and actions.
+ * The buffer is therefore left untouched, unless the profile is
+ * valid in its entirety.  It must be suitably aligned for the
+ * stages. */
+
+struct builder {
+    struct stage *stages;
+    int16_t (*points)[2];
+    uint8_t *actions;
+
+    size_t n_stages, n_points, n_actions;
+};
+
+static void add_point(struct builder *b, const int16_t z[2])
+{
+    if (b->points) {
+        b->points[b->n_points][0] = z[0];
+        b->points[b->n_points][1] = z[1];
+    }
+
+    b->n_points++;
+}
+
+static void add_action(struct builder *b, uint8_t a)
+{
+    if (b->actions) {
+        b->actions[b->n_actions] = a;
+    }
+
+    b->n_actions++;
+}
+
+/* Add a stage, the points and actions of which have just been
+ * added. */
+
+static void add_stage(struct builder *b, struct stage *stage)
+{
+    if (b->stages) {
+        stage->points = b->points + b->n_points - stage->sizes[0];
+        stage->actions = b->actions + b->n_actions - stage->sizes[1];
+        b->stages[b->n_stages] = *stage;
+    }
+
+    b->n_stages++;
+}
+
+/* Lay out the stages, points and actions counted in the first pass
+ * in the buffer, in preparation for the second. */
+
+static bool lay_out(struct builder *b, void *buffer, size_t size,
+                    struct profile *p, struct parse_error *e)
+{
+    const size_t n = (b->n_stages * sizeof(struct stage)
+                      + b->n_points * sizeof(int16_t[2])
+                      + b->n_actions);
+
+    if (n > size) {
+        e->offset = 0;
+        e->message = "profile too large";
+
+        return false;
+    }
+
+    b->stages = buffer;
+    b->points = (int16_t (*)[2])(b->stages + b->n_stages);
+    b->actions = (uint8_t *)(b->points + b->n_points);
+
+    p->stages = b->stages;
+    p->size = b->n_stages;
+    p->alloc = n;
+
+    b->n_stages = b->n_points = b->n_actions = 0;
+
+    return true;
+}
+
+/* Check that the input coordinates of a stage's points are strictly
+ * monotonic, as segments would otherwise be empty, or overlap.  The
+ * first can be missing, in which case the direction is only known
+ * once the stage is executed. */
+
+static bool is_monotonic(int16_t *last, int *direction, int16_t x)
+{
+    if (x == POINT_MISSING) {
+        return true;
+    }
+
+    if (*last != POINT_MISSING) {
+        const int d = (x > *last) - (x < *last);
+
+        if (d == 0 || d == -*direction) {
+            return false;
+        }
+
+        *direction = d;
+    }
+
+    *last = x;
+
+    return true;
+}
+
+#define FAIL(P, M) {                            \
+        e->offset = (P) - s;                    \
+        e->message = (M);                       \
+        return false;                           \
+    }
+
+#define EXPECT(X, M) {                          \
+        if (*c != (X)) {                        \
+            FAIL(c, "expected " M);             \
+        }                                       \
+                                                \
+        c++;                                    \
+    }
+
+/* Read a coordinate into fixed point.  It's given in decimal, with
+ * any digits past the second decimal rounded off, or as inf,
+ * optionally signed.  An empty coordinate is read as missing.
+ * Returns a description of the problem, if any. */
+
+static const char *read_coordinate(const char **c, int16_t *z)
+{
+    const char *p = *c;
+    bool negative = false, digits = false;
+    int32_t v = 0;
+
+    if (*p == ',' || *p == ')') {
+        *z = POINT_MISSING;
+
+        return NULL;
+    }
+
+    if (*p == '+' || *p == '-') {
+        negative = (*p++ == '-');
+    }
+
+    if (!strncmp(p, "inf", 3)) {
+        p += strncmp(p, "infinity", 8) ? 3 : 8;
+
+        *z = negative ? -POINT_INFINITY : POINT_INFINITY;
+        *c = p;
+
+        return NULL;
+    }
+
+    /* Saturate the integer part, so that it can't overflow. */
+
+    for (; *p >= '0' && *p <= '9'; p++, digits = true) {
+        if (v < POINT_INFINITY) {
+            v = 10 * v + (*p - '0');
+        }
+    }
+
+    v *= POINT_SCALE;
+
+    if (*p == '.') {
+        int32_t d = POINT_SCALE;
+
+        for (p++; *p >= '0' && *p <= '9'; p++, digits = true) {
+            if (d > 1) {
+                d /= 10;
+                v += d * (*p - '0');
+            } else if (d == 1) {
+                v += (*p >= '5');
+                d = 0;
+            }
+        }
+    }
+
+    if (!digits) {
+        return "invalid number";
+    }
+
+    if (v >= POINT_INFINITY) {
+        return "number out of range";
+    }
+
+    *z = (int16_t)(negative ? -v : v);
+    *c = p;
+
+    return NULL;
+}
+
+static bool parse_text(const char *s, struct builder *b,
+                       struct parse_error *e)
+{
+    const char *c = s;
+
+    if (*c != ',') {
+        FAIL(c, "expected ','");
+    }
+
+    while (*c == ',') {
+        struct stage stage = {0};
+
+        c++;
+
+        /* Input */
+
+        switch (*c) {
+        case 'a': stage.input_mode = ABSOLUTE; break;
+        case 'q': stage.input_mode = RATIOMETRIC; break;
+        case 'r': stage.input_mode = RELATIVE; break;
+        default: FAIL(c, "invalid input mode");
+        }
+
+        c++;
+
+        switch (*c) {
+        case 'f': stage.input = FLOW_INPUT; break;
+        case 'p': stage.input = PRESSURE_INPUT; break;
+        case 't': stage.input = TIME_INPUT; break;
+        case 'v': stage.input = VOLUME_INPUT; break;
+        case 'm': stage.input = MASS_INPUT; break;
+        case 'y': stage.input = MASS_RATE_INPUT; break;
+        default: FAIL(c, "invalid input");
+        }
+
+        c++;
+        EXPECT(';', "';'");
+
+        /* Output */
+
+        switch (*c) {
+        case 'a': stage.output_mode = ABSOLUTE; break;
+        case 'q': stage.output_mode = RATIOMETRIC; break;
+        case 'r': stage.output_mode = RELATIVE; break;
+        default: FAIL(c, "invalid output mode");
+        }
+
+        c++;
+
+        switch (*c) {
+        case 'f': stage.output = FLOW_OUTPUT; break;
+        case 'w': stage.output = POWER_OUTPUT; break;
+        case 'p': stage.output = PRESSURE_OUTPUT; break;
+        case 'y': stage.output = MASS_RATE_OUTPUT; break;
+        default: FAIL(c, "invalid output");
+        }
+
+        c++;
+        EXPECT(';', "';'");
+
+        /* Points */
+
+        int16_t last = POINT_MISSING;
+        int direction = 0;
+        size_t j;
+
+        for (j = 0; *c == '('; j++) {
+            const char * const p = c++;
+            int16_t z[2];
+
+            for (int k = 0; k < 2; k++) {
+                const char * const q = c;
+                const char * const m = read_coordinate(&c, &z[k]);
+
+                if (m) {
+                    FAIL(q, m);
+                }
+
+                if (j > 0 && z[k] == POINT_MISSING) {
+                    FAIL(q, "missing coordinate");
+                }
+
+                if (k == 0) {
+                    if (!is_monotonic(&last, &direction, z[0])) {
+                        FAIL(q, "input not monotonic");
+                    }
+
+                    EXPECT(',', "','");
+                } else {
+                    EXPECT(')', "')'");
+                }
+            }
+
+            EXPECT(';', "';'");
+
+            if (j == MAX_POINTS) {
+                FAIL(p, "too many points");
+            }
+
+            if (j == 0) {
+                stage.ease_input = (z[0] == POINT_MISSING);
+                stage.ease_output = (z[1] == POINT_MISSING);
+            }
+
+            add_point(b, z);
+        }
+
+        /* Need at least one segment, i.e. pair of points. */
+
+        if (j < 2) {
+            FAIL(c, "expected '('");
+        }
+
+        stage.sizes[0] = j;
+
+        /* Actions */
+
+        for (j = 0; *c != ',' && *c != '\0'; j++, c++) {
+            if (j == UINT8_MAX) {
+                FAIL(c, "too many actions");
+            }
+
+            switch (*c) {
+            case 'b': add_action(b, BACK); break;
+            case 'v': add_action(b, RESET_VOLUME); break;
+            case 't': add_action(b, RESET_TIME); break;
+            case 'm': add_action(b, RESET_MASS); break;
+            default: FAIL(c, "invalid action");
+            }
+        }
+
+        stage.sizes[1] = j;
+
+        add_stage(b, &stage);
+    }
+
+    return true;
+}
+
+/* The binary format is a byte holding the format version and one
+ * holding the number of stages, followed by the stages.  Each stage
+ * is stored as a byte holding the input in its low three bits and
+ * the output in the next two, one holding the input and output
+ * modes in its low and high two bits, the numbers of points and
+ * actions, then the points, as little-endian pairs of coordinates,
+ * in fixed point, and finally the actions. */
+
+static bool parse_binary(const uint8_t *s, size_t n, struct builder *b,
+                         struct parse_error *e)
+{
+    const uint8_t *c = s, * const end = s + n;
+
+    if (n < 2) {
+        FAIL(c, "truncated");
+    }
+
+    if (c[0] != PARSE_FORMAT) {
+        FAIL(c, "unsupported format");
+    }
+
+    if (c[1] == 0) {
+        FAIL(c + 1, "no stages");
+    }
+
+    const size_t m = c[1];
+
+    c += 2;
+
+    for (size_t i = 0; i < m; i++) {
+        struct stage stage = {0};
+
+        if (end - c < 4) {
+            FAIL(c, "truncated");
+        }
+
+        if ((c[0] & 7) > MASS_RATE_INPUT) {
+            FAIL(c, "invalid input");
+        }
+
+        if ((c[0] >> 3) > MASS_RATE_OUTPUT) {
+            FAIL(c, "invalid output");
+        }
+
+        if ((c[1] & 3) > RELATIVE || (c[1] >> 2) > RELATIVE) {
+            FAIL(c + 1, "invalid mode");
+        }
+
+        if (c[2] < 2 || c[2] > MAX_POINTS) {
+            FAIL(c + 2, "invalid number of points");
+        }
+
+        stage.input = c[0] & 7;
+        stage.output = c[0] >> 3;
+        stage.input_mode = c[1] & 3;
+        stage.output_mode = c[1] >> 2;
+        stage.sizes[0] = c[2];
+        stage.sizes[1] = c[3];
+
+        c += 4;
+
+        if (end - c < 4 * stage.sizes[0] + stage.sizes[1]) {
+            FAIL(c, "truncated");
+        }
+
+        /* Points */
+
+        int16_t last = POINT_MISSING;
+        int direction = 0;
+
+        for (size_t j = 0; j < stage.sizes[0]; j++, c += 4) {
+            const int16_t z[2] = {
+                (int16_t)(c[0] | c[1] << 8),
+                (int16_t)(c[2] | c[3] << 8)
+            };
+
+            if (j > 0 && (z[0] == POINT_MISSING || z[1] == POINT_MISSING)) {
+                FAIL(c, "missing coordinate");
+            }
+
+            if (!is_monotonic(&last, &direction, z[0])) {
+                FAIL(c, "input not monotonic");
+            }
+
+            if (j == 0) {
+                stage.ease_input = (z[0] == POINT_MISSING);
+                stage.ease_output = (z[1] == POINT_MISSING);
+            }
+
+            add_point(b, z);
+        }
+
+        /* Actions */
+
+        for (size_t j = 0; j < stage.sizes[1]; j++, c++) {
+            if (*c > RESET_MASS) {
+                FAIL(c, "invalid action");
+            }
+
+            add_action(b, *c);
+        }
+
+        add_stage(b, &stage);
+    }
+
+    if (c != end) {
+        FAIL(c, "trailing data");
+    }
+
+    return true;
+}
+
+/* Decode Base64, in place, returning the number of bytes decoded, or
+ * the offset of an invalid character. */
+
+static bool decode_base64(char *s, size_t *n, struct parse_error *e)
+{
+    uint32_t w = 0;
+    size_t i, j = 0, k = 0;
+
+    for (i = 0; s[i] != '\0' && s[i] != '='; i++) {
+        const char c = s[i];
+        unsigned int v;
+
+        if (c >= 'A' && c <= 'Z') {
+            v = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            v = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            v = c - '0' + 52;
+        } else if (c == '+') {
+            v = 62;
+        } else if (c == '/') {
+            v = 63;
+        } else {
+            FAIL(s + i, "invalid character");
+        }
+
+        w = w << 6 | v;
+        k += 6;
+
+        if (k >= 8) {
+            k -= 8;
+            s[j++] = (char)(w >> k);
+        }
+    }
+
+    for (; s[i] == '='; i++);
+
+    if (s[i] != '\0') {
+        FAIL(s + i, "invalid character");
+    }
+
+    *n = j;
+
+    return true;
+}
+
+#undef FAIL
+#undef EXPECT
+
+bool parse_profile(const char *s, void *buffer, size_t size,
+                   struct profile *p, struct parse_error *e)
+{
+    struct builder b = {0};
+
+    if (!parse_text(s, &b, e) || !lay_out(&b, buffer, size, p, e)) {
+        return false;
+    }
+
+    return parse_text(s, &b, e);
+}
+
+bool parse_binary_profile(const uint8_t *data, size_t n,
+                          void *buffer, size_t size,
+                          struct profile *p, struct parse_error *e)
+{
+    struct builder b = {0};
+
+    if (!parse_binary(data, n, &b, e) || !lay_out(&b, buffer, size, p, e)) {
+        return false;
+    }
+
+    return parse_binary(data, n, &b, e);
+}
+
+/* Parse a binary profile, packed and encoded in Base64, as it
+ * arrives over the text-based USB link.  The encoded string is
+ * decoded in place.  Errors in the packed profile are reported at
+ * the offset of the group of Base64 characters that encodes the
+ * offending byte. */
+
+bool parse_encoded_profile(char *s, void *buffer, size_t size,
+                           struct profile *p, struct parse_error *e)
+{
+    const uint8_t *data = (const uint8_t *)s;
+    size_t n;
+
+    if (!decode_base64(s, &n, e)) {
+        return false;
+    }
+
+    e->offset = 0;
+
+    if (n < 6) {
+        e->message = "truncated";
+
+        return false;
+    }
+
+    const size_t m = data[0] | data[1] << 8;
+
+    if (m + 6 != n) {
+        e->message = "length mismatch";
+
+        return false;
+    }
+
+    const uint32_t crc = ((uint32_t)data[m + 2]
+                          | (uint32_t)data[m + 3] << 8
+                          | (uint32_t)data[m + 4] << 16
+                          | (uint32_t)data[m + 5] << 24);
+
+    if (crc32(0, data + 2, m) != crc) {
+        e->message = "CRC mismatch";
+
+        return false;
+    }
+
+    if (!parse_binary_profile(data + 2, m, buffer, size, p, e)) {
+        e->offset = (e->offset + 2) / 3 * 4;
+
+        return false;
+    }
+
+    return true;
+}
+
+/* Pack a profile into the binary format, preceded by its length and
+ * followed by its CRC-32, both little-endian.  Returns the size of
+ * the packed profile, or 0 if it doesn't fit. */
+
+size_t pack_profile(const struct profile *p, uint8_t *data, size_t size)
+{
+    size_t n = 2;
+
+    for (size_t i = 0; i < p->size; i++) {
+        n += 4 + 4 * p->stages[i].sizes[0] + p->stages[i].sizes[1];
+    }
+
+    if (p->size > UINT8_MAX || n > UINT16_MAX || n + 6 > size) {
+        return 0;
+    }
+
+    uint8_t *c = data + 2;
+
+    *c++ = PARSE_FORMAT;
+    *c++ = (uint8_t)p->size;
+
+    for (size_t i = 0; i < p->size; i++) {
+        const struct stage *stage = &p->stages[i];
+
+        *c++ = (uint8_t)(stage->input | stage->output << 3);
+        *c++ = (uint8_t)(stage->input_mode | stage->output_mode << 2);
+        *c++ = stage->sizes[0];
+        *c++ = stage->sizes[1];
+
+        for (size_t j = 0; j < stage->sizes[0]; j++) {
+            for (int k = 0; k < 2; k++) {
+                const uint16_t z = (uint16_t)stage->points[j][k];
+
+                *c++ = (uint8_t)z;
+                *c++ = (uint8_t)(z >> 8);
+            }
+        }
+
+        memcpy(c, stage->actions, stage->sizes[1]);
+        c += stage->sizes[1];
+    }
+
+    const uint32_t crc = crc32(0, data + 2, n);
+
+    data[0] = (uint8_t)n;
+    data[1] = (uint8_t)(n >> 8);
+
+    for (int k = 0; k < 4; k++) {
+        *c++ = (uint8_t)(crc >> 8 * k);
+    }
+
+    return n + 6;
+}
+
+/* Encode n bytes of data in Base64, with padding, returning the
+ * length of the encoded string, or 0 if it doesn't fit. */
+
+size_t encode_base64(const uint8_t *data, size_t n, char *s, size_t size)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    const size_t m = (n + 2) / 3 * 4;
+
+    if (m + 1 > size) {
+        return 0;
+    }
+
+    for (size_t i = 0, j = 0; i < n; i += 3, j += 4) {
+        const uint32_t w = ((uint32_t)data[i] << 16
+                            | (i + 1 < n ? (uint32_t)data[i + 1] << 8 : 0)
+                            | (i + 2 < n ? (uint32_t)data[i + 2] : 0));
+
+        s[j] = alphabet[w >> 18];
+        s[j + 1] = alphabet[w >> 12 & 0x3f];
+        s[j + 2] = i + 1 < n ? alphabet[w >> 6 & 0x3f] : '=';
+        s[j + 3] = i + 2 < n ? alphabet[w & 0x3f] : '=';
+    }
+
+    s[m] = '\0';
+
+    return m;
+}
+
+#if defined(TEST) || defined(FUZZ)
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BUFFER_SIZE 1024
+
+static _Alignas(struct stage) uint8_t buffers[2][BUFFER_SIZE];
+
+/* Check that a parsed profile is well-formed, i.e. that it lies
+ * within its buffer and that it can be executed. */
+
+static void check_profile(const struct profile *p, const uint8_t *buffer)
+{
+    const uint8_t *end = buffer + p->alloc;
+
+    assert(p->size > 0 && p->alloc <= BUFFER_SIZE);
+    assert((const uint8_t *)p->stages == buffer);
+
+    for (size_t i = 0; i < p->size; i++) {
+        const struct stage *stage = &p->stages[i];
+
+        assert(stage->input <= MASS_RATE_INPUT);
+        assert(stage->output <= MASS_RATE_OUTPUT);
+        assert(stage->input_mode <= RELATIVE);
+        assert(stage->output_mode <= RELATIVE);
+        assert(stage->sizes[0] >= 2 && stage->sizes[0] <= MAX_POINTS);
+
+        assert((const uint8_t *)stage->points >= buffer);
+        assert((const uint8_t *)(stage->points + stage->sizes[0]) <= end);
+        assert(stage->actions >= buffer);
+        assert(stage->actions + stage->sizes[1] <= end);
+
+        assert(stage->ease_input
+               == (stage->points[0][0] == POINT_MISSING));
+        assert(stage->ease_output
+               == (stage->points[0][1] == POINT_MISSING));
+
+        for (size_t j = 1; j < stage->sizes[0]; j++) {
+            const int16_t (*P)[2] = stage->points;
+
+            assert(P[j][0] != POINT_MISSING && P[j][1] != POINT_MISSING);
+            assert(P[j][0] != P[j - 1][0]);
+            assert(j < 2 || P[j - 2][0] == POINT_MISSING
+                   || (P[j][0] > P[j - 1][0]) == (P[j - 1][0] > P[j - 2][0]));
+        }
+
+        for (size_t j = 0; j < stage->sizes[1]; j++) {
+            assert(stage->actions[j] <= RESET_MASS);
+        }
+    }
+}
+
+static bool are_equal(const struct profile *p, const struct profile *q)
+{
+    if (p->size != q->size || p->alloc != q->alloc) {
+        return false;
+    }
+
+    for (size_t i = 0; i < p->size; i++) {
+        const struct stage *a = &p->stages[i], *b = &q->stages[i];
+
+        if (a->input != b->input || a->output != b->output
+            || a->input_mode != b->input_mode
+            || a->output_mode != b->output_mode
+            || a->ease_input != b->ease_input
+            || a->ease_output != b->ease_output
+            || a->sizes[0] != b->sizes[0] || a->sizes[1] != b->sizes[1]
+            || memcmp(a->points, b->points, sizeof(int16_t[2]) * a->sizes[0])
+            || memcmp(a->actions, b->actions, a->sizes[1])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Feed arbitrary input to all parsers.  Whatever is accepted must be
+ * well-formed and survive packing, encoding and parsing back intact,
+ * while errors must be reported within the input. */
+
+static void check_input(const uint8_t *data, size_t n)
+{
+    static char s[4 * BUFFER_SIZE], t[4 * BUFFER_SIZE];
+    static uint8_t packed[2 * BUFFER_SIZE];
+    struct profile p, q;
+    struct parse_error e;
+
+    if (n >= sizeof(s)) {
+        n = sizeof(s) - 1;
+    }
+
+    memcpy(s, data, n);
+    s[n] = '\0';
+
+    if (parse_profile(s, buffers[0], BUFFER_SIZE, &p, &e)) {
+        check_profile(&p, buffers[0]);
+
+        const size_t m = pack_profile(&p, packed, sizeof(packed));
+
+        assert(m > 0);
+        assert(encode_base64(packed, m, t, sizeof(t)) > 0);
+        assert(parse_encoded_profile(t, buffers[1], BUFFER_SIZE, &q, &e));
+        check_profile(&q, buffers[1]);
+        assert(are_equal(&p, &q));
+    } else {
+        assert(e.message && e.offset <= strlen(s));
+    }
+
+    if (parse_binary_profile(data, n, buffers[0], BUFFER_SIZE, &p, &e)) {
+        check_profile(&p, buffers[0]);
+    } else {
+        assert(e.message && e.offset <= n);
+    }
+
+    const size_t l = strlen(s);
+
+    if (parse_encoded_profile(s, buffers[0], BUFFER_SIZE, &p, &e)) {
+        check_profile(&p, buffers[0]);
+    } else {
+        assert(e.message && e.offset <= l);
+    }
+}
+#endif
+
+#ifdef FUZZ
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t n)
+{
+    check_input(data, n);
+
+    return 0;
+}
+#endif
+
+#ifdef TEST
+#include <time.h>
+#include <unistd.h>
+
+#define PROFILE (",ap;af;(0,3);(4,3);v,"                \
+                 "rt;ap;(0,);(1,0);(30,0);(33,9);,"     \
+                 "ap;ap;(,9);(9,9);,"                   \
+                 "af;ap;(0,9);(1.8,9);,"                \
+                 "ap;qf;(0,1);(9.5,1);,"                \
+                 "rt;ap;(0,);(1,9);bbbb")
+
+static const struct {
+    const char *s;
+    int offset;
+} cases[] = {
+    {PROFILE, -1},
+    {",ap;af;(0,3);(4,3);v", -1},
+    {",rt;ap;(,);(1,0);", -1},
+    {",av;qf;(0,);(+inf,1);", -1},
+    {",ap;af;(327.664,3);(0,3);", -1},
+    {"", 0},
+    {"ap;af;(0,3);(4,3);", 0},
+    {",xp;af;(0,3);(4,3);", 1},
+    {",ax;af;(0,3);(4,3);", 2},
+    {",ap:af;(0,3);(4,3);", 3},
+    {",ap;af;(0,3);(4,3)", 18},
+    {",ap;af;(0,3);", 13},
+    {",ap;af;(0,3);(4,3);x", 19},
+    {",ap;af;(0,3);(0,4);", 14},
+    {",ap;af;(0,3);(4,);", 16},
+    {",ap;af;(0,3);(400,3);", 14},
+    {",ap;af;(327.665,3);(0,3);", 8},
+    {",ap;af;(0,3);(4,3.x);", 18},
+    {",ap;af;(0,3);(-inf,3);(1,1);", 23},
+    {",ap;af;(0,3);(4,3);v,", 21},
+};
+
+/* Apply a few random edits to a string: overwrite, insert or delete
+ * a character, favouring those that are significant to the
+ * parsers. */
+
+static size_t mutate(uint8_t *s, size_t n, size_t size)
+{
+    static const char alphabet[] =
+        ",;()afpqrtvmyw.-+0123456789infbAZ/=";
+
+    for (int k = rand() % 4; k >= 0; k--) {
+        const size_t i = n > 0 ? rand() % n : 0;
+        const uint8_t c = (rand() % 4
+                           ? (uint8_t)alphabet[rand() % (sizeof(alphabet) - 1)]
+                           : (uint8_t)rand());
+
+        switch (rand() % 3) {
+        case 0:
+            if (n > 0) {
+                s[i] = c;
+            }
+            break;
+
+        case 1:
+            if (n < size) {
+                memmove(s + i + 1, s + i, n - i);
+                s[i] = c;
+                n++;
+            }
+            break;
+
+        case 2:
+            if (n > 0) {
+                memmove(s + i, s + i + 1, n - i - 1);
+                n--;
+            }
+            break;
+        }
+    }
+
+    return n;
+}
+
+static double benchmark(const char *s, size_t l, int kind, int n)
+{
+    static char t[4 * BUFFER_SIZE];
+    struct profile p;
+    struct parse_error e;
+
+    const clock_t c_0 = clock();
+
+    for (int i = 0; i < n; i++) {
+        bool success;
+
+        switch (kind) {
+        case 0:
+            success = parse_profile(s, buffers[0], BUFFER_SIZE, &p, &e);
+            break;
+
+        case 1:
+            success = parse_binary_profile(
+                (const uint8_t *)s, l, buffers[0], BUFFER_SIZE, &p, &e);
+            break;
+
+        default:
+            memcpy(t, s, l + 1);
+            success = parse_encoded_profile(
+                t, buffers[0], BUFFER_SIZE, &p, &e);
+            break;
+        }
+
+        assert(success);
+    }
+
+    return (double)(clock() - c_0) / CLOCKS_PER_SEC / n;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, n = 100000, m = 1000000;
+    bool encode = false;
+
+    while ((opt = getopt(argc, argv, "en:f:")) != -1) {
+        switch (opt) {
+        case 'e':
+            encode = true;
+            break;
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'f':
+            m = atoi(optarg);
+            break;
+        default:
+            return 1;
+        }
+    }
+
+    static uint8_t packed[2 * BUFFER_SIZE];
+    static char encoded[4 * BUFFER_SIZE];
+    struct profile p, q;
+    struct parse_error e;
+    int failures = 0;
+
+    /* Convert profiles given on the command line into commands for
+     * binary upload. */
+
+    if (encode) {
+        for (int i = optind; i < argc; i++) {
+            if (!parse_profile(argv[i], buffers[0], BUFFER_SIZE, &p, &e)) {
+                fprintf(stderr, "%s\n%*s^ %s\n", argv[i],
+                        (int)e.offset, "", e.message);
+
+                return 1;
+            }
+
+            encode_base64(packed, pack_profile(&p, packed, sizeof(packed)),
+                          encoded, sizeof(encoded));
+            printf("pb%s\n", encoded);
+        }
+
+        return 0;
+    }
+
+    /* Check error reporting. */
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const bool success = parse_profile(
+            cases[i].s, buffers[0], BUFFER_SIZE, &p, &e);
+        const bool correct = (cases[i].offset < 0
+                              ? success
+                              : (!success
+                                 && (int)e.offset == cases[i].offset));
+
+        printf("%-32s %3d: %s (%s)\n", cases[i].s,
+               success ? -1 : (int)e.offset, success ? "ok" : e.message,
+               correct ? "correct" : "INCORRECT");
+
+        failures += !correct;
+    }
+
+    /* Check rounding. */
+
+    assert(parse_profile(",ap;af;(0.005,-0.015);(1.994,327.66);",
+                         buffers[0], BUFFER_SIZE, &p, &e));
+
+    {
+        const int16_t (*P)[2] = p.stages[0].points;
+        const bool correct = (P[0][0] == 1 && P[0][1] == -2
+                              && P[1][0] == 199 && P[1][1] == 32766);
+
+        printf("Rounding: %d, %d, %d, %d (%s)\n", P[0][0], P[0][1],
+               P[1][0], P[1][1], correct ? "correct" : "INCORRECT");
+
+        failures += !correct;
+    }
+
+    /* Check binary round trips and corruption. */
+
+    assert(parse_profile(PROFILE, buffers[0], BUFFER_SIZE, &p, &e));
+
+    const size_t k = pack_profile(&p, packed, sizeof(packed));
+    const size_t l = encode_base64(packed, k, encoded, sizeof(encoded));
+
+    printf("Packed: %zu bytes, %zu encoded, %zu as text, %zu compiled\n",
+           k, l, strlen(PROFILE), p.alloc);
+
+    {
+        static char t[4 * BUFFER_SIZE];
+        const bool correct = (
+            parse_binary_profile(packed + 2, k - 6,
+                                 buffers[1], BUFFER_SIZE, &q, &e)
+            && are_equal(&p, &q)
+            && parse_encoded_profile(strcpy(t, encoded),
+                                     buffers[1], BUFFER_SIZE, &q, &e)
+            && are_equal(&p, &q));
+
+        printf("Round trip: %s\n", correct ? "correct" : "INCORRECT");
+        failures += !correct;
+
+        /* Flip a bit in the middle. */
+
+        strcpy(t, encoded);
+        t[l / 2] ^= 1;
+
+        const bool rejected = !parse_encoded_profile(
+            t, buffers[1], BUFFER_SIZE, &q, &e);
+
+        printf("Corrupted: %s (%s)\n", rejected ? e.message : "accepted",
+               rejected ? "correct" : "INCORRECT");
+        failures += !rejected;
+    }
+
+    /* Fuzz with random mutations of the above, in both forms. */
+
+    for (int i = 0; i < m; i++) {
+        static uint8_t s[4 * BUFFER_SIZE];
+        const int j = rand() % (sizeof(cases) / sizeof(cases[0]) + 2);
+        size_t n_s;
+
+        if (j == 0) {
+            memcpy(s, packed + 2, (n_s = k - 6));
+        } else if (j == 1) {
+            memcpy(s, encoded, (n_s = l));
+        } else {
+            n_s = strlen(cases[j - 2].s);
+            memcpy(s, cases[j - 2].s, n_s);
+        }
+
+        check_input(s, mutate(s, n_s, sizeof(s) - 1));
+    }
+
+    printf("Fuzzed: %d inputs\n", m);
+
+    /* Measure throughput. */
+
+    const char *kinds[] = {"Text", "Binary", "Encoded"};
+
+    for (int i = 0; i < 3; i++) {
+        const size_t b = i == 0 ? strlen(PROFILE) : (i == 1 ? k - 6 : l);
+        const double t = benchmark(
+            i == 0 ? PROFILE : (i == 1 ? (const char *)packed + 2 : encoded),
+            b, i, n);
+
+        printf("%-8s %4zu bytes: %6.2f us/profile, %7.1f MB/s\n",
+               kinds[i], b, t * 1e6, b / t / 1e6);
+    }
+
+    return failures > 0;
+}
+#endif
@@ -0,0 +1,45 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "profile.h"
+
+/* The version of the binary profile format. */
+
+#define PARSE_FORMAT 1
+
+struct parse_error {
+    size_t offset;
+    const char *message;
+};
+
+bool parse_profile(const char *s, void *buffer, size_t size,
+                   struct profile *p, struct parse_error *e);
+bool parse_binary_profile(const uint8_t *data, size_t n,
+                          void *buffer, size_t size,
+                          struct profile *p, struct parse_error *e);
+bool parse_encoded_profile(char *s, void *buffer, size_t size,
+                           struct profile *p, struct parse_error *e);
+size_t pack_profile(const struct profile *p, uint8_t *data, size_t size);
+size_t encode_base64(const uint8_t *data, size_t n, char *s, size_t size);
+
+#endif
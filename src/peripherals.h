@@ -31,12 +31,14 @@ void set_pump_flow(double Q);
 double get_pump_delay(void);
 double get_pump_power(void);
 double get_pump_flow(void);
+double calculate_delay(double P);
 
 extern struct pid temperature_pid;
 extern struct filter temperature_filter, error_filter;
 void run_temperature(bool run);
 void read_temperature(void);
 void reset_temperature(void);
+double calibrate_temperature(uint16_t c);
 
 extern struct pid pressure_pid;
 extern struct filter pressure_filter;
@@ -44,20 +46,32 @@ void run_pressure(bool run);
 void read_pressure(void);
 void reset_pressure(void);
 
+extern struct pid mass_rate_pid;
 extern struct filter mass_filter;
 extern struct filter mass_rate_filter;
 void run_mass(bool run);
 void read_mass(void);
 void tare_mass(void);
 bool is_taring_mass(void);
+void set_mass_decimation(int r);
+int get_mass_decimation(void);
 
 extern struct pid flow_pid;
 extern struct filter flow_filter;
 void reset_flow(void);
+void set_flow_timeout(double t);
+double get_flow_timeout(void);
+void set_low_flow_volume(double V);
+double get_low_flow_volume(void);
 void tare_flow(void);
-double get_flow(void);
+double calibrate_flow(double r);
+double get_measured_flow(void);
+double get_measured_volume(void);
 double get_flow_derivative(void);
+
+double get_flow(void);
 double get_volume(void);
+double get_yield(void);
 
 void reset_display(void);
 void clear_display(void);
@@ -65,4 +79,6 @@ void display(const char *s, ...);
 
 void reset_input(void);
 
+void reset_control(void);
+
 #endif
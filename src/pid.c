@@ -52,6 +52,16 @@ double calculate_pid_output(struct pid *pid, double y, double dy, double dt)
     return u;
 }
 
+/* The output, without the derivative term and with the integral
+ * held, for samples whose history can't be relied upon. */
+
+double hold_pid_output(struct pid *pid, double y)
+{
+    const double u = pid->K_p * (pid->set - y + pid->integral / pid->T_i);
+
+    return fmin(fmax(u, 0), 1);
+}
+
 #ifdef TEST
 #include <stdbool.h>
 #include <stdio.h>
@@ -29,6 +29,7 @@ struct pid {
 };
 
 double calculate_pid_output(struct pid *pid, double y, double dy, double dt);
+double hold_pid_output(struct pid *pid, double y);
 void reset_pid(struct pid *pid, double set);
 
 #endif
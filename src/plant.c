@@ -0,0 +1,119 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "plant.h"
+
+/* A vibratory pump, the flow of which falls linearly with pressure,
+ * following its setting with some lag. */
+
+#define PUMP_FLOW 8.0           /* ml/s, at zero pressure */
+#define PUMP_PRESSURE 15.0      /* bar, at zero flow */
+#define PUMP_LAG 0.1            /* s */
+
+/* Water first fills the headspace and saturates the puck, after
+ * which pressure builds up, according to the basket's compliance.
+ * The coffee takes a while to drip into the cup. */
+
+#define SATURATION_VOLUME 30.0  /* ml */
+#define COMPLIANCE 1.5          /* ml/bar */
+#define YIELD_RATIO 0.95        /* g/ml */
+#define DRIP_TIME 1.5           /* s */
+
+static void puck_hydraulics(struct plant *p, double h)
+{
+    const struct model *m = p->model;
+
+    const double Q = PUMP_FLOW * p->pump * fmax(1 - p->P / PUMP_PRESSURE, 0);
+    const double R = m->resistance * (
+        m->erosion + (1 - m->erosion) * exp(-p->W / m->erosion_volume));
+    const double Q_o = p->P / R;
+
+    p->Q += (Q - p->Q) * h / PUMP_LAG;
+    p->V += (p->Q - Q_o) * h;
+    p->W += Q_o * h;
+    p->P = fmax(p->V - SATURATION_VOLUME, 0) / COMPLIANCE;
+
+    p->R += (YIELD_RATIO * Q_o - p->R) * h / DRIP_TIME;
+    p->M += p->R * h;
+}
+
+/* A boiler of some heat capacity, losing heat to its environment and
+ * to the water pumped through it, read by a sensor with some
+ * lag. */
+
+#define HEATER_POWER 1300.0     /* W */
+#define HEAT_CAPACITY 1500.0    /* J/K */
+#define HEAT_LOSS 2.0           /* W/K */
+#define WATER_HEAT 4.18         /* J/(ml K) */
+#define AMBIENT 20.0            /* degrees Celsius */
+#define SENSOR_LAG 2.0          /* s */
+
+static void boiler_thermal(struct plant *p, double h)
+{
+    const double dT = p->T - AMBIENT;
+
+    p->T += (HEATER_POWER * p->heat
+             - (HEAT_LOSS + WATER_HEAT * p->Q) * dT) / HEAT_CAPACITY * h;
+    p->T_s += (p->T - p->T_s) * h / SENSOR_LAG;
+}
+
+const struct model models[] = {
+    {"puck", puck_hydraulics, boiler_thermal, 4.5, 0.6, 40},
+    {"fine", puck_hydraulics, boiler_thermal, 7.0, 0.6, 40},
+    {"coarse", puck_hydraulics, boiler_thermal, 2.5, 0.5, 30},
+    {"blind", puck_hydraulics, boiler_thermal, INFINITY, 1, 1},
+};
+
+const size_t n_models = sizeof(models) / sizeof(models[0]);
+
+const struct model *find_model(const char *name)
+{
+    for (size_t i = 0; i < n_models; i++) {
+        if (!strcmp(name, models[i].name)) {
+            return &models[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Start with an empty basket and cup and the boiler at the given
+ * temperature. */
+
+void reset_plant(struct plant *p, const struct model *m, double T)
+{
+    *p = (struct plant){.model = m, .T = T, .T_s = T};
+}
+
+void step_plant(struct plant *p, double h)
+{
+    p->model->hydraulics(p, h);
+    p->model->thermal(p, h);
+}
+
+double sample_noise(double sigma)
+{
+    /* Box-Muller */
+
+    const double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    const double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+    return sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
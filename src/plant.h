@@ -0,0 +1,75 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLANT_H
+#define PLANT_H
+
+#include <stddef.h>
+
+/* A model of the espresso machine, as seen by the firmware's sensors
+ * and actuators, shared by the simulator and the software-in-the-loop
+ * build. */
+
+struct plant {
+    const struct model *model;
+
+    /* Inputs: the pump's flow setting and the heating power, as
+     * fractions. */
+
+    double pump, heat;
+
+    /* State: the pump's flow (ml/s), the pressure in the headspace
+     * (bar), the water retained in the headspace and puck (ml), the
+     * water that has gone through the puck (ml), the mass (g) and
+     * rate (g/s) of the coffee landing in the cup, the boiler's
+     * temperature and its reading (degrees Celsius). */
+
+    double Q, P, V, W, M, R, T, T_s;
+};
+
+/* A model consists of a hydraulic and a thermal part, each advancing
+ * the plant's state by a step h, given its parameters.  New models
+ * can be added to the table in plant.c. */
+
+struct model {
+    const char *name;
+    void (*hydraulics)(struct plant *p, double h);
+    void (*thermal)(struct plant *p, double h);
+
+    /* Puck resistance (bar s/ml), the fraction of it that remains
+     * once fully eroded and the volume through it (ml) over which
+     * erosion happens. */
+
+    double resistance, erosion, erosion_volume;
+};
+
+/* Sensor noise standard deviations, in bar, ml/s, g and degrees
+ * Celsius respectively. */
+
+#define PRESSURE_SIGMA 0.02
+#define FLOW_SIGMA 0.05
+#define MASS_SIGMA 0.05
+#define TEMPERATURE_SIGMA 0.05
+
+extern const struct model models[];
+extern const size_t n_models;
+
+const struct model *find_model(const char *name);
+void reset_plant(struct plant *p, const struct model *m, double T);
+void step_plant(struct plant *p, double h);
+double sample_noise(double sigma);
+
+#endif
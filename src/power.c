@@ -18,12 +18,15 @@
 #include <math.h>
 
 #include "callbacks.h"
+#include "cycles.h"
+#include "jitter.h"
 #include "mk20dx.h"
+#include "trace.h"
 #include "usb.h"
 
 static double heat = 1, pump = 1;
 
-__attribute__((interrupt ("IRQ"))) void porta_isr(void)
+TIMED_ISR(porta_isr, PORTA_ISR)
 {
     PORTA_PCR12 |= PORT_PCR_ISF;
 
@@ -56,7 +59,7 @@ __attribute__((interrupt ("IRQ"))) void porta_isr(void)
     }
 }
 
-static double calculate_delay(double P)
+double calculate_delay(double P)
 {
     /* The power for a given firing angle theta is given by:
      *
@@ -99,7 +102,7 @@ static double calculate_delay(double P)
  * simply turn off the TRIAC below that. */
 
 #define DEFINE_FUNCTIONS(WHAT, GPIO, PIN, PIT, COND)                    \
-    __attribute__((interrupt ("IRQ"))) void pit## PIT ##_isr(void)      \
+    TIMED_ISR(pit## PIT ##_isr, PIT0_ISR + PIT)                         \
     {                                                                   \
         PIT_TFLG(PIT) |= PIT_TFLG_TIF;                                  \
         PIT_TCTRL(PIT) &= ~PIT_TCTRL_TEN;                               \
@@ -107,12 +110,17 @@ static double calculate_delay(double P)
         if (COND) {                                                     \
             GPIO ##_PSOR = PT(PIN);                                     \
         }                                                               \
+                                                                        \
+        actuate(HEATER + PIT);                                          \
     }                                                                   \
                                                                         \
     void set_## WHAT ##_delay(double d)                                 \
     {                                                                   \
         WHAT = d;                                                       \
                                                                         \
+        trace(ACTUATOR_EVENT, HEATER + PIT,                             \
+              isnan(d) || d >= 1 ? UINT16_MAX : d * UINT16_MAX);        \
+                                                                        \
         if (isnan(d) || d == 0 || d >= 0.95) {                          \
             disable_interrupt(PIT0_IRQ + PIT);                          \
                                                                         \
@@ -122,6 +130,7 @@ static double calculate_delay(double P)
                 GPIO ##_PCOR = PT(PIN);                                 \
             }                                                           \
                                                                         \
+            actuate(HEATER + PIT);                                      \
             return;                                                     \
         }                                                               \
                                                                         \
@@ -14,17 +14,22 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <ctype.h>
-#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
 #include "callbacks.h"
+#include "curve.h"
+#include "estimator.h"
+#include "library.h"
 #include "mk20dx.h"
+#include "parse.h"
 #include "peripherals.h"
 #include "profile.h"
+#include "record.h"
 #include "time.h"
+#include "trace.h"
 #include "usb.h"
+#include "yield.h"
 
 #define PROFILE (",ap;af;(0,3);(4,3);v,"                \
                  "rt;ap;(0,);(1,0);(30,0);(33,9);,"     \
@@ -33,80 +38,83 @@
                  "ap;qf;(0,1);(9.5,1);,"                \
                  "rt;ap;(0,);(1,9);bbbb")
 
+#define BUFFER_SIZE 1024
+
 extern unsigned long __scratch_start, __scratch_end;
 
 static struct profile profile;
-static struct profile_log_entry *profile_log_cursor =
-    (struct profile_log_entry *)&__scratch_start;
+static struct record profile_log;
+static unsigned int log_decimation = 1, log_ticks;
 
 /* Profile execution */
 
 static inline void log_profile_execution(
-    uint8_t phase, uint8_t stage, __fp16 x, __fp16 y)
+    uint8_t phase, uint8_t stage, double x, double y)
 {
-    if (profile_log_cursor + 1 > (struct profile_log_entry *)&__scratch_end) {
-        return;
-    }
-
-    profile_log_cursor->phase = phase;
-    profile_log_cursor->stage = stage;
-    profile_log_cursor->x = x;
-    profile_log_cursor->y = y;
-    profile_log_cursor->pressure = pressure_filter.y;
-    profile_log_cursor->flow = get_flow();
+    /* Only log every so many ticks, but always log the end of a
+     * stage, i.e. a missing output. */
 
-    if (isnan(profile_log_cursor->flow)) {
-        profile_log_cursor->flow = 0;
+    if (log_ticks++ % log_decimation != 0 && !isnan(y)) {
+        return;
     }
 
-    profile_log_cursor->volume = get_volume();
-    profile_log_cursor->mass = mass_filter.y;
-
-    profile_log_cursor++;
+    double sample[RECORD_CHANNELS];
+
+    sample[RECORD_PHASE] = phase;
+    sample[RECORD_STAGE] = stage;
+    sample[RECORD_X] = x;
+    sample[RECORD_Y] = y;
+    sample[RECORD_PRESSURE] = pressure_filter.y;
+    sample[RECORD_FLOW] = get_flow();
+    sample[RECORD_VOLUME] = get_volume();
+    sample[RECORD_MASS] = mass_filter.y;
+    sample[RECORD_TEMPERATURE] = temperature_filter.y;
+    sample[RECORD_HEAT] = get_heat_power();
+    sample[RECORD_PUMP] = get_pump_flow();
+
+    append_record(&profile_log, sample);
 }
 
-void print_profile_log(void)
+void set_log_decimation(unsigned int n)
 {
-    for (struct profile_log_entry *p
-             = (struct profile_log_entry *)&__scratch_start;
-         p < profile_log_cursor;
-         p++) {
-        uprintf("%d, %d, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f\n",
-                p->phase,
-                p->stage,
-                (double)p->x,
-                (double)p->y,
-                (double)p->pressure,
-                (double)p->flow,
-                (double)p->volume,
-                (double)p->mass);
-    }
+    log_decimation = n > 0 ? n : 1;
 }
 
-static inline double evaluate_profile_at(const double *P_i, double x)
+unsigned int get_log_decimation(void)
 {
-    const double s = x - P_i[0];
-    return P_i[1] + s * s * (P_i[2] + s * P_i[3]);
+    return log_decimation;
 }
 
-static void interpolate_profile_at(double (*P)[4], size_t i)
+void print_profile_log(void)
 {
-    const double h = P[i + 1][0] - P[i][0];
-    const double d = (P[i + 1][1] - P[i][1]) / h / h;
-
-    P[i][2] = 3 * d;
-    P[i][3] = -2 * d / h;
+    struct record_cursor c;
+    double p[RECORD_CHANNELS];
+
+    seek_record(&profile_log, &c, 0);
+
+    while (read_record(&profile_log, &c, p)) {
+        uprintf("%d, %d, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f, "
+                "%.3f, %.3f, %.3f\n",
+                (int)p[RECORD_PHASE],
+                (int)p[RECORD_STAGE],
+                p[RECORD_X],
+                p[RECORD_Y],
+                p[RECORD_PRESSURE],
+                p[RECORD_FLOW],
+                p[RECORD_VOLUME],
+                p[RECORD_MASS],
+                p[RECORD_TEMPERATURE],
+                p[RECORD_HEAT],
+                p[RECORD_PUMP]);
+    }
 }
 
-static void interpolate_profile(void)
+static double decode_point(int16_t z)
 {
-    for (size_t j = 0; j < profile.size; j++) {
-        const struct stage *stage = &profile.stages[j];
-        double (*P)[4] = stage->points;
-
-        for (size_t i = 0; i < stage->sizes[0]; i++) {
-            interpolate_profile_at(P, i);
-        }
+    switch (z) {
+    case POINT_INFINITY: return INFINITY;
+    case -POINT_INFINITY: return -INFINITY;
+    default: return (double)z / POINT_SCALE;
     }
 }
 
@@ -140,8 +148,46 @@ static void back_calculate_pid(struct pid *pid, double dy_dt, double u)
 
 static bool enabled;
 static double start = NAN;
+
+/* The time the current stage began.  When a stage ends on a time
+ * input, this is when the input reached the last point, which can
+ * be up to a tick earlier than when the end was detected. */
+
+static double boundary = NAN;
 static size_t cursor;
 static bool initialize_stage = true;
+static bool settling;
+
+/* The current stage, compiled. */
+
+static double compiled[MAX_POINTS][4];
+static struct curve curve;
+
+/* Whether the current stage ends the profile, and hence the shot, on
+ * yield. */
+
+static bool ends_on_yield(const struct stage *stage)
+{
+    if (stage->input != MASS_INPUT || cursor + 1 != profile.size) {
+        return false;
+    }
+
+    for (size_t j = 0; j < stage->sizes[1]; j++) {
+        if (stage->actions[j] == BACK) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool yield_callback(void)
+{
+    settling = !settle_yield(
+        get_time(), mass_filter.y, get_estimate(YIELD_RATE_ESTIMATE));
+
+    return !settling;
+}
 
 static bool profiling_callback(void)
 {
@@ -153,7 +199,6 @@ static bool profiling_callback(void)
 
     for (; cursor < profile.size; cursor++) {
         const struct stage *stage = &profile.stages[cursor];
-        double (*P)[4] = stage->points;
         double x;
 
         /* Establish the input. */
@@ -184,11 +229,26 @@ static bool profiling_callback(void)
             x = mass_filter.y;
             break;
 
+        case MASS_RATE_INPUT:
+            x = mass_rate_filter.y;
+
+            if (isnan(x)) {
+                x = 0;
+            }
+
+            break;
+
         default: uassert(false);
         }
 
         if (initialize_stage) {
-            input_reference = x;
+            trace(STAGE_EVENT, cursor, 0);
+
+            if (stage->input == TIME_INPUT) {
+                input_reference = boundary - start;
+            } else {
+                input_reference = x;
+            }
 
             switch (stage->output) {
             case POWER_OUTPUT:
@@ -223,45 +283,95 @@ static bool profiling_callback(void)
                 }
 
                 break;
-            }
 
-            /* Potentially fill in a missing initial value, ensuring
-             * continuity wrt the previous stage. */
+            case MASS_RATE_OUTPUT:
+                output_reference = mass_rate_filter.y;
 
-            if (stage->ease_input || stage->ease_output) {
-                if (stage->ease_input) {
-                    P[0][0] = input_reference;
-                    adjust_value(
-                        &P[0][0], input_reference, stage->input_mode, false);
+                if (isnan(output_reference)) {
+                    output_reference = 0;
                 }
 
-                if (stage->ease_output) {
-                    P[0][1] = output_reference;
-                    adjust_value(
-                        &P[0][1], output_reference, stage->output_mode, false);
+                {
+                    double dy_dt = mass_rate_filter.dy / mass_rate_filter.dt;
+
+                    if (isnan(dy_dt)) {
+                        dy_dt = 0;
+                    }
+
+                    back_calculate_pid(&mass_rate_pid, dy_dt, get_pump_flow());
                 }
 
-                interpolate_profile_at(P, 0);
+                break;
+            }
+
+            for (size_t j = 0; j < stage->sizes[0]; j++) {
+                compiled[j][0] = decode_point(stage->points[j][0]);
+                compiled[j][1] = decode_point(stage->points[j][1]);
+            }
+
+            /* Potentially fill in a missing initial value, ensuring
+             * continuity wrt the previous stage. */
+
+            if (stage->ease_input) {
+                compiled[0][0] = input_reference;
+                adjust_value(
+                    &compiled[0][0], input_reference, stage->input_mode, false);
             }
 
+            if (stage->ease_output) {
+                compiled[0][1] = output_reference;
+                adjust_value(&compiled[0][1], output_reference,
+                             stage->output_mode, false);
+            }
+
+            compile_curve(&curve, compiled, stage->sizes[0],
+                          stage->input_mode, input_reference,
+                          stage->output_mode, output_reference);
+
             initialize_stage = false;
         }
 
-        adjust_value(&x, input_reference, stage->input_mode, false);
+        /* Find our position in the current segment and evaluate the
+         * profile there. */
+
+        double y;
+        bool finished = !evaluate_curve(&curve, x, &y);
+
+        /* When the shot ends on yield, anticipate the coffee that
+         * will still drip into the cup after the pump stops, so
+         * that the final mass lands on target. */
+
+        if (ends_on_yield(stage)) {
+            const double target = curve.points[curve.size - 1][0];
+            const double R = get_estimate(YIELD_RATE_ESTIMATE);
+            const double x_p = predict_yield(mass_filter.y, R);
 
-        /* Find our position in the current segment. */
+            finished = finished || (curve.increasing
+                                    ? x_p >= target : x_p <= target);
 
-        size_t i;
+            if (finished) {
+                trigger_yield(get_time(), target, mass_filter.y, R);
 
-        {
-            const bool p = P[0][0] < P[1][0];
-            for (i = 0; (i + 1 < stage->sizes[0]
-                         && (p ? P[i + 1][0] <= x : P[i + 1][0] >= x)); i++);
+                if (!settling) {
+                    settling = true;
+                    add_callback(yield_callback, tick_callbacks);
+                }
+            }
         }
 
-        if (i + 1 == stage->sizes[0]) {
+        const size_t i = curve.cursor;
+
+        if (finished) {
             /* We've finished the current stage. */
 
+            const double x_n = curve.points[curve.size - 1][0];
+
+            if (stage->input == TIME_INPUT && curve.increasing && x_n <= x) {
+                boundary = start + x_n;
+            } else {
+                boundary = get_time();
+            }
+
             for (size_t j = 0; j < stage->sizes[1]; j++) {
                 switch (stage->actions[j]) {
                 case BACK:
@@ -271,7 +381,7 @@ static bool profiling_callback(void)
                     tare_flow();
                     break;
                 case RESET_TIME:
-                    start = get_time();
+                    start = boundary;
                     break;
                 case RESET_MASS:
                     tare_mass();
@@ -285,10 +395,7 @@ static bool profiling_callback(void)
             continue;
         }
 
-        /* Evaluate the profile and set the output. */
-
-        double y = evaluate_profile_at(P[i], x);
-        adjust_value(&y, output_reference, stage->output_mode, true);
+        /* Set the output. */
 
         log_profile_execution(cursor, i, x, y);
 
@@ -296,6 +403,7 @@ static bool profiling_callback(void)
         case POWER_OUTPUT:
             pressure_pid.set = NAN;
             flow_pid.set = NAN;
+            mass_rate_pid.set = NAN;
 
             set_pump_flow(y);
 
@@ -304,12 +412,21 @@ static bool profiling_callback(void)
         case PRESSURE_OUTPUT:
             pressure_pid.set = y;
             flow_pid.set = NAN;
+            mass_rate_pid.set = NAN;
 
             break;
 
         case FLOW_OUTPUT:
             pressure_pid.set = NAN;
             flow_pid.set = y;
+            mass_rate_pid.set = NAN;
+
+            break;
+
+        case MASS_RATE_OUTPUT:
+            pressure_pid.set = NAN;
+            flow_pid.set = NAN;
+            mass_rate_pid.set = y;
 
             break;
         }
@@ -320,6 +437,7 @@ static bool profiling_callback(void)
     if (cursor == profile.size) {
         pressure_pid.set = NAN;
         flow_pid.set = NAN;
+        mass_rate_pid.set = NAN;
         set_pump_flow(0);
 
         return true;
@@ -331,14 +449,17 @@ static bool profiling_callback(void)
 static bool brew_callback(bool down)
 {
     if (down) {
-        start = get_time();
+        start = boundary = get_time();
+        log_ticks = 0;
 
         tare_flow();
 
         pressure_pid.integral = 0;
         flow_pid.integral = 0;
+        mass_rate_pid.integral = 0;
 
-        profile_log_cursor = (struct profile_log_entry *)&__scratch_start;
+        reset_record(&profile_log, &__scratch_start,
+                     (char *)&__scratch_end - (char *)&__scratch_start);
 
         if (enabled) {
             initialize_stage = true;
@@ -355,8 +476,13 @@ static bool brew_callback(bool down)
 
 void reset_profile(void)
 {
-    read_profile(PROFILE);
-    interpolate_profile();
+    /* Load the selected profile, falling back to the built-in one,
+     * if it has been corrupted. */
+
+    if (!load_library_profile(get_library_selection())) {
+        load_default_profile();
+    }
+
     add_callback(brew_callback, panel_callbacks);
 }
 
@@ -394,227 +520,90 @@ double get_shot_time(void)
 
 /* Profile reading and printing */
 
-#define BUFFER_SIZE 1024
-
 extern char __section_program_buffer[BUFFER_SIZE];
-static char *__section_program_p = __section_program_buffer;
+static struct parse_error error;
 
-static size_t reset_alloc(void)
+const struct profile *get_profile(void)
 {
-    const size_t n = __section_program_p - __section_program_buffer;
-    __section_program_p = __section_program_buffer;
-
-    return n;
+    return &profile;
 }
 
-static char *alloc(size_t n)
-{
-    /* Round to multiple of 4 if necessary, to keep addresses
-     * aligned. */
+/* Read a profile, either as text, or packed and encoded, replacing
+ * the current one only if it's valid.  On failure, the error can be
+ * retrieved with get_profile_error(). */
 
-    n = (n + 3) & ~3;
+bool read_profile(const char *s)
+{
+    if (!isnan(start)) {
+        error.offset = 0;
+        error.message = "shot in progress";
 
-    if (__section_program_p + n - __section_program_buffer > BUFFER_SIZE) {
-        return NULL;
+        return false;
     }
 
-    char * const p = __section_program_p;
-    __section_program_p += n;
-
-    return p;
+    return parse_profile(s, __section_program_buffer, BUFFER_SIZE,
+                         &profile, &error);
 }
 
-static const char *buffer;
-
-static bool print_error_callback(void)
+bool read_encoded_profile(char *s)
 {
-    uprintf("...%s\n", buffer);
+    if (!isnan(start)) {
+        error.offset = 0;
+        error.message = "shot in progress";
 
-    return true;
-}
-
-#define PEEK() (*buffer)
-#define CHECK(X) ((*buffer == (X)) && buffer++)
-
-#define ERROR() {                                               \
-        uprintf("! %d\n", __LINE__);                            \
-        add_callback(print_error_callback, tick_callbacks);     \
-        return 0;                                               \
-    }
-
-#define EXPECT(X) {                             \
-        if (*buffer != (X)) {                   \
-            ERROR();                            \
-        } else {                                \
-            buffer++;                           \
-        }                                       \
-    }
-
-#define READ_INT(X) X = strtol(buffer, (char **)&buffer, 10)
-#define READ_DOUBLE(_F) {                               \
-        const char *t = buffer;                         \
-        double f = strtod(buffer, (char **)&buffer);    \
-        _F = (buffer == t) ? (double)NAN : f;           \
+        return false;
     }
 
-#define READ_CHAR(_C) _C = *(buffer++);
+    return parse_encoded_profile(s, __section_program_buffer, BUFFER_SIZE,
+                                 &profile, &error);
+}
 
-static size_t read_stage(size_t i, struct stage **stages)
+const struct parse_error *get_profile_error(void)
 {
-    if (!CHECK(',')) {
-        EXPECT('\0');
-
-        *stages = (struct stage *)alloc(i * sizeof(struct stage));
-
-        return i;
-    }
-
-    struct stage stage;
-    char c;
-
-    /* Input */
-
-    READ_CHAR(c);
-
-    switch(c) {
-    case 'a': stage.input_mode = ABSOLUTE; break;
-    case 'q': stage.input_mode = RATIOMETRIC; break;
-    case 'r': stage.input_mode = RELATIVE; break;
-    default: ERROR();
-    }
-
-    READ_CHAR(c);
-
-    switch(c) {
-    case 'f': stage.input = FLOW_INPUT; break;
-    case 'p': stage.input = PRESSURE_INPUT; break;
-    case 't': stage.input = TIME_INPUT; break;
-    case 'v': stage.input = VOLUME_INPUT; break;
-    case 'm': stage.input = MASS_INPUT; break;
-    default: ERROR();
-    }
-
-    EXPECT(';');
-
-    /* Output */
-
-    READ_CHAR(c);
-
-    switch(c) {
-    case 'a': stage.output_mode = ABSOLUTE; break;
-    case 'r': stage.output_mode = RELATIVE; break;
-    case 'q': stage.output_mode = RATIOMETRIC; break;
-    default: ERROR();
-    }
-
-    READ_CHAR(c);
-
-    switch(c) {
-    case 'f': stage.output = FLOW_OUTPUT; break;
-    case 'w': stage.output = POWER_OUTPUT; break;
-    case 'p': stage.output = PRESSURE_OUTPUT; break;
-    default: ERROR();
-    }
-
-    EXPECT(';');
-
-    /* Points */
-
-    stage.points = (double (*)[4])alloc(0);
-
-    int j;
-
-    for (j = 0; CHECK('(') ; j++) {
-        double x, y;
-
-        READ_DOUBLE(x);
-        EXPECT(',');
-        READ_DOUBLE(y);
-
-        EXPECT(')');
-        EXPECT(';');
-
-        alloc(sizeof(double[4]));
-
-        stage.points[j][0] = x;
-        stage.points[j][1] = y;
-
-        if (j == 0) {
-            stage.ease_input = isnan(x);
-            stage.ease_output = isnan(y);
-        }
-    }
-
-    /* Need at least one segment, i.e. pair of points. */
-
-    if (j < 2) {
-        ERROR();
-    }
-
-    stage.sizes[0] = j;
-
-    /* Actions */
-
-    stage.actions = (enum action *)alloc(0);
+    return &error;
+}
 
-    for (j = 0; isalpha((int)PEEK()); j++) {
-        READ_CHAR(c);
+bool load_default_profile(void)
+{
+    return read_profile(PROFILE);
+}
 
-        switch(c) {
-        case 'b': stage.actions[j] = BACK; break;
-        case 'v': stage.actions[j] = RESET_VOLUME; break;
-        case 't': stage.actions[j] = RESET_TIME; break;
-        case 'm': stage.actions[j] = RESET_MASS; break;
-        default: ERROR();
-        }
+/* Make a profile current, given an image of the program buffer its
+ * stages point into. */
 
-        alloc(sizeof(enum action));
+bool load_profile(const struct profile *p, const void *image)
+{
+    if (!isnan(start) || p->alloc > BUFFER_SIZE) {
+        return false;
     }
 
-    stage.sizes[1] = j;
-
-    /* Read next stage, then save. */
-
-    const size_t n = read_stage(i + 1, stages);
-
-    if (n > 0) {
-        memcpy(*stages + i, &stage, sizeof(struct stage));
-    }
+    memcpy(__section_program_buffer, image, p->alloc);
+    profile = *p;
 
-    return n;
+    return true;
 }
 
-#undef PEEK
-#undef CHECK
-#undef EXPECT
-#undef READ_INT
-#undef READ_DOUBLE
-#undef READ_CHAR
-
-const struct profile *get_profile(void)
+const void *get_profile_image(void)
 {
-    return &profile;
+    return __section_program_buffer;
 }
 
-bool read_profile(const char *s)
-{
-    struct profile p;
-
-    buffer = s;
+/* The bytes of the program buffer taken by the current profile and
+ * of the scratch region taken by the log of the last shot, returning
+ * the size of each as well. */
 
-    /* Stages */
-
-    p.size = read_stage(0, &p.stages);
-    p.alloc = reset_alloc();
+size_t get_program_usage(size_t *size)
+{
+    *size = BUFFER_SIZE;
 
-    if (p.size > 0) {
-        profile = p;
-        interpolate_profile();
+    return profile.alloc;
+}
 
-        return true;
-    }
+size_t get_log_usage(size_t *size)
+{
+    *size = (char *)&__scratch_end - (char *)&__scratch_start;
 
-    return false;
+    return profile_log.length;
 }
 
 void print_profile(void)
@@ -640,6 +629,7 @@ void print_profile(void)
         case TIME_INPUT: uprintf("t"); break;
         case VOLUME_INPUT: uprintf("v"); break;
         case MASS_INPUT: uprintf("m"); break;
+        case MASS_RATE_INPUT: uprintf("y"); break;
         }
 
         uprintf(";");
@@ -656,6 +646,7 @@ void print_profile(void)
         case FLOW_OUTPUT: uprintf("f"); break;
         case POWER_OUTPUT: uprintf("w"); break;
         case PRESSURE_OUTPUT: uprintf("p"); break;
+        case MASS_RATE_OUTPUT: uprintf("y"); break;
         }
 
         uprintf(";");
@@ -666,13 +657,13 @@ void print_profile(void)
             uprintf("(");
 
             if (j > 0 || !stage->ease_input) {
-                uprintf("%f", (double)stage->points[j][0]);
+                uprintf("%.2f", decode_point(stage->points[j][0]));
             }
 
             uprintf(",");
 
             if (j > 0 || !stage->ease_output) {
-                uprintf("%f", (double)stage->points[j][1]);
+                uprintf("%.2f", decode_point(stage->points[j][1]));
             }
 
             uprintf(");");
@@ -17,9 +17,32 @@
 #ifndef PROFILE_H
 #define PROFILE_H
 
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
 
+struct parse_error;
+
+/* Point coordinates are stored in fixed point, in hundredths, so
+ * that values given with up to two decimals are reproduced exactly.
+ * A missing coordinate, to be eased in, is stored as POINT_MISSING
+ * and infinite ones as plus or minus POINT_INFINITY.
+ * The segments' coefficients are derived when the stage is
+ * compiled for execution, which also limits the number of points
+ * per stage. */
+
+#define POINT_SCALE 100
+#define POINT_MISSING INT16_MIN
+#define POINT_INFINITY INT16_MAX
+#define MAX_POINTS 32
+
+enum action {
+    BACK,
+    RESET_VOLUME,
+    RESET_TIME,
+    RESET_MASS,
+};
+
 struct profile {
     size_t size, alloc;
 
@@ -30,39 +53,30 @@ struct profile {
             TIME_INPUT,
             VOLUME_INPUT,
             MASS_INPUT,
-        } input;
+            MASS_RATE_INPUT,
+        } input : 3;
 
         enum {
             FLOW_OUTPUT,
             POWER_OUTPUT,
             PRESSURE_OUTPUT,
-        } output;
+            MASS_RATE_OUTPUT,
+        } output : 2;
 
         enum mode {
             ABSOLUTE,
             RATIOMETRIC,
             RELATIVE,
-        } input_mode, output_mode;
-
-        bool ease_input, ease_output;
-        double (*points)[4];
+        } input_mode : 2, output_mode : 2;
 
-        enum action {
-            BACK,
-            RESET_VOLUME,
-            RESET_TIME,
-            RESET_MASS,
-        } *actions;
+        bool ease_input : 1, ease_output : 1;
+        uint8_t sizes[2];
 
-        size_t sizes[2];
+        int16_t (*points)[2];
+        uint8_t *actions;
     } *stages;
 };
 
-struct profile_log_entry {
-    uint8_t phase, stage;
-    __fp16 x, y, pressure, flow, volume, mass;
-};
-
 void reset_profile(void);
 void enable_profile(bool enable);
 double get_shot_time(void);
@@ -72,6 +86,15 @@ size_t get_stages(void);
 const struct profile *get_profile(void);
 void print_profile(void);
 void print_profile_log(void);
+void set_log_decimation(unsigned int n);
+unsigned int get_log_decimation(void);
 bool read_profile(const char *s);
+bool read_encoded_profile(char *s);
+const struct parse_error *get_profile_error(void);
+bool load_default_profile(void);
+bool load_profile(const struct profile *p, const void *image);
+const void *get_profile_image(void);
+size_t get_program_usage(size_t *size);
+size_t get_log_usage(size_t *size);
 
 #endif
@@ -0,0 +1,379 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "record.h"
+
+#define MISSING INT32_MIN
+#define BLOCK_HEADER 2
+
+/* The bitmap and an eleven-nibble varint for each channel. */
+
+#define MAX_SAMPLE_SIZE ((4 + 11 * RECORD_CHANNELS + 1) / 2)
+
+/* The quantization step of each channel is the reciprocal of its
+ * scale. */
+
+static const double scales[RECORD_CHANNELS] = {
+    [RECORD_X] = 100,
+    [RECORD_Y] = 100,
+    [RECORD_PRESSURE] = 100,    /* 0.01 bar */
+    [RECORD_FLOW] = 100,        /* 0.01 ml/s */
+    [RECORD_VOLUME] = 100,      /* 0.01 ml */
+    [RECORD_MASS] = 100,        /* 0.01 g */
+    [RECORD_PUMP] = 1000,       /* 0.1 % */
+    [RECORD_TEMPERATURE] = 100, /* 0.01 deg. C */
+    [RECORD_HEAT] = 1000,       /* 0.1 % */
+    [RECORD_PHASE] = 1,
+    [RECORD_STAGE] = 1,
+};
+
+static int32_t quantize(double x, double scale)
+{
+    if (isnan(x)) {
+        return MISSING;
+    }
+
+    return (int32_t)lround(fmax(-INT32_MAX, fmin(INT32_MAX, x * scale)));
+}
+
+/* Values are written as varints of nibbles, each with three bits of
+ * the value and a continuation bit, since most differences are
+ * small.  Each sample starts at a byte boundary. */
+
+struct nibbles {
+    uint8_t *p;
+    bool odd;
+};
+
+static void put_nibble(struct nibbles *n, uint8_t v)
+{
+    if (n->odd) {
+        *(n->p++) |= v << 4;
+    } else {
+        *n->p = v;
+    }
+
+    n->odd = !n->odd;
+}
+
+static uint8_t get_nibble(struct nibbles *n)
+{
+    const uint8_t v = n->odd ? *(n->p++) >> 4 : *n->p & 0xf;
+
+    n->odd = !n->odd;
+
+    return v;
+}
+
+static void put_varint(struct nibbles *n, uint32_t v)
+{
+    for (; v >= 0x8; v >>= 3) {
+        put_nibble(n, (uint8_t)(v & 0x7) | 0x8);
+    }
+
+    put_nibble(n, (uint8_t)v);
+}
+
+static uint32_t get_varint(struct nibbles *n)
+{
+    uint32_t v = 0;
+
+    for (int s = 0; ; s += 3) {
+        const uint8_t b = get_nibble(n);
+
+        v |= (uint32_t)(b & 0x7) << s;
+
+        if (!(b & 0x8)) {
+            return v;
+        }
+    }
+}
+
+void reset_record(struct record *r, void *buffer, size_t size)
+{
+    r->buffer = buffer;
+    r->size = size;
+    r->length = 0;
+    r->block = 0;
+    r->count = 0;
+}
+
+/* Append a sample, with a value for each channel, returning false if
+ * the record is full. */
+
+bool append_record(struct record *r, const double *sample)
+{
+    if (r->length + BLOCK_HEADER + MAX_SAMPLE_SIZE > r->size) {
+        return false;
+    }
+
+    if (r->count % RECORD_BLOCK == 0) {
+        r->block = r->length;
+        r->length += BLOCK_HEADER;
+        memset(r->last, 0, sizeof(r->last));
+    }
+
+    uint32_t z[RECORD_CHANNELS];
+    uint32_t bitmap = 0;
+
+    for (int i = 0; i < RECORD_CHANNELS; i++) {
+        const int32_t v = quantize(sample[i], scales[i]);
+        const uint32_t d = (uint32_t)v - (uint32_t)r->last[i];
+
+        z[i] = (d << 1) ^ (0 - (d >> 31));
+
+        if (z[i]) {
+            bitmap |= (uint32_t)1 << i;
+        }
+
+        r->last[i] = v;
+    }
+
+    struct nibbles n = {r->buffer + r->length, false};
+
+    put_varint(&n, bitmap);
+
+    for (int i = 0; i < RECORD_CHANNELS; i++) {
+        if (z[i]) {
+            put_varint(&n, z[i]);
+        }
+    }
+
+    r->length = n.p + n.odd - r->buffer;
+    r->count++;
+
+    /* Keep the size of the block current, so that the record can be
+     * read at any time. */
+
+    const size_t m = r->length - r->block;
+
+    r->buffer[r->block] = (uint8_t)m;
+    r->buffer[r->block + 1] = (uint8_t)(m >> 8);
+
+    return true;
+}
+
+/* Position a cursor at the nth sample, skipping whole blocks and then
+ * decoding the samples preceding it in its block. */
+
+bool seek_record(const struct record *r, struct record_cursor *c, size_t n)
+{
+    if (n > r->count) {
+        return false;
+    }
+
+    c->offset = c->end = 0;
+
+    for (size_t k = 0; k < n / RECORD_BLOCK; k++) {
+        c->offset = c->end += (r->buffer[c->end]
+                               | (size_t)r->buffer[c->end + 1] << 8);
+    }
+
+    double sample[RECORD_CHANNELS];
+
+    for (size_t k = 0; k < n % RECORD_BLOCK; k++) {
+        read_record(r, c, sample);
+    }
+
+    return true;
+}
+
+bool read_record(const struct record *r, struct record_cursor *c,
+                 double *sample)
+{
+    if (c->offset == c->end) {
+        if (c->end + BLOCK_HEADER > r->length) {
+            return false;
+        }
+
+        c->offset = c->end + BLOCK_HEADER;
+        c->end += (r->buffer[c->end] | (size_t)r->buffer[c->end + 1] << 8);
+        memset(c->last, 0, sizeof(c->last));
+    }
+
+    struct nibbles n = {r->buffer + c->offset, false};
+    const uint32_t bitmap = get_varint(&n);
+
+    for (int i = 0; i < RECORD_CHANNELS; i++) {
+        if (bitmap & ((uint32_t)1 << i)) {
+            const uint32_t z = get_varint(&n);
+
+            c->last[i] = (int32_t)((uint32_t)c->last[i]
+                                   + ((z >> 1) ^ (0 - (z & 1))));
+        }
+
+        sample[i] = (c->last[i] == MISSING
+                     ? (double)NAN
+                     : c->last[i] / scales[i]);
+    }
+
+    c->offset = n.p + n.odd - r->buffer;
+
+    return true;
+}
+
+#ifdef TEST
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Record a synthetic shot, at various tick rates, and compare the
+ * size of the record with that of the previous, uncompressed log,
+ * which stored eight channels as half floats in 14 bytes per tick.
+ * Each sensor is sampled at its own rate and held in between, as it
+ * would be seen from the tick interrupt. */
+
+#define DURATION 60.0           /* s */
+#define OLD_SIZE 14             /* bytes per tick */
+
+static double gaussian(double sigma)
+{
+    /* Via the Box-Muller transform. */
+
+    const double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    const double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+    return sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+/* A noisy signal x(t), low-pass filtered, as the sensor filters do,
+ * and sampled every T seconds. */
+
+struct signal {
+    double T, t, y, sigma, tau;
+};
+
+static double sample_signal(struct signal *s, double t, double x)
+{
+    if (t >= s->t) {
+        s->y += (x + gaussian(s->sigma) - s->y) * fmin(1, s->T / s->tau);
+        s->t += s->T;
+    }
+
+    return s->y;
+}
+
+/* The shot: a preinfusion at 3 ml/s up to 3 bar, a ramp to 9 bar and
+ * a declining flow, as the puck erodes. */
+
+static void shoot(double t, double *P, double *Q, double *y, int *phase)
+{
+    if (t < 8) {
+        *phase = 0;
+        *P = 3 * t / 8;
+        *Q = 3;
+        *y = 3;
+    } else if (t < 14) {
+        *phase = 1;
+        *P = 3 + (t - 8);
+        *Q = 1.5;
+        *y = *P;
+    } else {
+        *phase = 2;
+        *P = 9;
+        *Q = 2 + 0.5 * (t - 14) / (DURATION - 14);
+        *y = 9;
+    }
+}
+
+static size_t record_shot(double f, uint8_t *buffer, size_t size)
+{
+    struct record r;
+    struct signal pressure = {1 / 150.0, 0, 0, 0.05, 0.02};
+    struct signal flow = {1 / 20.0, 0, 0, 0.2, 0.1};
+    struct signal mass = {1 / 20.0, 0, 0, 0.05, 0.1};
+    struct signal pump = {1 / 150.0, 0, 0, 0.01, 0.02};
+    struct signal temperature = {0.06, 0, 93, 0.05, 0.3};
+    struct signal heat = {0.06, 0, 0.3, 0.02, 0.06};
+    double V = 0, M = 0, t_0 = 0;
+    int phase_0 = 0;
+
+    reset_record(&r, buffer, size);
+
+    const int n = (int)(DURATION * f);
+
+    for (int k = 0; k < n; k++) {
+        const double t = k / f;
+        double P, Q, y, sample[RECORD_CHANNELS], check[RECORD_CHANNELS];
+        int phase;
+
+        shoot(t, &P, &Q, &y, &phase);
+
+        /* The end of a stage is logged without an output. */
+
+        if (phase != phase_0) {
+            t_0 = t;
+            phase_0 = phase;
+            y = NAN;
+        }
+
+        V += Q / f;
+        M += (t > 10 ? 0.8 * Q : 0) / f;
+
+        sample[RECORD_X] = t - t_0;
+        sample[RECORD_Y] = y;
+        sample[RECORD_PRESSURE] = sample_signal(&pressure, t, P);
+        sample[RECORD_FLOW] = sample_signal(&flow, t, Q);
+        sample[RECORD_VOLUME] = V;
+        sample[RECORD_MASS] = sample_signal(&mass, t, M);
+        sample[RECORD_PUMP] = sample_signal(&pump, t, 0.2 + 0.05 * P);
+        sample[RECORD_TEMPERATURE] = sample_signal(&temperature, t, 93);
+        sample[RECORD_HEAT] = sample_signal(&heat, t, 0.3);
+        sample[RECORD_PHASE] = phase;
+        sample[RECORD_STAGE] = 0;
+
+        assert(append_record(&r, sample));
+
+        /* Check the sample round trip, via a seek. */
+
+        struct record_cursor c;
+
+        assert(seek_record(&r, &c, k));
+        assert(read_record(&r, &c, check));
+
+        for (int i = 0; i < RECORD_CHANNELS; i++) {
+            assert(isnan(sample[i])
+                   ? isnan(check[i])
+                   : fabs(check[i] - sample[i]) <= 0.5 / scales[i] + 1e-9);
+        }
+    }
+
+    return r.length;
+}
+
+int main(void)
+{
+    static uint8_t buffer[1 << 20];
+    static const double rates[] = {10, 50, 100, 200};
+
+    printf("Rate (Hz)  Bytes/tick  Old  s/KB  Old s/KB  Ratio\n");
+
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        const double f = rates[i];
+        const double b = (double)record_shot(f, buffer, sizeof(buffer))
+            / (DURATION * f);
+
+        printf("%9.0f  %10.2f  %3d  %4.1f  %8.1f  %5.2f\n",
+               f, b, OLD_SIZE, 1024 / b / f, 1024.0 / OLD_SIZE / f,
+               OLD_SIZE / b);
+    }
+
+    return 0;
+}
+#endif
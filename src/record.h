@@ -0,0 +1,69 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A compressed record of samples of a fixed set of channels, such as
+ * the profile execution log.  Each channel is quantized to a fixed
+ * point value and stored as the zigzag varint-encoded difference
+ * from its previous value, with a bitmap marking the channels that
+ * changed.  Samples are grouped in blocks, the first sample of which
+ * is a keyframe, encoded with respect to zero, so that a given
+ * sample can be found by skipping whole blocks. */
+
+#define RECORD_CHANNELS 11
+#define RECORD_BLOCK 64
+
+/* Channels are ordered roughly by decreasing rate of change, to keep
+ * the bitmap short. */
+
+enum record_channel {
+    RECORD_X,
+    RECORD_Y,
+    RECORD_PRESSURE,
+    RECORD_FLOW,
+    RECORD_VOLUME,
+    RECORD_MASS,
+    RECORD_PUMP,
+    RECORD_TEMPERATURE,
+    RECORD_HEAT,
+    RECORD_PHASE,
+    RECORD_STAGE,
+};
+
+struct record {
+    uint8_t *buffer;
+    size_t size, length, block, count;
+    int32_t last[RECORD_CHANNELS];
+};
+
+struct record_cursor {
+    size_t offset, end;
+    int32_t last[RECORD_CHANNELS];
+};
+
+void reset_record(struct record *r, void *buffer, size_t size);
+bool append_record(struct record *r, const double *sample);
+bool seek_record(const struct record *r, struct record_cursor *c, size_t n);
+bool read_record(const struct record *r, struct record_cursor *c,
+                 double *sample);
+
+#endif
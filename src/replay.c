@@ -0,0 +1,661 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A replay harness for the filters and controllers.  It reads a log,
+ * as printed by one of the l commands, and drives the firmware's own
+ * filter or controller with the recorded samples, at the recorded
+ * times, comparing its output with the recorded one.  It reports the
+ * drift of each output and the throughput, in samples per second.
+ *
+ * The logs are printed with limited precision, so some drift is to
+ * be expected when replaying them.  To check a change to the
+ * numerics, replay a log once with -o, before the change, to get the
+ * output at full precision and then replay that output after the
+ * change, with -e to set a tolerance on the drift. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "callbacks.h"
+#include "health.h"
+#include "jitter.h"
+#include "peripherals.h"
+
+#define COLUMNS 7
+
+/* Mass deviations larger than this are taken to be due to a tare,
+ * which isn't logged. */
+
+#define TARE_THRESHOLD 0.05     /* g */
+
+/* Changes in the I term larger than this, which can't be explained by
+ * integration, are taken to be due to the profile. */
+
+#define INTERVENTION_THRESHOLD 2e-3
+
+/* The columns of the sensor logs... */
+
+enum {TIME, VALUE, DERIVATIVE, RAW, CODE};
+
+/* ...and those of the controller logs. */
+
+enum {OUTPUT = 1, PROCESS, SET_POINT, P_TERM, I_TERM, D_TERM};
+
+/* The firmware's interface to the hardware.  Filters are configured
+ * as in the drivers, while the flow filter is flow.c's own. */
+
+struct filter temperature_filter = DOUBLE_FILTER(1.0, 60.0);
+struct filter pressure_filter = DOUBLE_FILTER(0.12, 60.0);
+struct filter mass_filter = SINGLE_FILTER(0.03);
+struct filter mass_rate_filter = SINGLE_FILTER(0.3);
+
+struct health health[SENSORS];
+
+static double output;
+
+void set_heat_power(double P)
+{
+    output = P;
+}
+
+void set_pump_flow(double Q)
+{
+    output = Q;
+}
+
+/* Latencies to the actuators aren't replayed, as the outputs take
+ * effect immediately. */
+
+double get_time(void)
+{
+    return NAN;
+}
+
+int uprintf(const char *format, ...)
+{
+    return 0;
+}
+
+void count_sample(enum sensor s, double t)
+{
+}
+
+void tare_volume_estimate(void)
+{
+}
+
+void _uassert(const char *msg, int line, const char *func)
+{
+    fprintf(stderr, msg, line, func);
+    abort();
+}
+
+/* State of the replay not kept in the filters and controllers
+ * themselves. */
+
+static struct {
+    double t, dt;
+
+    /* The accumulated mass mean and the tare, as in the NAU7802
+     * driver. */
+
+    double m, tare;
+    int n, decimation, tares;
+
+    /* The recorded I term and set-point, before the current
+     * sample. */
+
+    double I, set;
+    int interventions;
+
+    /* The cumulative pulse count and whether the next edge completes
+     * a period, as in the flow driver. */
+
+    double pulses;
+    bool valid;
+} replay = {.decimation = 16};
+
+struct kind {
+    char name;
+    int columns;
+    const char *labels[COLUMNS];
+    struct filter *filter;
+    struct pid *pid;
+    void **callbacks;
+    void (*seed)(const struct kind *k, const double *x, double dt);
+    void (*sample)(const struct kind *k, const double *x, double *z);
+};
+
+static void seed_sensor(const struct kind *k, const double *x, double dt)
+{
+    struct filter *f = k->filter;
+
+    f->y = x[VALUE];
+    f->dy = x[DERIVATIVE] * dt;
+    f->t = x[TIME];
+    f->dt = dt;
+}
+
+static void output_sensor(const struct filter *f, const double *x, double *z)
+{
+    z[TIME] = f->t;
+    z[VALUE] = f->y;
+    z[DERIVATIVE] = f->dy / f->dt;
+    z[RAW] = x[RAW];
+    z[CODE] = x[CODE];
+}
+
+/* The firmware restarts the filter after a sensor timeout, which
+ * shows up as an undefined derivative. */
+
+static void restart_sensor(struct filter *f, const double *x)
+{
+    if (isnan(x[DERIVATIVE])) {
+        f->y = f->dy = NAN;
+    }
+}
+
+static void sample_temperature(
+    const struct kind *k, const double *x, double *z)
+{
+    /* Readings with a byte read as zero are discarded, leaving the
+     * filter's time unchanged. */
+
+    if (x[TIME] != k->filter->t) {
+        filter_sample(k->filter, x[RAW], x[TIME]);
+    }
+
+    output_sensor(k->filter, x, z);
+}
+
+static void sample_pressure(const struct kind *k, const double *x, double *z)
+{
+    restart_sensor(k->filter, x);
+    filter_sample(k->filter, x[RAW], x[TIME]);
+    output_sensor(k->filter, x, z);
+}
+
+static void seed_mass(const struct kind *k, const double *x, double dt)
+{
+    seed_sensor(k, x, dt);
+
+    replay.m = x[RAW];
+    replay.n = replay.decimation;
+    replay.tare = NAN;
+}
+
+static void sample_mass(const struct kind *k, const double *x, double *z)
+{
+    const double m = x[RAW];
+    const int n = replay.decimation;
+    const bool p = fabs(m - replay.m) < 0.25;
+
+    if (p) {
+        replay.m = (m * n + replay.m * replay.n) / (n + replay.n);
+        replay.n += n;
+    }
+
+    if (!p || replay.n >= 1000) {
+        replay.m = m;
+        replay.n = n;
+    }
+
+    restart_sensor(k->filter, x);
+
+    const struct filter f = *k->filter;
+
+    filter_sample(k->filter, replay.m - replay.tare, x[TIME]);
+
+    /* When the replayed mass departs from the recorded one, recover
+     * the tare from the recorded mass, assuming the firmware zeroed
+     * the filter before the sample, if the recorded derivative is
+     * consistent with that.  Otherwise, the tare is only unknown, at
+     * the start of the log. */
+
+    if (!(fabs(k->filter->y - x[VALUE]) <= TARE_THRESHOLD)) {
+        const double a = exp(-k->filter->dt / k->filter->tau);
+        const double dy = x[DERIVATIVE] * k->filter->dt;
+
+        *k->filter = f;
+
+        if (!isnan(replay.tare) && !isnan(f.y)
+            && fabs(dy - x[VALUE]) < fabs(dy - (x[VALUE] - f.y))) {
+            k->filter->y = k->filter->dy = 0;
+            replay.tares++;
+        }
+
+        replay.tare = replay.m - (
+            isnan(f.y)
+            ? x[VALUE]
+            : (x[VALUE] - a * k->filter->y) / (1 - a));
+
+        filter_sample(k->filter, replay.m - replay.tare, x[TIME]);
+    }
+
+    output_sensor(k->filter, x, z);
+}
+
+/* The calibration, in ml per pair of pulses, as applied by the flow
+ * driver. */
+
+static double calibrate(double r)
+{
+    return 2 * calibrate_flow(r) / r;
+}
+
+/* The flow filter's state isn't logged; it is seeded with the first
+ * pulse rate, which is exact if the log starts before the pump. */
+
+static void seed_flow(const struct kind *k, const double *x, double dt)
+{
+    struct filter *f = k->filter;
+
+    f->y = x[RAW];
+    f->dy = 0;
+    f->t = x[TIME];
+    f->dt = dt;
+
+    replay.pulses = x[CODE];
+    replay.valid = (x[RAW] > 0);
+}
+
+static void sample_flow(const struct kind *k, const double *x, double *z)
+{
+    struct filter *f = k->filter;
+    const double r = x[RAW];
+
+    z[TIME] = x[TIME];
+    z[RAW] = r;
+    z[CODE] = x[CODE];
+
+    if (r == 0) {
+        /* A stagnation report. */
+
+        filter_sample(f, 0, x[TIME]);
+
+        z[VALUE] = 0;
+        z[DERIVATIVE] = 0 / f->dt;
+
+        replay.valid = false;
+    } else {
+        /* Recover the number of periods in the batch, from the pulse
+         * count, which restarts on a tare.  The first edge after
+         * stagnation doesn't complete a period. */
+
+        const double n = fmax(
+            1, x[CODE] - (x[CODE] < replay.pulses ? 0 : replay.pulses)
+            - !replay.valid);
+        const double dt = n / r;
+
+        filter_sample(f, r, x[TIME]);
+
+        z[VALUE] = n * calibrate(f->y) / 2 / dt;
+        z[DERIVATIVE] = (
+            n * (calibrate(f->y + f->dy) - calibrate(f->y)) / 2 / dt / dt);
+
+        replay.valid = true;
+    }
+
+    replay.pulses = x[CODE];
+}
+
+/* The integral, given the I term. */
+
+static double integral(const struct pid *pid, double I)
+{
+    return pid->K_p != 0 && isfinite(pid->T_i) ? I * pid->T_i / pid->K_p : 0;
+}
+
+static void seed_controller(const struct kind *k, const double *x, double dt)
+{
+    k->pid->integral = integral(k->pid, x[I_TERM]);
+
+    /* Time the next sample's interval from this one, as the
+     * controller would have. */
+
+    reset_jitter();
+
+    for (int i = 0; i < LOOPS; i++) {
+        sample_loop(i, x[TIME]);
+    }
+
+    replay.t = x[TIME];
+    replay.dt = dt;
+    replay.I = x[I_TERM];
+    replay.set = x[SET_POINT];
+}
+
+static void sample_controller(const struct kind *k, const double *x, double *z)
+{
+    struct pid *pid = k->pid;
+    const double K_p = pid->K_p;
+
+    /* The temperature controller is run on discarded readings as
+     * well, with the last interval. */
+
+    if (x[TIME] != replay.t) {
+        replay.dt = x[TIME] - replay.t;
+        replay.t = x[TIME];
+    }
+
+    const double dt = replay.dt;
+
+    /* While the controller is disengaged, the output is set by
+     * something else, such as the profile. */
+
+    output = x[OUTPUT] / 100;
+
+    /* The derivative is recovered from the D term and the set-point,
+     * which is printed with a single decimal, from the P term. */
+
+    const double dy = (
+        K_p * pid->T_d != 0 ? -x[D_TERM] / (K_p * pid->T_d) * dt : 0);
+
+    pid->set = (
+        K_p > 0 && isfinite(K_p)
+        ? x[PROCESS] + x[P_TERM] / K_p
+        : x[SET_POINT]);
+
+    /* The profile also changes the controller's state, zeroing the
+     * integral at the start of the shot and back-calculating it at
+     * the start of each stage, and the logs aren't atomic with
+     * respect to that.  Samples where the controller engages, or
+     * where the recorded integral changes other than by integration,
+     * are passed through and the replay picks up from them. */
+
+    const double dI = x[I_TERM] - replay.I;
+    const double dI_e = K_p * (pid->set - x[PROCESS]) * dt / pid->T_i;
+    const bool engaging = isnan(replay.set) && !isnan(x[SET_POINT]);
+
+    replay.I = x[I_TERM];
+    replay.set = x[SET_POINT];
+
+    if (engaging
+        || fmin(fabs(dI), fabs(dI - dI_e)) > INTERVENTION_THRESHOLD) {
+        pid->integral = integral(pid, x[I_TERM]);
+        memcpy(z, x, sizeof(double) * COLUMNS);
+        replay.interventions++;
+
+        return;
+    }
+
+    /* The mass rate controller reads the rate filter directly. */
+
+    if (pid == &mass_rate_pid) {
+        mass_rate_filter.y = x[PROCESS];
+        mass_rate_filter.dy = dy;
+        mass_rate_filter.t = x[TIME];
+        mass_rate_filter.dt = dt;
+    }
+
+    RUN_CALLBACKS(
+        k->callbacks,
+        bool (*)(double, double, double, double, double, int32_t),
+        x[PROCESS], dy, x[TIME], dt, NAN, 0);
+
+    z[TIME] = x[TIME];
+    z[OUTPUT] = 100 * output;
+    z[PROCESS] = x[PROCESS];
+    z[SET_POINT] = pid->set;
+    z[P_TERM] = K_p * (pid->set - x[PROCESS]);
+    z[I_TERM] = K_p * pid->integral / pid->T_i;
+    z[D_TERM] = -K_p * pid->T_d * dy / dt;
+}
+
+/* The kinds of log, named after the l command that prints them, and
+ * the outputs compared for each. */
+
+static const struct kind kinds[] = {
+    {'t', 5, {[VALUE] = "temperature", [DERIVATIVE] = "derivative"},
+     &temperature_filter, NULL, NULL, seed_sensor, sample_temperature},
+    {'p', 5, {[VALUE] = "pressure", [DERIVATIVE] = "derivative"},
+     &pressure_filter, NULL, NULL, seed_sensor, sample_pressure},
+    {'m', 5, {[VALUE] = "mass", [DERIVATIVE] = "derivative"},
+     &mass_filter, NULL, NULL, seed_mass, sample_mass},
+    {'f', 5, {[VALUE] = "flow", [DERIVATIVE] = "derivative"},
+     &flow_filter, NULL, NULL, seed_flow, sample_flow},
+    {'T', 7, {[OUTPUT] = "heat", [I_TERM] = "integral"},
+     NULL, &temperature_pid, temperature_callbacks,
+     seed_controller, sample_controller},
+    {'P', 7, {[OUTPUT] = "pump", [I_TERM] = "integral"},
+     NULL, &pressure_pid, pressure_callbacks,
+     seed_controller, sample_controller},
+    {'F', 7, {[OUTPUT] = "pump", [I_TERM] = "integral"},
+     NULL, &flow_pid, flow_callbacks,
+     seed_controller, sample_controller},
+    {'Y', 7, {[OUTPUT] = "pump", [I_TERM] = "integral"},
+     NULL, &mass_rate_pid, mass_callbacks,
+     seed_controller, sample_controller},
+};
+
+#define N_KINDS (sizeof(kinds) / sizeof(kinds[0]))
+
+static struct {
+    double (*x)[COLUMNS], (*z)[COLUMNS];
+    size_t n, size;
+} records;
+
+/* Read the records of the log, skipping lines that don't parse,
+ * such as those of other logs, printed at the same time. */
+
+static size_t read_records(FILE *f, int columns)
+{
+    char line[256];
+    size_t skipped = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        double x[COLUMNS];
+        char *s = line, *end;
+        int i;
+
+        for (i = 0; i < columns; i++) {
+            x[i] = strtod(s, &end);
+
+            if (end == s
+                || (i < columns - 1 ? *end != ',' : !strchr("\r\n", *end))) {
+                break;
+            }
+
+            s = end + 1;
+        }
+
+        if (i < columns) {
+            skipped++;
+            continue;
+        }
+
+        if (records.n == records.size) {
+            records.size = records.size ? 2 * records.size : 1024;
+            records.x = realloc(records.x, records.size * sizeof(*records.x));
+            records.z = realloc(records.z, records.size * sizeof(*records.z));
+
+            if (!records.x || !records.z) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+
+        memcpy(records.x[records.n++], x, sizeof(x));
+    }
+
+    return skipped;
+}
+
+static void run(const struct kind *k)
+{
+    memcpy(records.z[0], records.x[0], sizeof(records.z[0]));
+
+    k->seed(k, records.x[0], records.x[1][TIME] - records.x[0][TIME]);
+
+    for (size_t i = 1; i < records.n; i++) {
+        k->sample(k, records.x[i], records.z[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const struct kind *k = &kinds[0];
+    double tolerance = INFINITY, skip = 0;
+    int opt, passes = 1;
+    bool print = false;
+
+    while ((opt = getopt(argc, argv, "k:g:r:s:e:n:o")) != -1) {
+        switch (opt) {
+        case 'k':
+            for (k = kinds; k < kinds + N_KINDS; k++) {
+                if (optarg[0] == k->name && !optarg[1]) {
+                    break;
+                }
+            }
+
+            if (k == kinds + N_KINDS) {
+                fprintf(stderr, "Unknown log %s\n", optarg);
+                return 1;
+            }
+
+            break;
+        case 'g':
+            if (!k->pid
+                || sscanf(optarg, "%lf,%lf,%lf", &k->pid->K_p,
+                          &k->pid->T_i, &k->pid->T_d) != 3) {
+                fprintf(stderr, "Gains need a controller log, after -k\n");
+                return 1;
+            }
+
+            break;
+        case 'r':
+            replay.decimation = atoi(optarg);
+            break;
+        case 's':
+            skip = atof(optarg);
+            break;
+        case 'e':
+            tolerance = atof(optarg);
+            break;
+        case 'n':
+            passes = atoi(optarg);
+            break;
+        case 'o':
+            print = true;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-k LOG] [-g K_P,T_I,T_D] [-r DECIMATION] "
+                    "[-s SKIP] [-e TOLERANCE] [-n PASSES] [-o] [FILE]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    FILE *f = stdin;
+
+    if (optind < argc && !(f = fopen(argv[optind], "r"))) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    const size_t skipped = read_records(f, k->columns);
+
+    if (records.n < 2) {
+        fprintf(stderr, "Need at least two records to replay\n");
+        return 1;
+    }
+
+    reset_control();
+
+    /* Replay the log repeatedly, to get a stable measure of the
+     * throughput. */
+
+    const clock_t c_0 = clock();
+
+    for (int i = 0; i < passes; i++) {
+        replay.tares = replay.interventions = 0;
+        run(k);
+    }
+
+    const double s = (double)(clock() - c_0) / CLOCKS_PER_SEC;
+
+    if (print) {
+        for (size_t i = 0; i < records.n; i++) {
+            const double *z = records.z[i];
+
+            if (k->columns == 5) {
+                printf("%.17g, %.17g, %.17g, %.17g, %d\n",
+                       z[TIME], z[VALUE], z[DERIVATIVE], z[RAW], (int)z[CODE]);
+            } else {
+                printf("%.17g, %.17g, %.17g, %.17g, %.17g, %.17g, %.17g\n",
+                       z[0], z[1], z[2], z[3], z[4], z[5], z[6]);
+            }
+        }
+    }
+
+    printf("# %zu records, %zu lines skipped", records.n, skipped);
+
+    if (k->filter == &mass_filter) {
+        printf(", %d tares", replay.tares);
+    } else if (k->pid) {
+        printf(", %d interventions", replay.interventions);
+    }
+
+    printf("\n# %.3g samples/s\n", passes * (records.n - 1) / s);
+
+    /* Compare the outputs, past the first record, which only seeds
+     * the replay. */
+
+    bool pass = true;
+
+    for (int j = 0; j < k->columns; j++) {
+        if (!k->labels[j]) {
+            continue;
+        }
+
+        double max = 0, t = NAN, sum = 0;
+        size_t n = 0;
+
+        for (size_t i = 1; i < records.n; i++) {
+            const double *x = records.x[i], *z = records.z[i];
+
+            if (x[TIME] - records.x[0][TIME] < skip
+                || (isnan(x[j]) && isnan(z[j]))) {
+                continue;
+            }
+
+            /* A mismatch in definedness counts as infinite drift. */
+
+            const double d = (
+                isnan(x[j] - z[j]) ? (double)INFINITY : fabs(x[j] - z[j]));
+
+            if (d > max) {
+                max = d;
+                t = x[TIME];
+            }
+
+            sum += d * d;
+            n++;
+        }
+
+        printf("# %s: max drift %.3g at %.3f s, rms %.3g\n",
+               k->labels[j], max, t, n > 0 ? sqrt(sum / n) : 0);
+
+        pass = pass && max <= tolerance;
+    }
+
+    return !pass;
+}
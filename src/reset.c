@@ -14,7 +14,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "memory.h"
 #include "mk20dx.h"
+#include "trace.h"
 #include "uassert.h"
 
 extern void __libc_init_array (void);
@@ -22,7 +24,7 @@ extern void __libc_fini_array (void);
 extern char __bss_start, __bss_end;
 extern char __data_start, __data_end, __data_load;
 extern int main (void);
-extern unsigned long __stack_end;
+extern unsigned long __scratch_end, __stack_end;
 
 static __attribute__ ((section(".flashconfig"), used))
 const uint8_t flashconfigbytes[16] = {
@@ -58,6 +60,14 @@ static __attribute__((interrupt ("IRQ"))) void unused_isr(void)
 
 static __attribute__((noreturn, interrupt ("IRQ"))) void fault_isr(void)
 {
+    uint32_t ipsr;
+
+    /* Record which fault it was, before the assertion freezes the
+     * trace. */
+
+    __asm__ volatile ("mrs %0, ipsr" : "=r" (ipsr));
+    trace(FAULT_EVENT, ipsr, 0);
+
     uassert(0);
 }
 
@@ -163,6 +173,17 @@ void reset(void)
          c < &__data_end;
          *c++ = *d++);
 
+    /* Paint the stack, below the current frame, so that its usage
+     * can be measured later on (see memory.c). */
+
+    if (is_stack_separate()) {
+        unsigned long *sp;
+
+        __asm__ volatile ("mov %0, sp" : "=r" (sp));
+
+        for (unsigned long *w = &__scratch_end; w < sp; *w++ = STACK_PAINT);
+    }
+
     /* Configure the LED pin as an output. */
 
     SIM_SCGC5 |= SIM_SCGC5_PORTC;
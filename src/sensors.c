@@ -0,0 +1,221 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The processing of the sensors' samples, from the codes read off
+ * the devices, to the filtered process variables and the callbacks
+ * that consume them.  It is kept apart from the drivers that read the
+ * codes (i2c.c and temperature.c), so that the software-in-the-loop
+ * build (see sil.c) runs it unchanged, on codes made up from its
+ * plant model. */
+
+#include <math.h>
+
+#include "callbacks.h"
+#include "cycles.h"
+#include "estimator.h"
+#include "filter.h"
+#include "health.h"
+#include "jitter.h"
+#include "peripherals.h"
+#include "sensors.h"
+#include "time.h"
+
+struct filter pressure_filter = DOUBLE_FILTER(0.12, 60.0);
+struct filter mass_filter = SINGLE_FILTER(0.03);
+struct filter mass_rate_filter = SINGLE_FILTER(0.3);
+struct filter temperature_filter = DOUBLE_FILTER(1.0, 60.0);
+
+static struct cic mass_cic = CIC_FILTER(16);
+static int mass_decimation = 16;
+static int taring_state = 1;
+
+void set_mass_decimation(int r)
+{
+    /* Keep the CIC filter's gain within range; see cic_sample. */
+
+    if (r >= 1 && r <= 64) {
+        mass_decimation = r;
+        set_loop_period(MASS_RATE_LOOP, r / MASS_RATE);
+    }
+}
+
+int get_mass_decimation(void)
+{
+    return mass_decimation;
+}
+
+void tare_mass(void)
+{
+    taring_state = 1;
+}
+
+bool is_taring_mass(void)
+{
+    return taring_state > 0;
+}
+
+/* Mark the pressure and mass as unknown, once their samples are
+ * overdue, i.e. when their sensors stop responding. */
+
+void expire_samples(double t)
+{
+    if (t - pressure_filter.t > 0.1) {
+        filter_sample(&pressure_filter, NAN, t);
+    }
+
+    if (t - mass_filter.t > 1) {
+        filter_sample(&mass_filter, NAN, t);
+    }
+}
+
+/* Process a reading of the NSA2862X. */
+
+void process_pressure_sample(int32_t d)
+{
+    /* Calculate the pressure in bars. */
+
+    const double P = (double)12.0 * ldexp(d, -23);
+    filter_sample(&pressure_filter, P, get_time());
+    count_sample(PRESSURE_SENSOR, pressure_filter.t);
+
+    begin_cycles(PRESSURE_CHAIN);
+    RUN_CALLBACKS(
+        pressure_callbacks,
+        bool (*)(double, double, double, double, double, int32_t),
+        pressure_filter.y, pressure_filter.dy,
+        pressure_filter.t, pressure_filter.dt,
+        P, d);
+    end_cycles(PRESSURE_CHAIN);
+}
+
+/* Process a reading of the NAU7802, returning whether it completed a
+ * decimated sample. */
+
+bool process_mass_sample(int32_t d)
+{
+    const double t = get_time();
+
+    static double tare, m[2];
+    static int n[2];
+
+    /* There's a lot of noise in the load cell's signal.  Handling it
+     * via exponential smoothing leads to long filter delays, esp. for
+     * the derivative.  We therefore pass the samples through a CIC
+     * decimator, which removes most of the noise, with a smaller
+     * delay than a block average of the same length would, and then
+     * perform light exponential smoothing on the decimated values.
+     * The output rate is 320Hz divided by the decimation factor, 20Hz
+     * by default. */
+
+    if (mass_cic.decimation != mass_decimation) {
+        reset_cic(&mass_cic, mass_decimation);
+    }
+
+    double c_m;
+
+    if (!cic_sample(&mass_cic, d, &c_m)) {
+        return false;
+    }
+
+    /* Calculate the mass in grams. */
+
+    m[0] = (double)1.3287e-03 * c_m - (double)5.6135e+02;
+    n[0] = mass_cic.decimation;
+
+    /* Mass accuracy is important when the reading is stable.  When
+     * weighing coffee beans for instance, a tolerance below 0.1g
+     * might be significant, when the weight increases at 2-3 g/s as
+     * coffee is produced, a 0.1g tolerance is arguably of less
+     * importance.  We therefore keep accumulating averaged values
+     * when successive means are close enough, giving increased noise
+     * reduction the longer you wait. */
+
+    const bool p = fabs(m[0] - m[1]) < (double)0.25;
+
+    if (p) {
+        m[1] = (m[0] * n[0] + m[1] * n[1]) / (n[0] + n[1]);
+        n[1] += n[0];
+    }
+
+    /* Take a first tare at 3s then stay in taring mode, while no
+     * disturbance is detected, but don't accumulate more than 5s
+     * worth os samples at any time, as there seems to be drift in the
+     * sensor's ouput (perhaps due to temperature?). */
+
+    if ((taring_state == 1 && n[1] >= 600)
+        || (taring_state > 1 && n[1] >= 1000)) {
+        tare = m[1];
+        tare_yield_estimate(mass_filter.y);
+        mass_filter.y = mass_filter.dy = 0;
+        taring_state++;
+    }
+
+    if (!p || n[1] >= 1000) {
+        m[1] = m[0];
+        n[1] = n[0];
+    }
+
+    filter_sample(&mass_filter, m[1] - tare, t);
+
+    /* The rate of change of the mass, i.e. the yield rate in g/s, is
+     * smoothed separately, as it is used for control. */
+
+    filter_sample(&mass_rate_filter, mass_filter.dy / mass_filter.dt, t);
+    count_sample(MASS_SENSOR, t);
+
+    if (fabs(mass_filter.dy / mass_filter.dt) > 100.0) {
+        taring_state = 1;
+    } else if (!p && taring_state > 1) {
+        taring_state = 0;
+    }
+
+    begin_cycles(MASS_CHAIN);
+    RUN_CALLBACKS(
+        mass_callbacks,
+        bool (*)(double, double, double, double, double, int32_t),
+        mass_filter.y, mass_filter.dy,
+        mass_filter.t, mass_filter.dt,
+        m[0], d);
+    end_cycles(MASS_CHAIN);
+
+    return true;
+}
+
+/* Process a reading of the MAX31865, converted to a temperature from
+ * its 16-bit code, or NaN on a fault. */
+
+void process_temperature_sample(double T, uint16_t c)
+{
+    /* Occasionally, one of the two bytes making up the 16-bit code is
+     * read as zero.  It is not clear why that happens and, since it
+     * happens relatively rarely (i.e. once in several tens of
+     * thousands of conversions, we'll just discard these readings in
+     * software. */
+
+    if (((c >> 8) && (c & 0xff)) || (fabs(T - temperature_filter.y) < 1)) {
+        filter_sample(&temperature_filter, T, get_time());
+        count_sample(TEMPERATURE_SENSOR, temperature_filter.t);
+    }
+
+    begin_cycles(TEMPERATURE_CHAIN);
+    RUN_CALLBACKS(
+        temperature_callbacks,
+        bool (*)(double, double, double, double, double, int32_t),
+        temperature_filter.y, temperature_filter.dy,
+        temperature_filter.t, temperature_filter.dt,
+        T, c);
+    end_cycles(TEMPERATURE_CHAIN);
+}
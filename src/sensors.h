@@ -0,0 +1,32 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SENSORS_H
+#define SENSORS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The NAU7802's conversion rate, in Hz. */
+
+#define MASS_RATE 320.0
+
+void expire_samples(double t);
+void process_pressure_sample(int32_t d);
+bool process_mass_sample(int32_t d);
+void process_temperature_sample(double T, uint16_t c);
+
+#endif
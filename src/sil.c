@@ -0,0 +1,1250 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A simulated board, for the software-in-the-loop build of the
+ * firmware.  The firmware, main loop and all, is compiled for the
+ * host with -DSIL and linked against this file, in place of the
+ * drivers that can't run without the hardware.
+ *
+ * The peripheral register blocks are mapped as plain memory at their
+ * real addresses, so that the drivers that merely configure
+ * peripherals and poke at their registers (power.c, input.c, flow.c
+ * and most of time.c) run unchanged.  The board then plays the part
+ * of the peripherals the firmware relies on, on a virtual timeline:
+ * SysTick and FTM1 for the time and profile tick, FTM0 and its DMA
+ * channel for flow meter edge capture, the PIT channels, the ports
+ * for the zero-crossing detector, panel switch and encoder and the
+ * NVIC, which dispatches the firmware's own interrupt handlers in
+ * priority order, with preemption.
+ *
+ * The I2C (NSA2862X and NAU7802) and SPI (MAX31865) sensors, USB and
+ * the SSD1351 display are driven by transaction-level state machines
+ * that can't be played back against plain memory, so they're
+ * modelled at the level of their drivers' interfaces instead, as is
+ * the flash controller.  The sensors read the plant model of
+ * plant.c, with their readings passed, as codes, to the same
+ * processing as the drivers' (see sensors.c).
+ *
+ * Virtual time advances when the firmware waits, or by a quantum each
+ * time the main loop reads the time, so the simulation is
+ * deterministic and, unless paced, runs as fast as the host
+ * allows. */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "callbacks.h"
+#include "estimator.h"
+#include "flash.h"
+#include "health.h"
+#include "i2c.h"
+#include "memory.h"
+#include "mk20dx.h"
+#include "peripherals.h"
+#include "plant.h"
+#include "profile.h"
+#include "sensors.h"
+#include "time.h"
+#include "trace.h"
+#include "uassert.h"
+#include "usb.h"
+#include "yield.h"
+
+#define QUANTUM 20e-6           /* s, per main loop read of the time */
+#define STEP 1e-3               /* s, the plant's integration step */
+#define MAINS 50.0              /* Hz */
+
+#define BUS_CLOCK 48e6          /* Hz, clocking the PIT */
+#define FTM_CLOCK 375e3         /* Hz, the bus clock divided by 128 */
+
+/* Sensor sample rates, in Hz.  The NAU7802 converts at MASS_RATE,
+ * before decimation, and the MAX31865 continuously, with the 50Hz
+ * notch filter. */
+
+#define PRESSURE_RATE 100.0
+#define TEMPERATURE_RATE 16.0
+
+#define N_IRQS 96
+
+/* Register blocks are mapped at their real addresses. */
+
+static const struct {
+    uintptr_t address;
+    size_t size;
+} regions[] = {
+    {0x40000000, 0x100000},     /* AIPS-Lite and GPIO */
+    {0xe0001000, 0x1000},       /* Data watchpoint and trace */
+    {0xe000e000, 0x1000},       /* System control space */
+};
+
+/* Accessors for the port and GPIO registers, by port index. */
+
+#define PORT_PCR(P, N)                                                  \
+    (*(volatile uint32_t *)(0x40049000 + 0x1000 * (P) + 4 * (N)))
+#define PORT_ISFR(P) (*(volatile uint32_t *)(0x400490a0 + 0x1000 * (P)))
+#define GPIO_PDIR(P) (*(volatile uint32_t *)(0x400ff010 + 0x40 * (P)))
+#define PORT_IRQ(P) (PORTA_IRQ + (P))
+
+#define PORT_A 0
+#define PORT_B 1
+#define PORT_D 3
+
+/* Symbols the linker script would provide. */
+
+char __section_program_buffer[1024]
+    __attribute__((aligned(__alignof__(struct stage))));
+unsigned long __scratch_start[4096], __scratch_end;
+
+__asm__(".globl __scratch_end\n"
+        ".set __scratch_end, __scratch_start + 4096 * 8\n");
+
+/* The firmware's interrupt handlers. */
+
+void porta_isr(void), portb_isr(void), portd_isr(void);
+void pit0_isr(void), pit1_isr(void), pit2_isr(void), pit3_isr(void);
+void ftm0_isr(void), ftm1_isr(void);
+
+static void pdb0_isr(void), portc_isr(void), usb_isr(void);
+
+static void (*const vectors[N_IRQS])(void) = {
+    [PORTA_IRQ] = porta_isr, [PORTB_IRQ] = portb_isr,
+    [PORTC_IRQ] = portc_isr, [PORTD_IRQ] = portd_isr,
+    [PIT0_IRQ] = pit0_isr, [PIT1_IRQ] = pit1_isr,
+    [PIT2_IRQ] = pit2_isr, [PIT3_IRQ] = pit3_isr,
+    [FTM0_IRQ] = ftm0_isr, [FTM1_IRQ] = ftm1_isr,
+    [PDB0_IRQ] = pdb0_isr, [USB0_IRQ] = usb_isr,
+};
+
+static struct {
+    bool enabled, pending;
+} nvic[N_IRQS];
+
+static bool masked;
+static int level = INT_MAX;     /* The running preemption level */
+
+static double now;
+static struct plant plant;
+
+/* Timeline sources, each firing at its own time. */
+
+enum source {
+    PLANT_SOURCE,
+    MAINS_SOURCE,
+    PIT_SOURCE,
+    FTM0_SOURCE = PIT_SOURCE + 4,
+    FTM1_SOURCE,
+    PRESSURE_SOURCE,
+    MASS_SOURCE,
+    TEMPERATURE_SOURCE,
+    PIN_SOURCE,
+    LINK_SOURCE,
+
+    SOURCES
+};
+
+static double timeline[SOURCES];
+
+/* NVIC */
+
+void enable_sil_interrupt(int n, int enable)
+{
+    nvic[n].enabled = enable;
+}
+
+void pend_sil_interrupt(int n, int pend)
+{
+    nvic[n].pending = pend;
+}
+
+int is_sil_interrupt_enabled(int n)
+{
+    return nvic[n].enabled;
+}
+
+int is_sil_interrupt_pending(int n)
+{
+    return nvic[n].pending;
+}
+
+/* The preemption level of an interrupt, i.e. the group priority of
+ * its 4-bit priority, given the grouping configured in AIRCR. */
+
+static int get_level(int n)
+{
+    const int p = (NVIC_IPR(n / 4) >> (8 * (n % 4) + 4)) & 0xf;
+
+    return (p << 4) >> (((SCB_AIRCR >> 8) & 7) + 1);
+}
+
+static void synchronize(void);
+
+/* Run the handlers of pending interrupts that can preempt the running
+ * level, most urgent first, as the NVIC would. */
+
+static void dispatch(void)
+{
+    while (!masked) {
+        int n = -1, p = 0;
+
+        for (int i = 0; i < N_IRQS; i++) {
+            if (nvic[i].pending && nvic[i].enabled && vectors[i]) {
+                const int q = (NVIC_IPR(i / 4) >> (8 * (i % 4) + 4)) & 0xf;
+
+                if (n < 0 || q < p) {
+                    n = i;
+                    p = q;
+                }
+            }
+        }
+
+        if (n < 0 || get_level(n) >= level) {
+            return;
+        }
+
+        const int l = level;
+
+        nvic[n].pending = false;
+        level = get_level(n);
+        vectors[n]();
+        level = l;
+
+        /* Interrupt flags are cleared by writing ones, which plain
+         * memory doesn't do, so clear them on the handler's behalf. */
+
+        if (n >= PORTA_IRQ && n <= PORTD_IRQ) {
+            const int port = n - PORTA_IRQ;
+
+            PORT_ISFR(port) = 0;
+
+            for (int i = 0; i < 32; i++) {
+                PORT_PCR(port, i) &= ~PORT_PCR_ISF;
+            }
+        } else if (n >= PIT0_IRQ && n <= PIT3_IRQ) {
+            PIT_TFLG(n - PIT0_IRQ) = 0;
+        }
+
+        synchronize();
+    }
+}
+
+static void raise(int n)
+{
+    nvic[n].pending = true;
+    dispatch();
+}
+
+void mask_sil_interrupts(int mask)
+{
+    masked = mask;
+
+    if (!masked) {
+        dispatch();
+    }
+}
+
+/* Timers */
+
+static struct {
+    bool armed;
+    double t;
+} pits[4];
+
+static uint64_t ftm0_fired = UINT64_MAX;
+
+static uint64_t ftm_count(double t)
+{
+    return (uint64_t)(t * FTM_CLOCK);
+}
+
+/* Bring the timeline in line with the timers' registers, after the
+ * firmware has had a chance to change them.  Note that a PIT
+ * channel that is disabled and re-enabled without the board getting
+ * a look in between keeps counting from where it was. */
+
+static void synchronize(void)
+{
+    for (int i = 0; i < 4; i++) {
+        const bool p = ((PIT_TCTRL(i) & PIT_TCTRL_TEN)
+                        && !(PIT_MCR & PIT_MCR_MDIS));
+
+        if (p && !pits[i].armed) {
+            pits[i].t = now + (PIT_LDVAL(i) + 1.0) / BUS_CLOCK;
+        }
+
+        pits[i].armed = p;
+        timeline[PIT_SOURCE + i] = p ? pits[i].t : (double)INFINITY;
+    }
+
+    /* FTM0 channel 2 is used as a software output compare. */
+
+    const uint64_t c = ftm_count(now);
+
+    FTM0_CNT = (uint16_t)c;
+
+    if ((FTM0_SC & FTM_SC_CLKS(3)) && (FTM0_C2SC & FTM_CSC_CHIE)) {
+        uint64_t k = c + (uint16_t)(FTM0_C2V - c);
+
+        if (k <= c || k == ftm0_fired) {
+            k += 65536;
+        }
+
+        timeline[FTM0_SOURCE] = (k + 0.5) / FTM_CLOCK;
+    } else {
+        timeline[FTM0_SOURCE] = INFINITY;
+    }
+
+    /* FTM1 overflows generate the profile tick.  A new MOD value takes
+     * effect at the next overflow. */
+
+    if (!(FTM1_SC & FTM_SC_CLKS(3)) || !(FTM1_SC & FTM_SC_TOIE)) {
+        timeline[FTM1_SOURCE] = INFINITY;
+    } else if (isinf(timeline[FTM1_SOURCE])) {
+        timeline[FTM1_SOURCE] = now + (FTM1_MOD + 1.0) / FTM_CLOCK;
+    }
+}
+
+static void fire_pit(int i)
+{
+    pits[i].t += (PIT_LDVAL(i) + 1.0) / BUS_CLOCK;
+    timeline[PIT_SOURCE + i] = pits[i].t;
+
+    if (PIT_TCTRL(i) & PIT_TCTRL_TIE) {
+        PIT_TFLG(i) = PIT_TFLG_TIF;
+        raise(PIT0_IRQ + i);
+    }
+}
+
+static void fire_ftm0(void)
+{
+    ftm0_fired = ftm_count(now);
+    FTM0_CNT = (uint16_t)ftm0_fired;
+    FTM0_C2SC |= FTM_CSC_CHF;
+    timeline[FTM0_SOURCE] = INFINITY;
+
+    raise(FTM0_IRQ);
+}
+
+static void fire_ftm1(void)
+{
+    timeline[FTM1_SOURCE] = now + (FTM1_MOD + 1.0) / FTM_CLOCK;
+    FTM1_SC |= FTM_SC_TOF;
+
+    raise(FTM1_IRQ);
+}
+
+/* Capture a flow meter edge on FTM0 channel 0 and move its timestamp
+ * into the ring by DMA, as configured by the firmware.  Note that
+ * this needs the firmware's data to be addressable in 32 bits,
+ * i.e. a non-PIE executable. */
+
+static void capture_edge(double t)
+{
+    const int ch = 1;
+
+    FTM0_C0V = (uint16_t)ftm_count(t);
+
+    if (!(DMAMUX0_CHCFG(ch) & DMAMUX_ENBL)) {
+        return;
+    }
+
+    /* A destination address modulo, if set, keeps the upper bits of
+     * the address fixed. */
+
+    const int dmod = (DMA_TCD_ATTR(ch) >> 3) & 0b11111;
+    const uint32_t mask = dmod ? (1u << dmod) - 1 : UINT32_MAX;
+    const uint32_t a = DMA_TCD_DADDR(ch);
+
+    *(volatile uint16_t *)(uintptr_t)a = FTM0_C0V;
+    DMA_TCD_DADDR(ch) = (a & ~mask) | ((a + DMA_TCD_DOFF(ch)) & mask);
+
+    if (--DMA_TCD_CITER(ch) == 0) {
+        DMA_TCD_DADDR(ch) += DMA_TCD_DLASTSGA(ch);
+        DMA_TCD_CITER(ch) = DMA_TCD_BITER(ch);
+    }
+}
+
+/* Pins */
+
+static bool brewing;
+
+static void set_pin(int port, int pin, bool high)
+{
+    const bool was = GPIO_PDIR(port) & PT(pin);
+
+    if (high) {
+        GPIO_PDIR(port) |= PT(pin);
+    } else {
+        GPIO_PDIR(port) &= ~PT(pin);
+    }
+
+    /* Raise the port interrupt, if the change matches the
+     * configured edge. */
+
+    const int irqc = (PORT_PCR(port, pin) >> 16) & 0xf;
+
+    if (was == high || !(irqc == 11 || irqc == (high ? 9 : 10))) {
+        return;
+    }
+
+    PORT_PCR(port, pin) |= PORT_PCR_ISF;
+    PORT_ISFR(port) |= PT(pin);
+
+    raise(PORT_IRQ(port));
+}
+
+/* Pin changes, scheduled by the board's operator, one at a time. */
+
+#define N_CHANGES 64
+
+static struct change {
+    double t;
+    int port, pin;
+    bool high;
+} changes[N_CHANGES];
+
+static size_t changes_head, changes_tail;
+
+static double schedule_pin(double t, int port, int pin, bool high)
+{
+    const size_t n = (changes_tail + 1) % N_CHANGES;
+
+    if (n == changes_head) {
+        fprintf(stderr, "sil: too many pin changes\n");
+        return t;
+    }
+
+    if (changes_head != changes_tail) {
+        t = fmax(t, changes[(changes_tail + N_CHANGES - 1) % N_CHANGES].t);
+    }
+
+    changes[changes_tail] = (struct change){t, port, pin, high};
+    changes_tail = n;
+    timeline[PIN_SOURCE] = changes[changes_head].t;
+
+    return t;
+}
+
+static void fire_pin(void)
+{
+    const struct change c = changes[changes_head];
+
+    changes_head = (changes_head + 1) % N_CHANGES;
+    timeline[PIN_SOURCE] = (changes_head == changes_tail
+                            ? (double)INFINITY : changes[changes_head].t);
+
+    if (c.port == PORT_B && c.pin == 16) {
+        brewing = !c.high;
+    }
+
+    set_pin(c.port, c.pin, c.high);
+}
+
+/* The plant, sampled by the sensors */
+
+static double pulse_phase;
+
+static void fire_plant(void)
+{
+    timeline[PLANT_SOURCE] = now + STEP;
+
+    /* The brew switch powers the pump. */
+
+    plant.pump = brewing ? fmax(get_pump_flow(), 0) : 0;
+    plant.heat = fmax(get_heat_power(), 0);
+
+    step_plant(&plant, STEP);
+
+    /* Generate flow meter edges at the rate that the calibration maps
+     * to the current flow. */
+
+    const double Q = fmax(plant.Q + sample_noise(FLOW_SIGMA), 0);
+    double a = 0, b = 1000;
+
+    while (b - a > 1e-3) {
+        const double r = (a + b) / 2;
+
+        if (calibrate_flow(r) < Q) {
+            a = r;
+        } else {
+            b = r;
+        }
+    }
+
+    for (pulse_phase += a * STEP; pulse_phase >= 1; pulse_phase -= 1) {
+        capture_edge(now - (pulse_phase - 1) / a);
+    }
+}
+
+static void fire_mains(void)
+{
+    /* The zero-crossing detector, on PTA12. */
+
+    timeline[MAINS_SOURCE] = now + 1 / (2 * MAINS);
+
+    if ((PORTA_PCR12 >> 16) & 0xf) {
+        PORTA_PCR12 |= PORT_PCR_ISF;
+        raise(PORTA_IRQ);
+    }
+}
+
+/* Sensors: the NSA2862X and NAU7802, polled over I2C and triggered
+ * by the PDB and the MAX31865, signalling readiness on PTC3. */
+
+static struct {
+    bool run, read, ready;
+} sensors[SENSORS];
+
+void read_pressure(void)
+{
+    sensors[PRESSURE_SENSOR].read = true;
+}
+
+void run_pressure(bool r)
+{
+    sensors[PRESSURE_SENSOR].run = r;
+}
+
+void read_mass(void)
+{
+    sensors[MASS_SENSOR].read = true;
+}
+
+void run_mass(bool r)
+{
+    sensors[MASS_SENSOR].run = r;
+}
+
+void reset_i2c(void)
+{
+    prioritize_interrupt(PDB0_IRQ, 8);
+    enable_interrupt(PDB0_IRQ);
+
+    run_pressure(true);
+    run_mass(true);
+}
+
+/* Register-level access to the sensors isn't modelled; they answer
+ * to probes, but read as zero. */
+
+bool probe_i2c(uint8_t slave)
+{
+    return slave == 0x54 || slave == 0xda;
+}
+
+uint8_t read_i2c(uint8_t slave, uint8_t reg, uint8_t *buffer, size_t n)
+{
+    memset(buffer, 0, n);
+
+    return 0;
+}
+
+void write_i2c(uint8_t slave, uint8_t reg, uint8_t value)
+{
+}
+
+void print_i2c_recoveries(void)
+{
+}
+
+static void fire_sensor(enum sensor s)
+{
+    static const double rates[] = {
+        [PRESSURE_SENSOR] = PRESSURE_RATE,
+        [MASS_SENSOR] = MASS_RATE,
+        [TEMPERATURE_SENSOR] = TEMPERATURE_RATE,
+    };
+
+    timeline[PRESSURE_SOURCE + s] = now + 1 / rates[s];
+
+    if (!sensors[s].run && !sensors[s].read) {
+        return;
+    }
+
+    sensors[s].read = false;
+    sensors[s].ready = true;
+
+    if (s == TEMPERATURE_SENSOR) {
+        PORTC_PCR3 |= PORT_PCR_ISF;
+        raise(PORTC_IRQ);
+    } else {
+        raise(PDB0_IRQ);
+    }
+}
+
+static void pdb0_isr(void)
+{
+    expire_samples(now);
+
+    if (sensors[PRESSURE_SENSOR].ready) {
+        sensors[PRESSURE_SENSOR].ready = false;
+
+        const double P = plant.P + sample_noise(PRESSURE_SIGMA);
+
+        count_transaction(PRESSURE_SENSOR);
+        process_pressure_sample(lround(ldexp(P / 12, 23)));
+    }
+
+    if (sensors[MASS_SENSOR].ready) {
+        sensors[MASS_SENSOR].ready = false;
+
+        /* Readings decimated by the default factor have roughly the
+         * plant model's noise. */
+
+        const double m = plant.M + sample_noise(4 * MASS_SIGMA);
+
+        count_transaction(MASS_SENSOR);
+        process_mass_sample(lround((m + 5.6135e+02) / 1.3287e-03));
+    }
+}
+
+void run_temperature(bool run)
+{
+    sensors[TEMPERATURE_SENSOR].run = run;
+}
+
+void read_temperature(void)
+{
+    sensors[TEMPERATURE_SENSOR].read = true;
+}
+
+void reset_temperature(void)
+{
+    prioritize_interrupt(PORTC_IRQ, 8);
+    enable_interrupt(PORTC_IRQ);
+
+    run_temperature(true);
+}
+
+static void portc_isr(void)
+{
+    PORTC_PCR3 &= ~PORT_PCR_ISF;
+
+    if (!sensors[TEMPERATURE_SENSOR].ready) {
+        return;
+    }
+
+    sensors[TEMPERATURE_SENSOR].ready = false;
+
+    /* Convert to the RTD's ratio code, as in temperature.c. */
+
+    const double A = 3.9083e-3;
+    const double B = -5.775e-7;
+    const double T = plant.T_s + sample_noise(TEMPERATURE_SIGMA);
+    const int32_t c = lround(ldexp((1 + A * T + B * T * T) / 4.3, 15)) << 1;
+
+    count_transaction(TEMPERATURE_SENSOR);
+    process_temperature_sample(T, c);
+}
+
+/* Flash, i.e. the FlexNVM, mapped at its real address, optionally
+ * backed by a file.  As with the real thing, programming can only
+ * clear bits. */
+
+size_t get_data_flash_size(void)
+{
+    return FLEXNVM_SIZE;
+}
+
+bool erase_flash_sector(uintptr_t address)
+{
+    uassert(address % FLEXNVM_SECTOR_SIZE == 0);
+
+    memset((void *)address, 0xff, FLEXNVM_SECTOR_SIZE);
+
+    return true;
+}
+
+bool program_flash(uintptr_t address, const void *data, size_t n)
+{
+    uassert(address % 4 == 0);
+
+    for (size_t i = 0; i < n; i++) {
+        ((uint8_t *)address)[i] &= ((const uint8_t *)data)[i];
+    }
+
+    return true;
+}
+
+/* The SSD1351, holding the text of each field drawn on it, by
+ * position. */
+
+#define N_FIELDS 32
+#define FIELD_SIZE 32
+
+static struct field {
+    uint8_t x, y;
+    char s[FIELD_SIZE];
+} fields[N_FIELDS];
+
+static size_t n_fields;
+
+void reset_display(void)
+{
+    n_fields = 0;
+}
+
+void clear_display(void)
+{
+    n_fields = 0;
+}
+
+static struct field *get_field(uint8_t x, uint8_t y)
+{
+    for (size_t i = 0; i < n_fields; i++) {
+        if (fields[i].x == x && fields[i].y == y) {
+            fields[i].s[0] = '\0';
+            return &fields[i];
+        }
+    }
+
+    if (n_fields == N_FIELDS) {
+        return NULL;
+    }
+
+    fields[n_fields] = (struct field){.x = x, .y = y};
+
+    return &fields[n_fields++];
+}
+
+static void append(struct field **f, uint8_t x, uint8_t y, const char *s)
+{
+    if (!*f) {
+        *f = get_field(x, y);
+    }
+
+    if (*f) {
+        strncat((*f)->s, s, FIELD_SIZE - strlen((*f)->s) - 1);
+    }
+}
+
+/* Text is drawn into the field at the current position, which is
+ * looked up, and cleared, when first drawn into. */
+
+void display(const char *s, ...)
+{
+    struct field *f = NULL;
+    uint8_t x = 0, y = 0;
+
+    va_list ap;
+    va_start(ap, s);
+
+    for (const char *c = s; *c != '\0'; c++) {
+        if (*c >= 1 && *c <= 3) {
+            continue;
+        }
+
+        if (*c == '\a') {
+            x = *(uint8_t *)(++c);
+            y = *(uint8_t *)(++c);
+            f = NULL;
+            continue;
+        }
+
+        if (*c == '\n') {
+            y += 12;
+            f = NULL;
+            continue;
+        }
+
+        if (*c == '\f') {
+            c += 2;
+            continue;
+        }
+
+        if (*c == '\v') {
+            continue;
+        }
+
+        if (*c == '%') {
+            char b[32];
+            uint8_t d = *(uint8_t *)(++c);
+            int w_f = 1;
+
+            if (d >= '0' && d <= '9') {
+                d = *(uint8_t *)(++c);
+            }
+
+            if (d == '.') {
+                d = *(uint8_t *)(++c);
+            }
+
+            if (d >= '0' && d <= '9') {
+                w_f = d - '0';
+                d = *(uint8_t *)(++c);
+            }
+
+            if (d == 'd') {
+                snprintf(b, sizeof(b), "%d", va_arg(ap, int));
+            } else if (d == 'f') {
+                snprintf(b, sizeof(b), "%.*f", w_f, va_arg(ap, double));
+            } else {
+                snprintf(b, sizeof(b), "%c", d);
+            }
+
+            append(&f, x, y, b);
+            continue;
+        }
+
+        append(&f, x, y, *c == 0x7f ? "°" : (char []){*c, '\0'});
+    }
+
+    va_end(ap);
+}
+
+static int compare_fields(const void *a, const void *b)
+{
+    const struct field *f = a, *g = b;
+
+    return f->y != g->y ? f->y - g->y : f->x - g->x;
+}
+
+/* USB, over a pseudo-terminal, or the standard input and output.
+ * Lines starting with @ are addressed to the board, not the
+ * firmware. */
+
+static int link_in = STDIN_FILENO, link_out = STDOUT_FILENO;
+static bool link_pty;
+static double speed;
+
+static void (*data_in_callback)(uint8_t *data, size_t n);
+static uint8_t data_in_buffer[1024];
+static size_t data_in_count;
+
+static char link_line[1024];
+static size_t link_length;
+
+void reset_usb(void)
+{
+    prioritize_interrupt(USB0_IRQ, 2);
+    enable_interrupt(USB0_IRQ);
+}
+
+/* The host is always attached. */
+
+int is_usb_enumerated(void)
+{
+    return 1;
+}
+
+void await_usb_enumeration(void)
+{
+}
+
+void set_usb_data_in_callback(void (*new_callback)(uint8_t *data, size_t n))
+{
+    data_in_callback = new_callback;
+}
+
+static void write_link(const char *s, size_t n)
+{
+    while (n > 0) {
+        const ssize_t m = write(link_out, s, n);
+
+        /* Output is dropped while nobody reads the terminal. */
+
+        if (m < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return;
+        }
+
+        s += m;
+        n -= m;
+    }
+}
+
+int write_usb(const char *s, int n, bool flush)
+{
+    write_link(s, n);
+
+    return n;
+}
+
+int uprintf(const char *format, ...)
+{
+    char s[1024];
+    va_list ap;
+
+    va_start(ap, format);
+    const int n = vsnprintf(s, sizeof(s), format, ap);
+    va_end(ap);
+
+    write_link(s, n < (int)sizeof(s) ? (size_t)n : sizeof(s) - 1);
+
+    return n;
+}
+
+static void usb_isr(void)
+{
+    if (data_in_callback && data_in_count > 0) {
+        data_in_callback(data_in_buffer, data_in_count);
+    }
+
+    memset(data_in_buffer, 0, sizeof(data_in_buffer));
+    data_in_count = 0;
+}
+
+static struct timespec boot_time;
+
+static double get_wall_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return ((t.tv_sec - boot_time.tv_sec)
+            + (t.tv_nsec - boot_time.tv_nsec) * 1e-9);
+}
+
+static void finish(int status)
+{
+    const double t = get_wall_time();
+
+    fprintf(stderr, "sil: %.3f s simulated in %.3f s, %.0f times real time\n",
+            now, t, now / t);
+
+    exit(status);
+}
+
+/* Carry out a board command, returning the time at which the next
+ * line should be read. */
+
+static double command(const char *s)
+{
+    char c[16];
+    double x = 0;
+    double t = now;
+
+    if (sscanf(s, "@%15s %lf", c, &x) < 1) {
+        return t;
+    }
+
+    if (!strcmp(c, "wait")) {
+        return now + x;
+    } else if (!strcmp(c, "brew")) {
+        schedule_pin(now, PORT_B, 16, x == 0);
+    } else if (!strcmp(c, "click")) {
+        t = schedule_pin(now, PORT_D, 4, false);
+        t = schedule_pin(t + (x > 0 ? x : 0.1), PORT_D, 4, true);
+    } else if (!strcmp(c, "turn")) {
+        /* Step through the quadrature sequence, 1ms per edge, with
+         * some time for the debouncing timer to expire after each
+         * detent. */
+
+        static const int sequences[2][4] = {{1, 3, 2, 0}, {2, 3, 1, 0}};
+
+        for (int i = 0; i < fabs(x); i++) {
+            for (int j = 0; j < 4; j++) {
+                const int k = sequences[x < 0][j];
+
+                t = schedule_pin(t + 1e-3, PORT_D, 2, !(k & 1));
+                t = schedule_pin(t, PORT_D, 3, !(k & 2));
+            }
+
+            t += 10e-3;
+        }
+    } else if (!strcmp(c, "screen")) {
+        qsort(fields, n_fields, sizeof(fields[0]), compare_fields);
+
+        for (size_t i = 0; i < n_fields; i++) {
+            uprintf("@ %d, %d: %s\n", fields[i].x, fields[i].y, fields[i].s);
+        }
+    } else if (!strcmp(c, "plant")) {
+        uprintf("@ %.3f, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f\n",
+                now, plant.pump, plant.heat, plant.Q, plant.P,
+                plant.M, plant.T);
+    } else if (!strcmp(c, "quit")) {
+        finish(EXIT_SUCCESS);
+    } else {
+        uprintf("@ unknown command %s\n", c);
+    }
+
+    return t;
+}
+
+static void handle_line(void)
+{
+    while (link_length > 0
+           && (link_line[link_length - 1] == '\n'
+               || link_line[link_length - 1] == '\r')) {
+        link_length--;
+    }
+
+    link_line[link_length] = '\0';
+
+    if (link_line[0] == '@') {
+        timeline[LINK_SOURCE] = fmax(command(link_line), now + 1e-3);
+    } else if (link_length > 0) {
+        memcpy(data_in_buffer, link_line, link_length);
+        data_in_count = link_length;
+        raise(USB0_IRQ);
+    }
+
+    link_length = 0;
+}
+
+/* Poll the link once per USB frame, i.e. every millisecond, reading
+ * a line at a time. */
+
+static void fire_link(void)
+{
+    timeline[LINK_SOURCE] = now + 1e-3;
+
+    if (link_pty) {
+        char c;
+
+        while (read(link_in, &c, 1) == 1) {
+            if (link_length < sizeof(link_line) - 1) {
+                link_line[link_length++] = c;
+            }
+
+            if (c == '\n') {
+                handle_line();
+                break;
+            }
+        }
+    } else if (fgets(link_line, sizeof(link_line), stdin)) {
+        link_length = strlen(link_line);
+        handle_line();
+    } else {
+        finish(EXIT_SUCCESS);
+    }
+}
+
+/* Time */
+
+static void pace(void)
+{
+    if (speed <= 0) {
+        return;
+    }
+
+    const double ahead = now / speed - get_wall_time();
+
+    if (ahead > 1e-3) {
+        usleep(ahead * 1e6);
+    }
+}
+
+static void advance(double t)
+{
+    while (true) {
+        enum source s = 0;
+
+        for (int i = 1; i < SOURCES; i++) {
+            if (timeline[i] < timeline[s]) {
+                s = i;
+            }
+        }
+
+        if (timeline[s] > t) {
+            break;
+        }
+
+        now = fmax(now, timeline[s]);
+
+        /* SysTick counts down, from its reload value, at the core
+         * clock. */
+
+        const uint64_t r = (uint64_t)SYST_RVR + 1;
+
+        SYST_CVR = SYST_RVR - (uint64_t)(now * COUNTS_PER_US * 1e6) % r;
+
+        /* The cycle counter counts up, but only in virtual time, so
+         * that the cycle profiler sees no time spent in the ISRs. */
+
+        DWT_CYCCNT = (uint32_t)(uint64_t)(now * COUNTS_PER_US * 1e6);
+
+        switch (s) {
+        case PLANT_SOURCE: fire_plant(); pace(); break;
+        case MAINS_SOURCE: fire_mains(); break;
+        case FTM0_SOURCE: fire_ftm0(); break;
+        case FTM1_SOURCE: fire_ftm1(); break;
+        case PRESSURE_SOURCE:
+        case MASS_SOURCE:
+        case TEMPERATURE_SOURCE:
+            fire_sensor(s - PRESSURE_SOURCE);
+            break;
+        case PIN_SOURCE: fire_pin(); break;
+        case LINK_SOURCE: fire_link(); break;
+        default: fire_pit(s - PIT_SOURCE); break;
+        }
+
+        synchronize();
+    }
+
+    now = fmax(now, t);
+    synchronize();
+}
+
+double get_time(void)
+{
+    if (level == INT_MAX) {
+        advance(now + QUANTUM);
+    }
+
+    return now;
+}
+
+void delay_us(int32_t n)
+{
+    advance(now + n * 1e-6);
+}
+
+/* Memory: the firmware runs in the host's address space, so its
+ * layout and stack usage aren't modelled. */
+
+void print_memory(void)
+{
+}
+
+/* Faults */
+
+void _uassert(const char *msg, int line, const char *func)
+{
+    trace(ASSERT_EVENT, 0, line);
+    freeze_trace();
+
+    uprintf(msg, line, func);
+    print_trace();
+    fprintf(stderr, "sil: assertion failed at %.3f s\n", now);
+
+    exit(EXIT_FAILURE);
+}
+
+void break_sil(void)
+{
+    fprintf(stderr, "sil: breakpoint at %.3f s\n", now);
+
+    finish(EXIT_SUCCESS);
+}
+
+/* Power-on, before the firmware's main, configured via the
+ * environment. */
+
+__attribute__((constructor)) static void boot(void)
+{
+    const char *s;
+
+    for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+        if (mmap((void *)regions[i].address, regions[i].size,
+                 PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+                 -1, 0) != (void *)regions[i].address) {
+            perror("sil: mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* The FlexNVM, either erased, or loaded from a file, to which it
+     * is written back as it changes. */
+
+    {
+        int fd = -1, flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        bool erase = true;
+
+        if ((s = getenv("SIL_FLASH"))) {
+            fd = open(s, O_RDWR | O_CREAT, 0644);
+            erase = fd >= 0 && lseek(fd, 0, SEEK_END) == 0;
+
+            if (fd < 0 || ftruncate(fd, FLEXNVM_SIZE) < 0) {
+                perror("sil: open flash");
+                exit(EXIT_FAILURE);
+            }
+
+            flags = MAP_SHARED;
+        }
+
+        uint8_t *p = mmap((void *)FLEXNVM_BASE, FLEXNVM_SIZE,
+                          PROT_READ | PROT_WRITE,
+                          flags | MAP_FIXED_NOREPLACE, fd, 0);
+
+        if (p != (void *)FLEXNVM_BASE) {
+            perror("sil: mmap flash");
+            exit(EXIT_FAILURE);
+        }
+
+        if (erase) {
+            memset(p, 0xff, FLEXNVM_SIZE);
+        }
+    }
+
+    /* The panel switch is off and the encoder at rest, with the
+     * inputs pulled up. */
+
+    GPIOB_PDIR |= PT(16);
+    GPIOD_PDIR |= PT(2) | PT(3) | PT(4);
+
+    reset_plant(&plant, models,
+                (s = getenv("SIL_TEMPERATURE")) ? atof(s) : 20);
+
+    if ((s = getenv("SIL_MODEL")) && !(plant.model = find_model(s))) {
+        fprintf(stderr, "sil: unknown model %s\n", s);
+        exit(EXIT_FAILURE);
+    }
+
+    srand((s = getenv("SIL_SEED")) ? atoi(s) : 1);
+
+    /* Attach USB to a pseudo-terminal, if asked to, running in real
+     * time by default. */
+
+    if (getenv("SIL_PTY")) {
+        const int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+        if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+            perror("sil: pty");
+            exit(EXIT_FAILURE);
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fprintf(stderr, "sil: USB on %s\n", ptsname(fd));
+
+        link_in = link_out = fd;
+        link_pty = true;
+        speed = 1;
+    }
+
+    if ((s = getenv("SIL_SPEED"))) {
+        speed = atof(s);
+    }
+
+    for (int i = 0; i < SOURCES; i++) {
+        timeline[i] = INFINITY;
+    }
+
+    timeline[PLANT_SOURCE] = 0;
+    timeline[MAINS_SOURCE] = 0;
+    timeline[PRESSURE_SOURCE] = 0;
+    timeline[MASS_SOURCE] = 0;
+    timeline[TEMPERATURE_SOURCE] = 0;
+    timeline[LINK_SOURCE] = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &boot_time);
+}
@@ -0,0 +1,828 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A host simulator, running profiles against a model of the espresso
+ * machine.  The profile executor, controllers, estimator and filters
+ * are the firmware's own, compiled natively, while the sensors and
+ * actuators they'd normally talk to are replaced by a model of the
+ * pump, the puck and the boiler.  The simulation runs much faster
+ * than real time, so that profiles can be checked off-line. */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "callbacks.h"
+#include "estimator.h"
+#include "jitter.h"
+#include "library.h"
+#include "parse.h"
+#include "peripherals.h"
+#include "plant.h"
+#include "profile.h"
+#include "yield.h"
+
+#define STEP 1e-3               /* s, the plant's integration step */
+#define PRE_ROLL 3.0            /* s, before the shot */
+#define POST_ROLL 5.0           /* s, after the shot */
+
+/* Sensor sample rates, in Hz. */
+
+#define PRESSURE_RATE 100.0
+#define FLOW_RATE 10.0
+#define MASS_RATE 20.0
+#define TEMPERATURE_RATE 20.0
+
+static struct plant plant;
+static double now, mass_tare, drip_lag = NAN;
+static unsigned int seed = 1;
+
+/* The firmware's interface to the hardware, in terms of the
+ * plant. */
+
+struct filter pressure_filter, mass_filter, mass_rate_filter, flow_filter;
+struct filter temperature_filter;
+
+char __section_program_buffer[1024]
+    __attribute__((aligned(__alignof__(struct stage))));
+unsigned long __scratch_start[4096], __scratch_end;
+
+__asm__(".globl __scratch_end\n"
+        ".set __scratch_end, __scratch_start + 4096 * 8\n");
+
+double get_time(void)
+{
+    return now;
+}
+
+void set_pump_flow(double Q)
+{
+    plant.pump = fmin(fmax(Q, 0), 1);
+}
+
+double get_pump_flow(void)
+{
+    return plant.pump;
+}
+
+void set_heat_power(double P)
+{
+    plant.heat = fmin(fmax(P, 0), 1);
+}
+
+double get_heat_power(void)
+{
+    return plant.heat;
+}
+
+void tare_flow(void)
+{
+    tare_volume_estimate();
+}
+
+/* The firmware tares once the reading has settled, which takes a
+ * couple of seconds.  Here it happens at once. */
+
+void tare_mass(void)
+{
+    mass_tare += mass_filter.y;
+    tare_yield_estimate(mass_filter.y);
+    mass_filter.y = mass_filter.dy = 0;
+}
+
+double calibrate_flow(double r)
+{
+    /* The flow sensor's pulse rate is reported directly as the
+     * flow. */
+
+    return r;
+}
+
+double get_flow_derivative(void)
+{
+    return flow_filter.dy / flow_filter.dt;
+}
+
+bool load_library_profile(size_t slot)
+{
+    return false;
+}
+
+size_t get_library_selection(void)
+{
+    return LIBRARY_BUILTIN;
+}
+
+int uprintf(const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    const int n = vprintf(format, ap);
+    va_end(ap);
+
+    return n;
+}
+
+void _uassert(const char *msg, int line, const char *func)
+{
+    fprintf(stderr, msg, line, func);
+    abort();
+}
+
+/* Sample the sensors, as their drivers would, running the callbacks
+ * registered on them. */
+
+#define SAMPLE(CALLBACKS, FILTER, Y)                                    \
+    {                                                                   \
+        const double _y = (Y);                                          \
+                                                                        \
+        filter_sample(&FILTER, _y, now);                                \
+        RUN_CALLBACKS(                                                  \
+            CALLBACKS,                                                  \
+            bool (*)(double, double, double, double, double, int32_t),  \
+            FILTER.y, FILTER.dy, FILTER.t, FILTER.dt, _y, 0);           \
+    }
+
+static void sample_pressure(void)
+{
+    SAMPLE(pressure_callbacks, pressure_filter,
+           plant.P + sample_noise(PRESSURE_SIGMA));
+}
+
+static void sample_flow(void)
+{
+    SAMPLE(flow_callbacks, flow_filter,
+           fmax(plant.Q + sample_noise(FLOW_SIGMA), 0));
+}
+
+static void sample_mass(void)
+{
+    filter_sample(&mass_filter,
+                  plant.M + sample_noise(MASS_SIGMA) - mass_tare, now);
+    filter_sample(&mass_rate_filter, mass_filter.dy / mass_filter.dt, now);
+
+    RUN_CALLBACKS(
+        mass_callbacks,
+        bool (*)(double, double, double, double, double, int32_t),
+        mass_filter.y, mass_filter.dy, mass_filter.t, mass_filter.dt,
+        mass_filter.y, 0);
+}
+
+static void sample_temperature(void)
+{
+    SAMPLE(temperature_callbacks, temperature_filter,
+           plant.T_s + sample_noise(TEMPERATURE_SIGMA));
+}
+
+#undef SAMPLE
+
+/* Simulation */
+
+/* Bring the firmware to the state it would be in after a reset, so
+ * that each shot starts afresh. */
+
+static void boot(void)
+{
+    void **callbacks[] = {
+        pressure_callbacks, mass_callbacks, flow_callbacks,
+        temperature_callbacks, tick_callbacks, turn_callbacks,
+        click_callbacks, panel_callbacks
+    };
+
+    for (size_t i = 0; i < sizeof(callbacks) / sizeof(callbacks[0]); i++) {
+        memset(callbacks[i], 0, N_CALLBACKS * sizeof(void *));
+    }
+
+    /* As in i2c.c, flow.c and temperature.c. */
+
+    pressure_filter = DOUBLE_FILTER(0.12, 60.0);
+    mass_filter = SINGLE_FILTER(0.03);
+    mass_rate_filter = SINGLE_FILTER(0.3);
+    flow_filter = SINGLE_FILTER(0.5);
+    temperature_filter = DOUBLE_FILTER(1.0, 60.0);
+
+    temperature_pid.integral = 0;
+    mass_tare = 0;
+
+    /* Don't let the drip lag learnt in one shot carry over to the
+     * next, nor the noise. */
+
+    if (isnan(drip_lag)) {
+        drip_lag = get_drip_lag();
+    } else {
+        set_drip_lag(drip_lag);
+    }
+
+    srand(seed);
+
+    reset_estimator();
+    reset_profile();
+    reset_jitter();
+    reset_control();
+    enable_profile(true);
+}
+
+/* The controllers that can be swept, with the plant's variable each
+ * controls and the band within which it's taken to have settled. */
+
+static const struct loop {
+    char name;
+    const char *pid_name, *unit;
+    struct pid *pid;
+    const double *y;
+    double band;
+} loops[] = {
+    {'t', "temperature_pid", "C", &temperature_pid, &plant.T, 0.5},
+    {'p', "pressure_pid", "bar", &pressure_pid, &plant.P, 0.2},
+    {'f', "flow_pid", "ml/s", &flow_pid, &plant.Q, 0.2},
+};
+
+#define N_LOOPS (sizeof(loops) / sizeof(loops[0]))
+
+/* A controller's performance over a shot: the largest excursion of
+ * the process variable past the set-point, in the direction of the
+ * last step of the set-point, the longest it took to settle within
+ * the band after a step and the integrated absolute error.  All are
+ * NaN if the controller wasn't engaged. */
+
+struct metrics {
+    double overshoot, settling, iae;
+};
+
+#define N_TRANSITIONS 64
+
+struct result {
+    double duration, mass, peak_pressure, temperature[2];
+    struct metrics loops[N_LOOPS];
+
+    size_t n_transitions;
+    struct {
+        size_t stage;
+        double t;
+    } transitions[N_TRANSITIONS];
+};
+
+/* Run a shot of the current profile, of at most the given duration,
+ * optionally printing a trace every so many ticks. */
+
+static void simulate(const struct model *model, double temperature,
+                     double tick_rate, double duration, int trace,
+                     struct result *r)
+{
+    static const struct {
+        double rate;
+        void (*sample)(void);
+    } sensors[] = {
+        {PRESSURE_RATE, sample_pressure},
+        {FLOW_RATE, sample_flow},
+        {MASS_RATE, sample_mass},
+        {TEMPERATURE_RATE, sample_temperature},
+    };
+
+    const size_t n_sensors = sizeof(sensors) / sizeof(sensors[0]);
+    double t_s[n_sensors + 1], t_0 = NAN, t_1 = NAN;
+    double set[N_LOOPS], t_step[N_LOOPS], direction[N_LOOPS];
+    size_t stage = 0;
+    long ticks = 0;
+
+    memset(r, 0, sizeof(*r));
+    r->temperature[0] = INFINITY;
+    r->temperature[1] = -INFINITY;
+
+    for (size_t i = 0; i < N_LOOPS; i++) {
+        r->loops[i] = (struct metrics){NAN, NAN, NAN};
+        set[i] = t_step[i] = direction[i] = NAN;
+    }
+
+    reset_plant(&plant, model, temperature);
+    temperature_pid.set = temperature;
+
+    for (size_t i = 0; i <= n_sensors; i++) {
+        t_s[i] = 0;
+    }
+
+    for (now = 0; isnan(t_1) || now < t_1 + POST_ROLL; now += STEP) {
+        step_plant(&plant, STEP);
+
+        for (size_t i = 0; i < n_sensors; i++) {
+            if (now >= t_s[i]) {
+                sensors[i].sample();
+                t_s[i] += 1 / sensors[i].rate;
+            }
+        }
+
+        if (now < t_s[n_sensors]) {
+            continue;
+        }
+
+        t_s[n_sensors] += 1 / tick_rate;
+        ticks++;
+
+        RUN_CALLBACKS(tick_callbacks, bool (*)(void));
+
+        /* Start the shot after the pre-roll and end it once the
+         * profile has run to completion, or runs too long. */
+
+        if (isnan(t_0) && now >= PRE_ROLL) {
+            tare_mass();
+            t_0 = now;
+            RUN_CALLBACKS(panel_callbacks, bool (*)(bool), true);
+        } else if (!isnan(t_0) && isnan(t_1)
+                   && (get_stage() > get_stages()
+                       || now - t_0 >= duration)) {
+            t_1 = now;
+            RUN_CALLBACKS(panel_callbacks, bool (*)(bool), false);
+
+            /* The brew switch cuts power to the pump and the
+             * controllers release it. */
+
+            set_pump_flow(0);
+            pressure_pid.set = flow_pid.set = mass_rate_pid.set = NAN;
+        }
+
+        if (!isnan(t_0) && isnan(t_1)) {
+            if (get_stage() != stage
+                && r->n_transitions < N_TRANSITIONS) {
+                stage = get_stage();
+                r->transitions[r->n_transitions].stage = stage;
+                r->transitions[r->n_transitions].t = now - t_0;
+                r->n_transitions++;
+            }
+
+            r->peak_pressure = fmax(r->peak_pressure, plant.P);
+            r->temperature[0] = fmin(r->temperature[0], plant.T);
+            r->temperature[1] = fmax(r->temperature[1], plant.T);
+
+            /* A set-point that changes by more than the band in a
+             * tick, or is newly set, is a step, while smaller
+             * changes, as along a ramp, are followed. */
+
+            for (size_t i = 0; i < N_LOOPS; i++) {
+                const double set_k = loops[i].pid->set;
+                const double e = *loops[i].y - set_k;
+                struct metrics *m = &r->loops[i];
+
+                if (isnan(set_k)) {
+                    set[i] = NAN;
+                    continue;
+                }
+
+                if (isnan(set[i]) || fabs(set_k - set[i]) > loops[i].band) {
+                    t_step[i] = now;
+                    direction[i] = e > 0 ? -1 : 1;
+                }
+
+                set[i] = set_k;
+
+                if (isnan(m->iae)) {
+                    *m = (struct metrics){0, 0, 0};
+                }
+
+                m->overshoot = fmax(m->overshoot, direction[i] * e);
+                m->iae += fabs(e) / tick_rate;
+
+                if (fabs(e) > loops[i].band) {
+                    m->settling = fmax(m->settling, now - t_step[i]);
+                }
+            }
+        }
+
+        if (trace > 0 && ticks % trace == 0) {
+            printf("%.2f, %d, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f, "
+                   "%.3f, %.3f\n",
+                   now - (isnan(t_0) ? PRE_ROLL : t_0),
+                   isnan(t_0) || !isnan(t_1) ? 0 : (int)stage,
+                   pressure_filter.y, get_flow(), get_volume(),
+                   mass_filter.y, temperature_filter.y,
+                   plant.pump, plant.heat, plant.P, plant.M);
+        }
+    }
+
+    r->duration = t_1 - t_0;
+    r->mass = plant.M;
+}
+
+static void print_timeline(const struct result *r, const char *separator)
+{
+    for (size_t i = 0; i < r->n_transitions; i++) {
+        if (r->transitions[i].stage > get_stages()) {
+            break;
+        }
+
+        printf("%s%u@%.2f", i > 0 ? separator : "",
+               (unsigned int)r->transitions[i].stage, r->transitions[i].t);
+    }
+}
+
+/* Parameter sweeps */
+
+/* A range of N values, evenly spaced from one value to another, given
+ * as FROM:TO:N, or a single value. */
+
+struct range {
+    double from, to;
+    int n;
+};
+
+static bool parse_range(const char *s, struct range *r)
+{
+    char *e;
+
+    r->from = r->to = strtod(s, &e);
+    r->n = 1;
+
+    if (e > s && *e == ':') {
+        r->to = strtod(e + 1, &e);
+        r->n = *e == ':' ? (int)strtol(e + 1, &e, 10) : 0;
+    }
+
+    return e > s && *e == '\0' && r->n > 0;
+}
+
+/* The gain set with the given index, K_p varying fastest. */
+
+static void get_gains(const struct range ranges[3], int g, double gains[3])
+{
+    for (int i = 0; i < 3; i++) {
+        const struct range *r = &ranges[i];
+        const int j = g % r->n;
+
+        gains[i] = r->n > 1 ? r->from + (r->to - r->from) * j / (r->n - 1)
+                            : r->from;
+        g /= r->n;
+    }
+}
+
+static bool dominates(const struct metrics *a, const struct metrics *b)
+{
+    return (a->overshoot <= b->overshoot && a->settling <= b->settling
+            && a->iae <= b->iae
+            && (a->overshoot < b->overshoot || a->settling < b->settling
+                || a->iae < b->iae));
+}
+
+static double wall_time(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Simulate a shot of each profile with each gain set in the ranges
+ * for the given controller and print its metrics, followed by the
+ * Pareto-optimal gain sets, with respect to the largest overshoot
+ * and settling time and the total IAE over the profiles.  The
+ * firmware keeps its state in globals, so the shots are spread over
+ * as many processes, each with its own copy of it, which write the
+ * metrics to a shared array. */
+
+static int sweep(const struct loop *loop, const struct range ranges[3],
+                 const char **profiles, int n_profiles, int jobs,
+                 const struct model *model, double temperature,
+                 double tick_rate, double duration)
+{
+    const int n_gains = ranges[0].n * ranges[1].n * ranges[2].n;
+    const int n = n_gains * n_profiles;
+    const size_t k = loop - loops;
+    struct metrics *results = mmap(
+        NULL, n * sizeof(struct metrics), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    const double t_0 = wall_time();
+    bool failed = false;
+    int status;
+
+    fflush(stdout);
+
+    for (int j = 0; j < jobs; j++) {
+        const pid_t child = fork();
+
+        if (child < 0) {
+            perror("fork");
+            failed = true;
+            break;
+        }
+
+        if (child > 0) {
+            continue;
+        }
+
+        for (int i = j; i < n; i += jobs) {
+            const char *s = profiles[i % n_profiles];
+            double gains[3];
+            struct result r;
+
+            boot();
+
+            if (s) {
+                read_profile(s);
+            }
+
+            get_gains(ranges, i / n_profiles, gains);
+            loop->pid->K_p = gains[0];
+            loop->pid->T_i = gains[1];
+            loop->pid->T_d = gains[2];
+
+            simulate(model, temperature, tick_rate, duration, 0, &r);
+            results[i] = r.loops[k];
+        }
+
+        _exit(0);
+    }
+
+    while (wait(&status) > 0) {
+        failed = failed || !WIFEXITED(status) || WEXITSTATUS(status);
+    }
+
+    if (failed) {
+        fprintf(stderr, "Sweep failed\n");
+        return 1;
+    }
+
+    const double t_1 = wall_time();
+    struct metrics *totals = calloc(n_gains, sizeof(struct metrics));
+
+    if (!totals) {
+        perror("calloc");
+        return 1;
+    }
+
+    printf("# %s, %d gain sets, %d profiles, model %s\n",
+           loop->pid_name, n_gains, n_profiles, model->name);
+    printf("# gains, profile, K_p, T_i, T_d, overshoot (%s), "
+           "settling time (s), IAE (%s s)\n", loop->unit, loop->unit);
+
+    for (int g = 0; g < n_gains; g++) {
+        double gains[3];
+        struct metrics *t = &totals[g];
+
+        get_gains(ranges, g, gains);
+        *t = (struct metrics){NAN, NAN, NAN};
+
+        for (int p = 0; p < n_profiles; p++) {
+            const struct metrics *m = &results[g * n_profiles + p];
+
+            printf("%d, %d, %g, %g, %g, %.3f, %.2f, %.3f\n", g, p,
+                   gains[0], gains[1], gains[2],
+                   m->overshoot, m->settling, m->iae);
+
+            /* Profiles that don't engage the controller don't
+             * count. */
+
+            if (!isnan(m->iae)) {
+                t->overshoot = fmax(t->overshoot, m->overshoot);
+                t->settling = fmax(t->settling, m->settling);
+                t->iae = isnan(t->iae) ? m->iae : t->iae + m->iae;
+            }
+        }
+    }
+
+    int n_front = 0;
+
+    printf("# Pareto-optimal gains, with the largest overshoot and settling "
+           "time and the total IAE:\n");
+
+    for (int g = 0; g < n_gains; g++) {
+        bool dominated = isnan(totals[g].iae);
+        double gains[3];
+
+        for (int h = 0; h < n_gains && !dominated; h++) {
+            dominated = !isnan(totals[h].iae)
+                && dominates(&totals[h], &totals[g]);
+        }
+
+        if (dominated) {
+            continue;
+        }
+
+        get_gains(ranges, g, gains);
+        printf("# struct pid %s = {%g, %g, %g, NAN}; "
+               "/* %.3f %s, %.2f s, %.3f %s s */\n",
+               loop->pid_name, gains[0], gains[1], gains[2],
+               totals[g].overshoot, loop->unit, totals[g].settling,
+               totals[g].iae, loop->unit);
+        n_front++;
+    }
+
+    if (n_front == 0) {
+        printf("# None: %s isn't engaged by the profiles\n", loop->pid_name);
+    }
+
+    printf("# %d shots in %.2f s, %d at a time\n", n, t_1 - t_0, jobs);
+
+    free(totals);
+    munmap(results, n * sizeof(struct metrics));
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const struct model *model = &models[0];
+    double temperature = 93, tick_rate = 10, duration = 60;
+    const struct loop *loop = &loops[1];
+    struct range ranges[3];
+    int opt, trace = 1, jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool batch = false, sweeping = false;
+
+    while ((opt = getopt(argc, argv, "bm:T:r:d:t:s:g:k:j:")) != -1) {
+        switch (opt) {
+        case 'b':
+            batch = true;
+            break;
+        case 'g': {
+            char *t = strtok(optarg, ",");
+
+            for (int i = 0; i < 3; i++, t = strtok(NULL, ",")) {
+                if (!t || !parse_range(t, &ranges[i])) {
+                    fprintf(stderr, "Invalid gains, expected K_P,T_I,T_D, "
+                            "each a value or FROM:TO:N\n");
+                    return 1;
+                }
+            }
+
+            sweeping = true;
+            break;
+        }
+        case 'k':
+            for (loop = loops;
+                 loop < loops + N_LOOPS && loop->name != optarg[0];
+                 loop++);
+
+            if (loop == loops + N_LOOPS || optarg[1]) {
+                fprintf(stderr, "Unknown controller %s\n", optarg);
+                return 1;
+            }
+
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'm':
+            if (!(model = find_model(optarg))) {
+                fprintf(stderr, "Unknown model %s\n", optarg);
+                return 1;
+            }
+
+            break;
+        case 'T':
+            temperature = atof(optarg);
+            break;
+        case 'r':
+            tick_rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 't':
+            trace = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-b] [-m MODEL] [-T TEMPERATURE] [-r RATE] "
+                    "[-d DURATION] [-t TICKS] [-s SEED] "
+                    "[-g K_P,T_I,T_D [-k t|p|f] [-j JOBS]] [PROFILE...]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    /* Sweep the given controller's gains, each given as a range,
+     * over the profiles on the command line, or the built-in one,
+     * checking them first. */
+
+    if (sweeping) {
+        const char *builtin = NULL;
+        const char **profiles = optind < argc
+            ? (const char **)argv + optind : &builtin;
+        const int n_profiles = optind < argc ? argc - optind : 1;
+
+        for (int i = 0; i < n_profiles; i++) {
+            boot();
+
+            if (profiles[i] && !read_profile(profiles[i])) {
+                const struct parse_error *e = get_profile_error();
+
+                fprintf(stderr, "Profile %d: %u: %s\n", i,
+                        (unsigned int)e->offset + 1, e->message);
+                return 1;
+            }
+        }
+
+        return sweep(loop, ranges, profiles, n_profiles, jobs > 0 ? jobs : 1,
+                     model, temperature, tick_rate, duration);
+    }
+
+    /* Simulate each profile given on the command line, or else the
+     * built-in one, printing a trace.  In batch mode, print a line
+     * per profile instead, reading them from the standard input, one
+     * per line, if none are given. */
+
+    char line[1024];
+    int n = 0;
+
+    if (batch) {
+        printf("# profile, duration (s), yield (g), peak pressure (bar), "
+               "temperature range (C), time (ms), stage@time...\n");
+    }
+
+    for (int i = optind; ; i++) {
+        const char *s;
+
+        if (optind == argc) {
+            if (!batch) {
+                s = NULL;
+            } else if (fgets(line, sizeof(line), stdin)) {
+                line[strcspn(line, "\r\n")] = '\0';
+                s = line;
+            } else {
+                break;
+            }
+        } else if (i < argc) {
+            s = argv[i];
+        } else {
+            break;
+        }
+
+        boot();
+
+        if (s && !read_profile(s)) {
+            const struct parse_error *e = get_profile_error();
+
+            printf("%d, ! %u: %s\n", n, (unsigned int)e->offset + 1,
+                   e->message);
+            n++;
+
+            continue;
+        }
+
+        struct result r;
+
+        if (!batch) {
+            printf("# %s\n# %u stages, %u bytes, model %s\n",
+                   s ? s : "built-in", (unsigned int)get_stages(),
+                   (unsigned int)get_profile()->alloc, model->name);
+            printf("# time (s), stage, pressure (bar), flow (ml/s), "
+                   "volume (ml), mass (g), temperature (C), pump, heat, "
+                   "plant pressure (bar), plant mass (g)\n");
+        }
+
+        const clock_t c_0 = clock();
+
+        simulate(model, temperature, tick_rate, duration,
+                 batch ? 0 : trace, &r);
+
+        const double ms = 1e3 * (clock() - c_0) / CLOCKS_PER_SEC;
+
+        if (batch) {
+            printf("%d, %.2f, %.1f, %.2f, %.1f-%.1f, %.1f, ", n,
+                   r.duration, r.mass, r.peak_pressure,
+                   r.temperature[0], r.temperature[1], ms);
+            print_timeline(&r, " ");
+            printf("\n");
+        } else {
+            printf("# stages: ");
+            print_timeline(&r, ", ");
+            printf("\n# %.2f s, %.1f g, simulated in %.1f ms\n",
+                   r.duration, r.mass, ms);
+        }
+
+        n++;
+
+        if (!s) {
+            break;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,543 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Worst-case stack usage, from the call graphs GCC writes with
+ * -fcallgraph-info=su, one per translation unit.  The deepest path
+ * is found from the thread-mode entry point and from each interrupt
+ * handler and, since a handler can only be preempted by one of a
+ * higher priority group, the worst case is the sum of the deepest
+ * path in thread mode and in each priority group, plus the exception
+ * frame stacked on entry to each group.
+ *
+ * Indirect calls are assumed to reach any of the callbacks, i.e. the
+ * functions named *_callback, while those made by specific callers
+ * can be given additional targets with -i, as in -i CALLER:FUNCTION,
+ * where CALLER can be a comma-separated list, e.g. of a function and
+ * the one it may be inlined into.
+ * Recursion is only allowed through functions given with -r, along
+ * with the number of activations they can have on any path, and
+ * functions without stack usage information, such as those in the C
+ * library, are assumed to use a fixed amount, given with -e.
+ * Functions are named as in the source in the above, although GCC
+ * qualifies static ones with their file and may clone them, under
+ * names such as display_i_inner.part.0. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The exception frame, of eight words without floating point
+ * context, plus a word of padding to align the stack. */
+
+#define EXCEPTION_FRAME 36
+#define MAX_LEVELS 8
+#define MAX_DEPTH 1024
+
+static struct function {
+    char *name;
+    int bytes, bound, active, worst, next;
+    bool defined, dynamic, memoized, reported, printed;
+
+    int *callees;
+    size_t n_callees;
+} *functions;
+
+static size_t n_functions;
+static int external = 128, recursing, path[MAX_DEPTH], depth;
+static bool failed;
+
+static int find_function(const char *name, size_t n)
+{
+    for (size_t i = 0; i < n_functions; i++) {
+        if (strlen(functions[i].name) == n
+            && !strncmp(functions[i].name, name, n)) {
+            return i;
+        }
+    }
+
+    if (!(n_functions & (n_functions + 1))) {
+        functions = realloc(
+            functions, 2 * (n_functions + 1) * sizeof(struct function));
+
+        if (!functions) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    functions[n_functions] = (struct function){
+        .name = strndup(name, n), .bound = 1, .next = -1};
+
+    return n_functions++;
+}
+
+static void add_callee(int f, int g)
+{
+    struct function *p = &functions[f];
+
+    for (size_t i = 0; i < p->n_callees; i++) {
+        if (p->callees[i] == g) {
+            return;
+        }
+    }
+
+    if (!(p->n_callees & (p->n_callees + 1))) {
+        p->callees = realloc(
+            p->callees, 2 * (p->n_callees + 1) * sizeof(int));
+
+        if (!p->callees) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    p->callees[p->n_callees++] = g;
+}
+
+/* Whether a function has the given name, in the source. */
+
+static bool is_named(const struct function *p, const char *name)
+{
+    const char *s = strrchr(p->name, ':');
+
+    s = s ? s + 1 : p->name;
+
+    const size_t n = strcspn(s, ".");
+
+    return strlen(name) == n && !strncmp(s, name, n);
+}
+
+/* Find the quoted string following a key on a line of the graph. */
+
+static const char *find_string(const char *line, const char *key,
+                               size_t *n)
+{
+    const char *s = strstr(line, key);
+
+    if (!s || !(s = strchr(s + strlen(key), '"'))) {
+        return NULL;
+    }
+
+    s++;
+    *n = strcspn(s, "\"");
+
+    return s;
+}
+
+static bool read_graph(const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+
+    if (!file) {
+        perror(filename);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+
+    while (getline(&line, &size, file) != -1) {
+        const char *s, *t;
+        size_t n, m;
+
+        if (!strncmp(line, "node:", 5)) {
+            if (!(s = find_string(line, "title:", &n))) {
+                continue;
+            }
+
+            const int f = find_function(s, n);
+            struct function *p = &functions[f];
+
+            /* The label reads "NAME\nLOCATION\nN bytes (QUALIFIERS)"
+             * for defined functions, where the qualifiers are static,
+             * or dynamic, possibly bounded. */
+
+            if ((t = strstr(line, " bytes ("))) {
+                while (t > line && t[-1] != 'n') {
+                    t--;
+                }
+
+                const int bytes = atoi(t);
+
+                if (!p->defined || bytes > p->bytes) {
+                    p->bytes = bytes;
+                }
+
+                p->defined = true;
+                p->dynamic |= (strstr(t, "(dynamic)") != NULL);
+            }
+        } else if (!strncmp(line, "edge:", 5)) {
+            if (!(s = find_string(line, "sourcename:", &n))
+                || !(t = find_string(line, "targetname:", &m))) {
+                continue;
+            }
+
+            const int g = find_function(t, m);
+            const int f = find_function(s, n);
+
+            add_callee(f, g);
+        }
+    }
+
+    free(line);
+    fclose(file);
+
+    return true;
+}
+
+static void report(int f, const char *message)
+{
+    struct function *p = &functions[f];
+
+    if (!p->reported) {
+        fprintf(stderr, "%s: %s\n", p->name, message);
+        p->reported = true;
+    }
+
+    failed = true;
+}
+
+/* Whether a call to an active function closes a cycle that passes
+ * through a function with bounded recursion, which then bounds the
+ * cycle as well. */
+
+static bool is_bounded_cycle(int f)
+{
+    for (int i = depth - 1; i >= 0 && path[i] != f; i--) {
+        if (functions[path[i]].bound > 1) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* The stack usage of the deepest path from a function, recording the
+ * callee it goes through, so that the path can be printed.  Results
+ * are only reused when no recursive function is active, as they
+ * otherwise depend on the path taken to the function. */
+
+static int find_worst(int f)
+{
+    struct function *p = &functions[f];
+
+    if (p->memoized) {
+        return p->worst;
+    }
+
+    if (p->active >= p->bound
+        && (p->bound > 1 || !is_bounded_cycle(f) || depth == MAX_DEPTH)) {
+        if (p->bound == 1) {
+            report(f, "unbounded recursion");
+        }
+
+        return 0;
+    }
+
+    if (p->dynamic) {
+        report(f, "unbounded dynamic allocation");
+    }
+
+    const bool recursive = p->bound > 1;
+    int worst = 0, next = -1;
+
+    p->active++;
+    recursing += recursive;
+    path[depth++] = f;
+
+    for (size_t i = 0; i < p->n_callees; i++) {
+        const int w = find_worst(p->callees[i]);
+
+        if (w > worst || next < 0) {
+            worst = w;
+            next = p->callees[i];
+        }
+    }
+
+    depth--;
+    recursing -= recursive;
+    p->active--;
+
+    /* Keep the way out of the innermost activation of a recursive
+     * function, for printing. */
+
+    if (next != f) {
+        p->next = next;
+    }
+
+    worst += (
+        p->defined ? p->bytes : (p->n_callees > 0 ? 0 : external));
+
+    if (!recursing) {
+        p->memoized = true;
+        p->worst = worst;
+    }
+
+    return worst;
+}
+
+/* Print the deepest path from a function, by source name, listing
+ * recursive functions once. */
+
+static void print_path(int f)
+{
+    for (size_t i = 0; i < n_functions; i++) {
+        functions[i].printed = false;
+    }
+
+    for (int i = 0; f >= 0 && !functions[f].printed;
+         f = functions[f].next, i++) {
+        const char *s = strrchr(functions[f].name, ':');
+
+        s = s ? s + 1 : functions[f].name;
+        printf("%s%.*s", i > 0 ? " " : "", (int)strcspn(s, "."), s);
+        functions[f].printed = true;
+    }
+
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *entry = "reset", *levels[MAX_LEVELS];
+    char *indirect[argc];
+    struct {char *name; int bound;} bounds[argc];
+    int opt, n_levels = 0, n_indirect = 0, n_bounds = 0;
+    long budget = -1;
+
+    while ((opt = getopt(argc, argv, "m:l:i:r:e:b:")) != -1) {
+        switch (opt) {
+        case 'm':
+            entry = optarg;
+            break;
+        case 'l':
+            if (n_levels == MAX_LEVELS) {
+                fprintf(stderr, "Too many priority groups\n");
+                return 1;
+            }
+
+            levels[n_levels++] = optarg;
+            break;
+        case 'i':
+            indirect[n_indirect++] = optarg;
+            break;
+        case 'r': {
+            char *c = strchr(optarg, ':');
+
+            if (!c || atoi(c + 1) < 1) {
+                fprintf(stderr, "Bad recursion bound %s\n", optarg);
+                return 1;
+            }
+
+            *c = '\0';
+            bounds[n_bounds].name = optarg;
+            bounds[n_bounds++].bound = atoi(c + 1);
+            break;
+        }
+        case 'e':
+            external = atoi(optarg);
+            break;
+        case 'b':
+            budget = atol(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-m ENTRY] [-l HANDLER,...]... "
+                    "[-i CALLER,...:FUNCTION]... [-r FUNCTION:DEPTH]... [-e BYTES] "
+                    "[-b BUDGET] FILE.ci...\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (!read_graph(argv[i])) {
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < n_functions; i++) {
+        for (int j = 0; j < n_bounds; j++) {
+            if (is_named(&functions[i], bounds[j].name)) {
+                functions[i].bound = bounds[j].bound;
+            }
+        }
+    }
+
+    /* Connect the placeholder for indirect calls to the functions
+     * they can reach. */
+
+    const int placeholder = find_function("__indirect_call", 15);
+
+    functions[placeholder].defined = true;
+
+    for (size_t i = 0; i < n_functions; i++) {
+        const char *name = functions[i].name;
+        const size_t n = strcspn(name, ".");
+        bool reachable = (
+            functions[i].defined && (int)i != placeholder
+            && n > 9 && !strncmp(name + n - 9, "_callback", 9));
+
+        if (reachable) {
+            add_callee(placeholder, i);
+        }
+    }
+
+    /* Give the callers named with -i placeholders of their own, that
+     * also reach the given functions. */
+
+    for (int j = 0; j < n_indirect; j++) {
+        char *c = strrchr(indirect[j], ':'), *callers = indirect[j];
+        bool found = false;
+
+        if (!c) {
+            fprintf(stderr, "Bad indirect call target %s\n", indirect[j]);
+            return 1;
+        }
+
+        *c = '\0';
+
+        for (char *name = strtok(callers, ", "); name;
+             name = strtok(NULL, ", ")) {
+            for (size_t f = 0; f < n_functions; f++) {
+                struct function *p = &functions[f];
+                size_t k;
+
+                if (!p->defined || !is_named(p, name)) {
+                    continue;
+                }
+
+                for (k = 0; k < p->n_callees; k++) {
+                    const char *s = strrchr(
+                        functions[p->callees[k]].name, '/');
+
+                    if (p->callees[k] == placeholder
+                        || (s && !strcmp(s, "/__indirect_call"))) {
+                        break;
+                    }
+                }
+
+                if (k == p->n_callees) {
+                    continue;
+                }
+
+                /* The caller's own placeholder, which may already
+                 * exist, from a previous -i. */
+
+                char title[strlen(p->name) + 17];
+
+                sprintf(title, "%s/__indirect_call", p->name);
+
+                const int g = find_function(title, strlen(title));
+
+                p = &functions[f];
+
+                if (!functions[g].defined) {
+                    functions[g].defined = true;
+
+                    for (size_t l = 0;
+                         l < functions[placeholder].n_callees; l++) {
+                        add_callee(g, functions[placeholder].callees[l]);
+                    }
+                }
+
+                p->callees[k] = g;
+
+                for (size_t l = 0; l < n_functions; l++) {
+                    if (functions[l].defined
+                        && is_named(&functions[l], c + 1)) {
+                        add_callee(g, l);
+                    }
+                }
+
+                found = true;
+            }
+        }
+
+        if (!found) {
+            fprintf(stderr, "%s: no indirect calls\n", callers);
+            failed = true;
+        }
+    }
+
+    /* Thread mode first, followed by each priority group. */
+
+    long total = 0;
+
+    printf("# context, bytes, path\n");
+
+    for (int i = -1; i < n_levels; i++) {
+        char *list = strdup(i < 0 ? entry : levels[i]);
+        int worst = -1, deepest = -1;
+
+        for (char *name = strtok(list, ", "); name;
+             name = strtok(NULL, ", ")) {
+            bool found = false;
+
+            for (size_t f = 0; f < n_functions; f++) {
+                if (!functions[f].defined
+                    || !is_named(&functions[f], name)) {
+                    continue;
+                }
+
+                const int w = find_worst(f);
+
+                if (w > worst) {
+                    worst = w;
+                    deepest = f;
+                }
+
+                found = true;
+            }
+
+            if (!found) {
+                fprintf(stderr, "%s: not found\n", name);
+                failed = true;
+            }
+        }
+
+        free(list);
+
+        if (deepest < 0) {
+            continue;
+        }
+
+        worst += i < 0 ? 0 : EXCEPTION_FRAME;
+        total += worst;
+
+        printf("%s, %d, ", i < 0 ? "thread" : "handler", worst);
+        print_path(deepest);
+    }
+
+    printf("total, %ld", total);
+
+    if (budget >= 0) {
+        printf(", %ld", budget);
+    }
+
+    printf("\n");
+
+    if (budget >= 0 && total > budget) {
+        fprintf(stderr, "Worst-case stack usage of %ld bytes exceeds "
+                "the budget of %ld\n", total, budget);
+
+        return 1;
+    }
+
+    return failed;
+}
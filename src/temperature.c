@@ -17,16 +17,18 @@
 #include <math.h>
 
 #include "mk20dx.h"
-#include "callbacks.h"
-#include "filter.h"
+#include "cycles.h"
+#include "health.h"
+#include "peripherals.h"
+#include "sensors.h"
 #include "time.h"
 #include "usb.h"
 
-struct filter temperature_filter = DOUBLE_FILTER(1.0, 60.0);
-
 #define TRANSMIT(X, FLAGS) {                                            \
         SPI0_SR |= SPI_SR_TFFF;                                         \
-        WAIT_WHILE(!(SPI0_SR & SPI_SR_TFFF), 100);                      \
+        WAIT_WHILE(                                                     \
+            !(SPI0_SR & SPI_SR_TFFF), 100,                              \
+            count_error(TEMPERATURE_SENSOR, TIMEOUT_ERROR));            \
         SPI0_PUSHR = SPI_PUSHR_PCS(0) | SPI_PUSHR_CTAS(1) | (FLAGS) | (X); \
     }
 
@@ -88,7 +90,22 @@ void reset_temperature(void)
     enable_interrupt(PORTC_IRQ);
 }
 
-__attribute__((interrupt ("IRQ"))) void portc_isr(void)
+/* Convert a 16-bit code, as read from the data registers, i.e. the
+ * 15-bit ratio of the RTD to the reference resistance and the fault
+ * bit, to a temperature, by solving the Callendar-Van Dusen equation
+ * for temperatures above 0C. */
+
+double calibrate_temperature(uint16_t c)
+{
+    const double A = 3.9083e-3;
+    const double B = -5.775e-7;
+
+    return (
+        (-A + sqrt(A * A - 4 * B * (1 - ldexp(c >> 1, -15) * 4.3)))
+        / (2 * B));
+}
+
+TIMED_ISR(portc_isr, PORTC_ISR)
 {
     /* At this point, the current state of the SPI module is not
      * known; it might be busy sending data elsewhere, with one or
@@ -96,11 +113,15 @@ __attribute__((interrupt ("IRQ"))) void portc_isr(void)
      * address, setting the EOQ flag, so that we can wait for its
      * completion. */
 
+    count_transaction(TEMPERATURE_SENSOR);
+
     TRANSMIT(0x01, SPI_PUSHR_CONT | SPI_PUSHR_EOQ);
 
     /* Wait for the transmission to end and flush the RX FIFO.  */
 
-    WAIT_WHILE(!(SPI0_SR & SPI_SR_EOQF), 100);
+    WAIT_WHILE(
+        !(SPI0_SR & SPI_SR_EOQF), 100,
+        count_error(TEMPERATURE_SENSOR, TIMEOUT_ERROR));
     SPI0_MCR |= SPI_MCR_CLR_RXF;
     SPI0_SR |= SPI_SR_EOQF;
 
@@ -110,7 +131,9 @@ __attribute__((interrupt ("IRQ"))) void portc_isr(void)
     TRANSMIT(0, SPI_PUSHR_CONT);
     TRANSMIT(0, SPI_PUSHR_EOQ);
 
-    WAIT_WHILE(!(SPI0_SR & SPI_SR_EOQF), 100);
+    WAIT_WHILE(
+        !(SPI0_SR & SPI_SR_EOQF), 100,
+        count_error(TEMPERATURE_SENSOR, TIMEOUT_ERROR));
 
     const uint8_t a = SPI0_POPR;
     const uint8_t b = SPI0_POPR;
@@ -126,6 +149,8 @@ __attribute__((interrupt ("IRQ"))) void portc_isr(void)
     if (c & 1) {
         T = NAN;
 
+        count_error(TEMPERATURE_SENSOR, FAULT_ERROR);
+
         if (is_usb_dtr()) {
             /* Send the fault register's read address and read the next two
              * bytes of returned data. */
@@ -133,11 +158,15 @@ __attribute__((interrupt ("IRQ"))) void portc_isr(void)
             SPI0_PUSHR = SPI_PUSHR_PCS(0) | SPI_PUSHR_CTAS(1) | SPI_PUSHR_CONT | 0x07;
             SPI0_PUSHR = SPI_PUSHR_PCS(0) | SPI_PUSHR_CTAS(1) | 0;
 
-            WAIT_WHILE(!(SPI0_SR & SPI_SR_RFDF), 100);
+            WAIT_WHILE(
+                !(SPI0_SR & SPI_SR_RFDF), 100,
+                count_error(TEMPERATURE_SENSOR, TIMEOUT_ERROR));
             SPI0_POPR;
 
             SPI0_SR |= SPI_SR_RFDF;
-            WAIT_WHILE(!(SPI0_SR & SPI_SR_RFDF), 100);
+            WAIT_WHILE(
+                !(SPI0_SR & SPI_SR_RFDF), 100,
+                count_error(TEMPERATURE_SENSOR, TIMEOUT_ERROR));
 
             uprintf("MAX13865 fault: %b\n", SPI0_POPR);
         }
@@ -146,30 +175,10 @@ __attribute__((interrupt ("IRQ"))) void portc_isr(void)
         delay_ms(100);
         run_temperature(true);
     } else {
-        const double A = 3.9083e-3;
-        const double B = -5.775e-7;
-
-        T = (
-            (-A + sqrt(A * A - 4 * B * (1 - ldexp(c >> 1, -15) * 4.3)))
-            / (2 * B));
-    }
-
-    /* Occasionally, one of the two bytes making up the 16-bit code is
-     * read as zero.  It is not clear why that happens and, since it
-     * happens relatively rarely (i.e. once in several tens of
-     * thousands of conversions, we'll just discard these readings in
-     * software. */
-
-    if ((a && b) || (fabs(T - temperature_filter.y) < 1)) {
-        filter_sample(&temperature_filter, T, get_time());
+        T = calibrate_temperature(c);
     }
 
-    RUN_CALLBACKS(
-        temperature_callbacks,
-        bool (*)(double, double, double, double, double, int32_t),
-        temperature_filter.y, temperature_filter.dy,
-        temperature_filter.t, temperature_filter.dt,
-        T, c);
+    process_temperature_sample(T, c);
 
   error:
 }
@@ -18,22 +18,95 @@
 
 #include "mk20dx.h"
 #include "callbacks.h"
+#include "cycles.h"
 #include "time.h"
+#include "trace.h"
 
+/* In the software-in-the-loop build, time is kept by the simulated
+ * board instead (see sil.c). */
+
+#ifndef SIL
 static volatile uint32_t ticks;
+#endif
+
+/* The profile tick is derived from the 48Mhz bus clock, divided by
+ * 128. */
+
+#define TICK_CLOCK 375000
+#define MIN_TICK_RATE 10
+#define MAX_TICK_RATE 200
 
-__attribute__((interrupt ("IRQ"))) void systick_isr(void)
+static struct {
+    uint32_t count, cycles, max;
+} tick_load;
+
+#ifndef SIL
+TIMED_ISR(systick_isr, SYSTICK_ISR)
 {
     ticks++;
 }
+#endif
 
-__attribute__((interrupt ("IRQ"))) void ftm1_isr(void)
+TIMED_ISR(ftm1_isr, FTM1_ISR)
 {
+    const uint32_t c = SYST_CVR;
+
     FTM1_SC &= ~FTM_SC_TOF;
 
+    clock_trace();
+
+    begin_cycles(TICK_CHAIN);
     RUN_CALLBACKS(tick_callbacks, bool (*)());
+    end_cycles(TICK_CHAIN);
+
+    /* Measure the time spent in the tick callbacks, in core clock
+     * cycles, via the SysTick counter, which counts down. */
+
+    const uint32_t r = SYST_RVR + 1;
+    const uint32_t n = (c + r - SYST_CVR) % r;
+
+    tick_load.count++;
+    tick_load.cycles += n;
+
+    if (n > tick_load.max) {
+        tick_load.max = n;
+    }
+}
+
+/* Set the rate of the profile tick, in Hz.  A new MOD value takes
+ * effect when the counter next overflows, so the change is
+ * glitch-free. */
+
+void set_tick_rate(double f)
+{
+    f = f < MIN_TICK_RATE ? MIN_TICK_RATE : (f > MAX_TICK_RATE
+                                             ? MAX_TICK_RATE : f);
+
+    FTM1_MOD = (uint32_t)(TICK_CLOCK / f + 0.5) - 1;
+}
+
+double get_tick_rate(void)
+{
+    return (double)TICK_CLOCK / (FTM1_MOD + 1);
+}
+
+/* Print the tick rate, the mean and maximum cycles spent per tick
+ * since the last call and the resulting CPU load, in percent. */
+
+void print_tick_load(void)
+{
+    const double f = get_tick_rate();
+    const uint32_t n = tick_load.count > 0 ? tick_load.count : 1;
+    const uint32_t mean = tick_load.cycles / n;
+
+    uprintf("%f, %u, %u, %f\n",
+            f, mean, tick_load.max,
+            100 * mean * f / (COUNTS_PER_US * 1e6));
+
+    tick_load.count = tick_load.cycles = tick_load.max = 0;
 }
 
+#ifndef SIL
 double get_time()
 {
     const uint32_t r = SYST_RVR;
@@ -64,15 +137,16 @@ void delay_us(int32_t n)
     while (((int32_t)(ticks - t) * (r + 1) + u - (int32_t)SYST_CVR)
            / COUNTS_PER_US < n);
 }
+#endif
 
 void reset_time()
 {
-    /* Configure FTM1 as a 10Hz tick interrupt, for profile
-     * execution and such. */
+    /* Configure FTM1 as a tick interrupt, for profile execution and
+     * such, at 10Hz by default. */
 
     SIM_SCGC6 |= SIM_SCGC6_FTM1;
     FTM1_SC = FTM_SC_CLKS(1) | FTM_SC_PS(7) | FTM_SC_TOIE;
-    FTM1_MOD = 37499;
+    set_tick_rate(10);
 
     prioritize_interrupt(FTM1_IRQ, 8);
     enable_interrupt(FTM1_IRQ);
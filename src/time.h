@@ -29,6 +29,9 @@
 void reset_time(void);
 double get_time(void);
 void delay_us(int32_t n);
+void set_tick_rate(double f);
+double get_tick_rate(void);
+void print_tick_load(void);
 #define delay_ms(N) delay_us(1000 * N)
 #define DELAY_WHILE_US(COND, N, ACTION)                                 \
     {                                                                   \
@@ -0,0 +1,244 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Conversion of event traces, as printed by dt or on a failed
+ * assertion (see trace.c), to Chrome's trace event format, for
+ * viewing in chrome://tracing or Perfetto.  Sections, i.e. ISRs and
+ * callback chains, become duration events, the settings of the
+ * actuators counters and the rest instant events.  Each trace in the input
+ * becomes a process of its own, while lines that don't parse, such
+ * as the assertion message, are skipped.
+ *
+ * The cycle counter wraps around every minute or so, but the firmware
+ * traces clock events often enough to keep successive records less
+ * than that apart, so it can be unwrapped.  Times are given in
+ * microseconds from the first event, for the clock given with -c, in
+ * cycles per microsecond. */
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cycles.h"
+#include "health.h"
+#include "jitter.h"
+#include "trace.h"
+
+#define MAX_NESTING 16
+
+/* The names of the sections, as printed by di, the sensors and their
+ * errors, as in health.h, and of the modes, as in main.c. */
+
+static const char *sections[SECTIONS] = {
+    "porta", "portb", "portc", "portd", "i2c0", "pdb0", "ftm0",
+    "ftm1", "pit0", "pit1", "pit2", "pit3", "usb", "systick",
+    "pressure", "mass", "temperature", "flow", "tick", "turn",
+    "click", "panel"
+};
+
+static const char *sensors[SENSORS] = {
+    "pressure", "mass", "temperature", "flow"
+};
+
+static const char *errors[SENSOR_ERRORS] = {
+    "nack", "arbitration", "busy", "master", "timeout", "fault", "overrun"
+};
+
+static const char *modes[] = {
+    "auto", "manual temperature", "manual flow", "manual pressure",
+    "manual heat", "manual pump"
+};
+
+static const char *actuators[ACTUATORS] = {"heater", "pump"};
+
+static const char *faults[] = {
+    [3] = "hard fault", [4] = "memory management fault",
+    [5] = "bus fault", [6] = "usage fault"
+};
+
+static bool first = true;
+
+/* Print an event, leaving the arguments, if any, to the caller. */
+
+static void print_event(const char *phase, int pid, double t,
+                        const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void print_event(const char *phase, int pid, double t,
+                        const char *format, ...)
+{
+    va_list ap;
+
+    printf("%s\n    {\"ph\": \"%s\", \"pid\": %d, \"tid\": 0, "
+           "\"ts\": %.3f, \"name\": \"",
+           first ? "" : ",", phase, pid, t);
+
+    va_start(ap, format);
+    vprintf(format, ap);
+    va_end(ap);
+
+    printf("\"");
+    first = false;
+}
+
+int main(int argc, char *argv[])
+{
+    double clock = 72;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+        case 'c':
+            clock = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c CYCLES_PER_US] [FILE]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    FILE *f = stdin;
+
+    if (optind < argc && !(f = fopen(argv[optind], "r"))) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    uint64_t t = 0;
+    uint32_t last = 0;
+    int pid = -1, depth = 0, open[MAX_NESTING];
+    bool started = false;
+
+    printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+    while (getline(&line, &size, f) != -1) {
+        uint32_t cycles;
+        unsigned int e, id, value;
+
+        if (!strncmp(line, "# cycles, event, id, value", 26)) {
+            pid++;
+            depth = 0;
+            started = false;
+
+            print_event("M", pid, 0, "process_name");
+            printf(", \"args\": {\"name\": \"trace %d\"}}", pid);
+            continue;
+        }
+
+        if (pid < 0
+            || sscanf(line, "%" SCNu32 ", %u, %u, %u",
+                      &cycles, &e, &id, &value) != 4
+            || e >= TRACE_EVENTS) {
+            continue;
+        }
+
+        t = started ? t + (uint32_t)(cycles - last) : 0;
+        last = cycles;
+        started = true;
+
+        const double us = t / clock;
+
+        switch (e) {
+        case BEGIN_EVENT:
+            if (id >= SECTIONS) {
+                continue;
+            }
+
+            if (depth < MAX_NESTING) {
+                open[depth] = id;
+            }
+
+            depth++;
+            print_event("B", pid, us, "%s", sections[id]);
+            break;
+
+        case END_EVENT:
+            /* Sections that began before the first traced event have
+             * no beginning to end. */
+
+            if (depth == 0 || (depth <= MAX_NESTING
+                               && open[depth - 1] != (int)id)) {
+                continue;
+            }
+
+            depth--;
+            print_event("E", pid, us, "%s", sections[id]);
+            break;
+
+        case STAGE_EVENT:
+            print_event("i", pid, us, "stage %u", id);
+            printf(", \"s\": \"p\"");
+            break;
+
+        case MODE_EVENT:
+            print_event("i", pid, us, "%s mode",
+                        id < sizeof(modes) / sizeof(*modes)
+                        ? modes[id] : "unknown");
+            printf(", \"s\": \"p\"");
+            break;
+
+        case ACTUATOR_EVENT:
+            if (id >= ACTUATORS) {
+                continue;
+            }
+
+            print_event("C", pid, us, "%s", actuators[id]);
+            printf(", \"args\": {\"delay\": %.4f}",
+                   (double)value / UINT16_MAX);
+            break;
+
+        case ERROR_EVENT:
+            if (id >= SENSORS || value >= SENSOR_ERRORS) {
+                continue;
+            }
+
+            print_event("i", pid, us, "%s %s error",
+                        sensors[id], errors[value]);
+            break;
+
+        case FAULT_EVENT:
+            print_event("i", pid, us, "%s",
+                        id < sizeof(faults) / sizeof(*faults) && faults[id]
+                        ? faults[id] : "fault");
+            printf(", \"s\": \"g\"");
+            break;
+
+        case ASSERT_EVENT:
+            print_event("i", pid, us, "assertion failed on line %u", value);
+            printf(", \"s\": \"g\"");
+            break;
+
+        case CLOCK_EVENT:
+            continue;
+        }
+
+        printf("}");
+    }
+
+    printf("\n]}\n");
+
+    free(line);
+    fclose(f);
+
+    return pid < 0;
+}
@@ -0,0 +1,123 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+
+#include "mk20dx.h"
+#include "trace.h"
+#include "usb.h"
+
+/* The most recent events, in a ring of compact records, timestamped
+ * with the DWT cycle counter.  Slots are claimed by atomically
+ * incrementing the head, so that events can be traced at any
+ * priority without masking interrupts; an ISR that preempts the
+ * tracing of an event simply takes the next slot. */
+
+#ifdef TEENSY30
+#define TRACE_SIZE 128
+#else
+#define TRACE_SIZE 512
+#endif
+
+static struct trace_record {
+    uint32_t cycles;
+    uint8_t event, id;
+    uint16_t value;
+} records[TRACE_SIZE];
+
+/* The events traced, one bit per event.  Sections and actuator
+ * settings occur hundreds of times a second and would soon overwrite
+ * the rarer events a post-mortem needs, so they're only traced on
+ * request.  Faults and failed assertions are always traced, as are
+ * clock events (see clock_trace). */
+
+#define ALWAYS_TRACED (                                                 \
+        (1 << FAULT_EVENT) | (1 << ASSERT_EVENT) | (1 << CLOCK_EVENT))
+
+static uint32_t head, last;
+static volatile uint32_t traced = (
+    (1 << STAGE_EVENT) | (1 << MODE_EVENT) | (1 << ERROR_EVENT)
+    | ALWAYS_TRACED);
+static volatile bool frozen;
+
+void trace(enum trace_event e, uint8_t id, uint16_t value)
+{
+    if (frozen || !(traced & (1 << e))) {
+        return;
+    }
+
+    const uint32_t i = (
+        __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED) % TRACE_SIZE);
+
+    const uint32_t now = DWT_CYCCNT;
+
+    records[i] = (struct trace_record){now, e, id, value};
+    last = now;
+}
+
+/* The cycle counter wraps around every minute or so, so a clock event
+ * is traced whenever nothing else has been for a quarter of that, to
+ * keep the time between successive records unambiguous.  This is
+ * called off the profile tick, which runs at 10Hz or more. */
+
+void clock_trace(void)
+{
+    if (DWT_CYCCNT - last >= (uint32_t)1 << 30) {
+        trace(CLOCK_EVENT, 0, 0);
+    }
+}
+
+void set_trace_mask(uint32_t mask)
+{
+    traced = mask | ALWAYS_TRACED;
+}
+
+uint32_t get_trace_mask(void)
+{
+    return traced;
+}
+
+/* Stop tracing for good, so that the events leading to a failed
+ * assertion or a fault are kept for post-mortem analysis. */
+
+void freeze_trace(void)
+{
+    frozen = true;
+}
+
+/* Print the traced events, oldest first, one per line, as the cycle
+ * count, the event, its id and value (see timeline.c for a
+ * decoder).  Tracing is suspended while printing, so that the ring
+ * isn't overwritten under us. */
+
+void print_trace(void)
+{
+    const bool was_frozen = frozen;
+
+    frozen = true;
+
+    const uint32_t n = head < TRACE_SIZE ? head : TRACE_SIZE;
+
+    uprintf("# cycles, event, id, value\n");
+
+    for (uint32_t i = head - n; i != head; i++) {
+        const struct trace_record *r = &records[i % TRACE_SIZE];
+
+        uprintf("%u, %u, %u, %u\n", r->cycles, r->event, r->id, r->value);
+    }
+
+    frozen = was_frozen;
+}
@@ -0,0 +1,55 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <inttypes.h>
+
+/* The kinds of event traced, along with the meaning of their id and
+ * value.  Sections are those of the cycle profiler (see cycles.h),
+ * i.e. ISRs and callback chains, while actuator values are the
+ * trigger delay, as a fraction of the half-period, scaled to
+ * UINT16_MAX. */
+
+enum trace_event {
+    BEGIN_EVENT,                /* Section entered. */
+    END_EVENT,                  /* Section left. */
+    STAGE_EVENT,                /* Profile stage begun. */
+    MODE_EVENT,                 /* Mode selected on the panel. */
+    ACTUATOR_EVENT,             /* Actuator set, to value. */
+    ERROR_EVENT,                /* Sensor error, of kind value. */
+    FAULT_EVENT,                /* Fault, of exception number id. */
+    ASSERT_EVENT,               /* Assertion failed, on line value. */
+    CLOCK_EVENT,                /* Nothing traced for a while. */
+
+    TRACE_EVENTS
+};
+
+#if defined(TEST) || defined(HOST)
+#define trace(E, I, V) ((void)0)
+#define clock_trace() ((void)0)
+#else
+void trace(enum trace_event e, uint8_t id, uint16_t value);
+void clock_trace(void);
+#endif
+
+void set_trace_mask(uint32_t mask);
+uint32_t get_trace_mask(void);
+void freeze_trace(void);
+void print_trace(void);
+
+#endif
@@ -21,7 +21,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cycles.h"
+#include "format.h"
 #include "mk20dx.h"
+#include "trace.h"
 #include "uassert.h"
 #include "usb_private.h"
 
@@ -451,7 +454,7 @@ static void handle_control_transfer(uint8_t status)
     }
 }
 
-__attribute__((interrupt ("IRQ"))) void usb_isr(void)
+TIMED_ISR(usb_isr, USB_ISR)
 {
     if (USB0_ISTAT & USB_ISTAT_USBRST) {
         /* Reset the even/odd BDT toggle bits. */
@@ -729,80 +732,6 @@ int is_usb_rts()
     return line_state & LINE_STATE_RTS;
 }
 
-static void utostr(uint64_t n, unsigned int radix, int width, int precision)
-{
-    if (n >= radix || width > 1 || precision > 1) {
-        utostr(n / radix, radix, width - 1, precision - 1);
-    }
-
-    if (n == 0) {
-        write_usb(precision > 0 ? "0" : " ", 1, false);
-    } else {
-        n %= radix;
-        const char c = n + (n < 10 ? '0' : 'a' - 10);
-        write_usb(&c, 1, false);
-    }
-}
-
-static void itostr(int64_t n, unsigned int radix, int width, int precision)
-{
-    if (n < 0) {
-        write_usb("-", 1, false);
-        utostr((uint64_t)(-n), radix, width, precision);
-    } else {
-        utostr((uint64_t)n, radix, width, precision);
-    }
-}
-
-static void ftostr(double n, int width, int precision)
-{
-    if (isnan(n)) {
-        write_usb("nan", 3, true);
-        return;
-    }
-
-    {
-        const int i = isinf(n);
-
-        if (i) {
-            write_usb(i > 0 ? "+" : "-", 1, false);
-            write_usb("inf", 3, true);
-            return;
-        }
-    }
-
-    if (n < 0) {
-        write_usb("-", 1, false);
-
-        utostr(-n, 10, width - precision - 1 - (n < 0), 1);
-    } else {
-        utostr(n, 10, width - precision - 1 - (n < 0), 1);
-    }
-
-    const double f = fmod(n, 1);
-
-    if (f == 0) {
-        return;
-    }
-
-    write_usb(".", 1, false);
-
-    {
-        int i;
-        uint32_t u;
-
-        for (u = fabs(f * pow(10, precision)), i = 0;
-             u > 0 && u % 10 == 0;
-             u /= 10, i++);
-
-        if (!u) {
-            write_usb("0", 1, true);
-        } else {
-            utostr(u, 10, 0, precision - i);
-        }
-    }
-}
-
 int uprintf(const char *format, ...)
 {
     va_list ap;
@@ -921,6 +850,8 @@ int uprintf(const char *format, ...)
 void __attribute__((noreturn)) _uassert(
     const char *msg, int line, const char *func)
 {
+    trace(ASSERT_EVENT, 0, line);
+    freeze_trace();
     set_led();
 
     disable_all_interrupts();
@@ -931,6 +862,11 @@ void __attribute__((noreturn)) _uassert(
 
     uprintf(msg, line, func);
 
+    /* The device can't be talked to after this, so dump the events
+     * leading up to the failure right away. */
+
+    print_trace();
+
     disable_interrupt(USB0_IRQ);
 
     __asm__ volatile ("bkpt #251");
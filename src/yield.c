@@ -0,0 +1,287 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stddef.h>
+
+#include "usb.h"
+#include "yield.h"
+
+/* When a shot ends on yield, coffee keeps dripping into the cup after
+ * the pump stops: the puck drains, the drops already in flight land
+ * and the mass reading itself lags.  We model the mass still to
+ * come as proportional to the yield rate at the time the pump is
+ * stopped, i.e. as the yield rate continuing for a "drip lag".  Each
+ * shot's outcome is logged and used to refine the lag. */
+
+#define DRIP_LAG 1.5            /* s */
+#define MAX_DRIP_LAG 5.0        /* s */
+#define LEARNING_RATE 0.3
+
+/* Consider the mass settled, once the yield rate has stayed below
+ * SETTLED_RATE for SETTLED_TIME, or after SETTLE_TIMEOUT in any
+ * case.  Shots that ended at a rate below MIN_RATE tell us little
+ * about the lag. */
+
+#define SETTLED_RATE 0.05       /* g/s */
+#define SETTLED_TIME 1.0        /* s */
+#define SETTLE_TIMEOUT 10.0     /* s */
+#define MIN_RATE 0.5            /* g/s */
+
+#define N_YIELDS 8
+
+static struct yield {
+    double t, target, trigger, rate, lag, final;
+} yields[N_YIELDS];
+
+static size_t yield_count;
+static double drip_lag = DRIP_LAG, t_settled;
+static bool pending;
+
+double predict_yield(double m, double R)
+{
+    return isnan(R) || R < 0 ? m : m + drip_lag * R;
+}
+
+/* Record that the pump was stopped at time t, with mass m and yield
+ * rate R, aiming for a final mass target.  Triggers are ignored while
+ * the mass is still settling after the previous one. */
+
+void trigger_yield(double t, double target, double m, double R)
+{
+    struct yield *y = &yields[yield_count % N_YIELDS];
+
+    if (pending) {
+        return;
+    }
+
+    y->t = t;
+    y->target = target;
+    y->trigger = m;
+    y->rate = R;
+    y->lag = drip_lag;
+    y->final = NAN;
+
+    t_settled = NAN;
+    pending = true;
+}
+
+/* Track the mass after a trigger, until it settles.  The yield rate R
+ * must be the one the prediction used, so that the lag is learned
+ * for that signal.  Returns true once the final mass has been
+ * logged, or if there was no trigger. */
+
+bool settle_yield(double t, double m, double R)
+{
+    struct yield *y = &yields[yield_count % N_YIELDS];
+
+    if (!pending) {
+        return true;
+    }
+
+    if (!(fabs(R) < SETTLED_RATE)) {
+        t_settled = NAN;
+    } else if (isnan(t_settled)) {
+        t_settled = t;
+    }
+
+    if (t - y->t < SETTLE_TIMEOUT
+        && (isnan(t_settled) || t - t_settled < SETTLED_TIME)) {
+        return false;
+    }
+
+    y->final = m;
+    yield_count++;
+    pending = false;
+
+    if (y->rate >= MIN_RATE) {
+        const double lag = (y->final - y->trigger) / y->rate;
+
+        drip_lag = fmin(
+            fmax(drip_lag + LEARNING_RATE * (lag - drip_lag), 0),
+            MAX_DRIP_LAG);
+    }
+
+    return true;
+}
+
+void set_drip_lag(double lag)
+{
+    drip_lag = fmin(fmax(lag, 0), MAX_DRIP_LAG);
+}
+
+double get_drip_lag(void)
+{
+    return drip_lag;
+}
+
+#ifndef TEST
+void print_yields(void)
+{
+    const size_t n = yield_count;
+
+    for (size_t i = n > N_YIELDS ? n - N_YIELDS : 0; i < n; i++) {
+        const struct yield *y = &yields[i % N_YIELDS];
+
+        uprintf("%u, %.1f, %.1f, %.2f, %.3f, %.1f, %.1f\n",
+                i,
+                (double)y->target,
+                (double)y->trigger,
+                (double)y->rate,
+                (double)y->lag,
+                (double)y->final,
+                (double)(y->final - y->target));
+    }
+}
+#endif
+
+#ifdef TEST
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "filter.h"
+
+/* Replay a set of synthetic shots, each with a different flow rate
+ * and puck, stopping at a target yield, either when the mass reading
+ * reaches it, or when the predicted final mass does. */
+
+#define STEP 1e-3
+#define TARGET 36.0             /* g */
+#define DRIP_STEPS 200          /* 0.2s */
+#define SHOTS 20
+#define SETTLED_SHOTS 5
+
+static double uniform(double a, double b)
+{
+    return a + (b - a) * rand() / RAND_MAX;
+}
+
+static double gaussian(double sigma)
+{
+    /* Via the Box-Muller transform. */
+
+    const double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    const double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+    return sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static double shoot(double Q, double tau, bool predictive)
+{
+    struct filter mass_filter = SINGLE_FILTER(0.03);
+    struct filter rate_filter = SINGLE_FILTER(0.1);
+
+    double drip[DRIP_STEPS] = {0}, cup = 0, R = Q;
+    bool pumping = true;
+
+    if (!predictive) {
+        set_drip_lag(0);
+    }
+
+    for (int j = 0; ; j++) {
+        const double t = j * STEP;
+
+        /* The puck drains exponentially once the pump stops. */
+
+        if (!pumping) {
+            R -= R / tau * STEP;
+        }
+
+        cup += drip[j % DRIP_STEPS];
+        drip[j % DRIP_STEPS] = R * STEP;
+
+        /* The load cell is read at 20Hz, the profile runs at
+         * 10Hz. */
+
+        if (j % 50 == 0) {
+            filter_sample(&mass_filter, cup + gaussian(0.1), t);
+
+            if (!isnan(mass_filter.dy)) {
+                filter_sample(
+                    &rate_filter, mass_filter.dy / mass_filter.dt, t);
+            }
+        }
+
+        if (j % 100 == 0 && !isnan(rate_filter.y)) {
+            const double m = mass_filter.y;
+            const double R_m = rate_filter.y;
+
+            if (pumping && predict_yield(m, R_m) >= TARGET) {
+                trigger_yield(t, TARGET, m, R_m);
+                pumping = false;
+            } else if (!pumping && settle_yield(t, m, R_m)) {
+                return m - TARGET;
+            }
+        }
+    }
+}
+
+int main(void)
+{
+    double e[2][SHOTS];
+
+    /* A second trigger, while the first is settling, must not replace
+     * it, or the lag would be learned from the wrong trigger mass. */
+
+    trigger_yield(0, TARGET, 30, 2);
+    trigger_yield(0.1, TARGET, 31, 2);
+    assert(!settle_yield(0.2, 31, 1));
+    assert(settle_yield(SETTLE_TIMEOUT, 33, 0));
+    assert(get_drip_lag() == DRIP_LAG);
+
+    for (int k = 0; k < 2; k++) {
+        srand(1);
+        set_drip_lag(DRIP_LAG);
+
+        for (int i = 0; i < SHOTS; i++) {
+            e[k][i] = shoot(uniform(1.5, 3), uniform(0.8, 1.2), k > 0);
+        }
+    }
+
+    printf("$data << end\n");
+
+    for (int i = 0; i < SHOTS; i++) {
+        printf("%d, %f, %f\n", i, e[0][i], e[1][i]);
+    }
+
+    printf("end\n");
+    printf("set datafile separator ','\n");
+    printf("plot $data using 1:2 with linespoints title 'Reactive', "
+           "$data using 1:3 with linespoints title 'Predictive'\n");
+    printf("set print '-'\n");
+
+    for (int k = 0; k < 2; k++) {
+        double b = 0, s = 0;
+
+        for (int i = SETTLED_SHOTS; i < SHOTS; i++) {
+            b += e[k][i];
+            s += e[k][i] * e[k][i];
+        }
+
+        b /= SHOTS - SETTLED_SHOTS;
+        s /= SHOTS - SETTLED_SHOTS;
+
+        printf("print '%s: mean error %f g, RMS error %f g'\n",
+               k ? "Predictive" : "Reactive", b, sqrt(s));
+    }
+
+    printf("print 'Learned drip lag: %f s'\n", get_drip_lag());
+    printf("pause mouse keypress \"Hit enter\"\n");
+
+    return 0;
+}
+#endif
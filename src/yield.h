@@ -0,0 +1,29 @@
+/* Copyright (C) 2024 Papavasileiou Dimitris
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef YIELD_H
+#define YIELD_H
+
+#include <stdbool.h>
+
+double predict_yield(double m, double R);
+void trigger_yield(double t, double target, double m, double R);
+bool settle_yield(double t, double m, double R);
+void set_drip_lag(double lag);
+double get_drip_lag(void);
+void print_yields(void);
+
+#endif